@@ -0,0 +1,240 @@
+/**
+ * 论文查重系统 - 分阶段性能基准
+ * 对 text/orig.txt 与每个 text/orig_0.8_* 组成的文档对，重复运行完整流程并分别计时：
+ * 读取、预处理、n-gram生成、求交集、求并集、释放，报告每个阶段的平均耗时、标准差、最小值、
+ * ns/字节 与 n-gram/秒，作为后续性能改动的对照基线。
+ *
+ * 构建与运行（需先按 plagiarism.h 中的说明生成 libplagiarism.a）：
+ *   gcc -O2 bench.c libplagiarism.a -pthread -lm -o bench
+ *   ./bench [重复次数] [文本目录]        默认重复20次，文本目录为 text
+ */
+#define _CRT_SECURE_NO_WARNINGS 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+
+#define DEFAULT_RUNS 20
+#define MAX_PATH_LENGTH 1024
+
+typedef enum
+{
+    BENCH_READ,
+    BENCH_NORMALIZE,
+    BENCH_NGRAM,
+    BENCH_INTERSECT,
+    BENCH_UNION,
+    BENCH_TEARDOWN,
+    BENCH_STAGES
+} BenchStage;
+
+static const char *const BENCH_STAGE_NAMES[BENCH_STAGES] = {"read", "normalize", "ngram", "intersect", "union", "teardown"};
+
+static const char *const VARIANTS[] = {
+    "orig_0.8_add.txt", "orig_0.8_del.txt", "orig_0.8_dis_1.txt", "orig_0.8_dis_10.txt", "orig_0.8_dis_15.txt",
+};
+
+/**
+ * 单调时钟的当前值（纳秒）
+ */
+static long long bench_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+/**
+ * 读取整个文件
+ * @return 文件内容（调用者负责释放），无法读取时返回NULL
+ */
+static char *read_file(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    size_t capacity = 65536;
+    char *data = (char *)malloc(capacity);
+    size_t got;
+    *length = 0;
+    while ((got = fread(data + *length, 1, capacity - *length, file)) > 0)
+    {
+        *length += got;
+        if (*length == capacity)
+        {
+            capacity *= 2;
+            data = (char *)realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+/**
+ * 对一个文档对完整运行一次流程，把各阶段耗时写入ns
+ * @return 相似度
+ */
+static float run_once(const char *paths[2], long long ns[BENCH_STAGES], long long *bytes, long long *grams)
+{
+    char *raw[2];
+    size_t raw_length[2];
+    char *text[2];
+    HashTable *ht[2];
+
+    long long start = bench_now();
+    for (int d = 0; d < 2; d++)
+    {
+        raw[d] = read_file(paths[d], &raw_length[d]);
+    }
+    ns[BENCH_READ] = bench_now() - start;
+
+    start = bench_now();
+    for (int d = 0; d < 2; d++)
+    {
+        size_t consumed = 0;
+        text[d] = (char *)malloc(raw_length[d] + 1);
+        text[d][normalize_block(raw[d], raw_length[d], text[d], &consumed, 1)] = '\0';
+    }
+    ns[BENCH_NORMALIZE] = bench_now() - start;
+
+    start = bench_now();
+    for (int d = 0; d < 2; d++)
+    {
+        ht[d] = create_hash_table(HASH_TABLE_SIZE);
+        generate_ngrams(text[d], ht[d]);
+    }
+    ns[BENCH_NGRAM] = bench_now() - start;
+
+    start = bench_now();
+    int intersection = get_intersection_count(ht[0], ht[1]);
+    ns[BENCH_INTERSECT] = bench_now() - start;
+
+    start = bench_now();
+    int union_count = get_union_count(ht[0], ht[1]);
+    ns[BENCH_UNION] = bench_now() - start;
+
+    *bytes = (long long)(raw_length[0] + raw_length[1]);
+    *grams = 0;
+    for (int d = 0; d < 2; d++)
+    {
+        long long positions = (long long)strlen(text[d]) - N_GRAM + 1;
+        *grams += positions > 0 ? positions : 0;
+    }
+
+    start = bench_now();
+    for (int d = 0; d < 2; d++)
+    {
+        free_hash_table(ht[d]);
+        free(text[d]);
+        free(raw[d]);
+    }
+    ns[BENCH_TEARDOWN] = bench_now() - start;
+
+    // get_union_count() 是两表计数之和，减去交集才是并集
+    return jaccard_from_counts(intersection, union_count - intersection);
+}
+
+/**
+ * 对一个文档对重复运行runs次并输出各阶段统计
+ * @return 0表示成功，-1表示文件无法读取
+ */
+static int bench_pair(const char *dir, const char *variant, int runs)
+{
+    char original[MAX_PATH_LENGTH];
+    char plagiarized[MAX_PATH_LENGTH];
+    snprintf(original, sizeof(original), "%s/orig.txt", dir);
+    snprintf(plagiarized, sizeof(plagiarized), "%s/%s", dir, variant);
+    const char *paths[2] = {original, plagiarized};
+
+    for (int d = 0; d < 2; d++)
+    {
+        size_t length;
+        char *data = read_file(paths[d], &length);
+        if (data == NULL)
+        {
+            printf("错误：无法打开文档: %s\n", paths[d]);
+            return -1;
+        }
+        free(data);
+    }
+
+    long long ns[BENCH_STAGES];
+    long long bytes = 0;
+    long long grams = 0;
+    double sum[BENCH_STAGES] = {0};
+    double squares[BENCH_STAGES] = {0};
+    long long best[BENCH_STAGES];
+
+    // 预热一次：把文件读进页缓存，让分配器进入稳定状态，不计入统计
+    float similarity = run_once(paths, ns, &bytes, &grams);
+    for (int s = 0; s < BENCH_STAGES; s++)
+    {
+        best[s] = -1;
+    }
+    for (int r = 0; r < runs; r++)
+    {
+        run_once(paths, ns, &bytes, &grams);
+        for (int s = 0; s < BENCH_STAGES; s++)
+        {
+            sum[s] += (double)ns[s];
+            squares[s] += (double)ns[s] * (double)ns[s];
+            best[s] = best[s] < 0 || ns[s] < best[s] ? ns[s] : best[s];
+        }
+    }
+
+    printf("\n文档对: orig.txt vs %s（%lld 字节，%lld 个n-gram，相似度 %.2f，重复 %d 次）\n", variant, bytes, grams, similarity, runs);
+    printf("%-10s %12s %12s %12s %10s %14s\n", "阶段", "平均(us)", "标准差(us)", "最小(us)", "ns/字节", "n-gram/秒");
+    double total = 0.0;
+    for (int s = 0; s < BENCH_STAGES; s++)
+    {
+        double mean = sum[s] / runs;
+        double variance = runs > 1 ? (squares[s] - sum[s] * sum[s] / runs) / (runs - 1) : 0.0;
+        double stddev = sqrt(variance > 0.0 ? variance : 0.0);
+        total += mean;
+        printf("%-10s %12.1f %12.1f %12.1f %10.2f %14.0f\n", BENCH_STAGE_NAMES[s], mean / 1e3, stddev / 1e3,
+               (double)best[s] / 1e3, mean / (double)bytes, mean > 0.0 ? (double)grams * 1e9 / mean : 0.0);
+    }
+    printf("%-10s %12.1f %12s %12s %10.2f %14.0f\n", "total", total / 1e3, "", "", total / (double)bytes,
+           total > 0.0 ? (double)grams * 1e9 / total : 0.0);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+    const char *dir = argc > 2 ? argv[2] : "text";
+    if (runs < 1)
+    {
+        printf("使用方法: %s [重复次数] [文本目录]\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (size_t v = 0; v < sizeof(VARIANTS) / sizeof(VARIANTS[0]); v++)
+    {
+        failed |= bench_pair(dir, VARIANTS[v], runs) != 0;
+    }
+    return failed ? 1 : 0;
+}
@@ -1,38 +1,24 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 
-// ==================== 被测试的函数声明 ====================
-#define MAX_FILE_SIZE 1000000
-#define N_GRAM 3
-#define MAX_NGRAMS 50000
-#define HASH_TABLE_SIZE 100003
-
-typedef struct NGramNode
-{
-    char gram[N_GRAM + 1];
-    int count;
-    struct NGramNode *next;
-} NGramNode;
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
-typedef struct
-{
-    NGramNode **table;
-    int size;
-} HashTable;
-
-void remove_punctuation(char *str);
-void to_lower_case(char *str);
-HashTable *create_hash_table(int size);
-void free_hash_table(HashTable *ht);
-unsigned int hash_function(const char *str, int table_size);
-void addhash(HashTable *ht, const char *gram);
-int get_intersection_count(HashTable *ht1, HashTable *ht2);
-int get_union_count(HashTable *ht1, HashTable *ht2);
-float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized);
-void generate_ngrams(const char *text, HashTable *ht);
+// ==================== 被测试的函数声明 ====================
+// 被测试的函数由计算库提供（见 plagiarism.h 与 index.h）
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+#include "index.h"
 
 // ==================== 测试统计 ====================
 typedef struct
@@ -351,231 +337,706 @@ void test_hash_table_counting()
     free_hash_table(ht);
 }
 
-// ==================== 主测试函数 ====================
-int main()
+// 生成确定性的测试文本（线性同余随机数，字母表很小以产生大量重复n-gram）
+static char *make_test_text(int len, unsigned int seed)
 {
-    printf("开始单元测试...\n");
-    printf("====================\n");
-
-    // 运行所有测试用例
-    test_remove_punctuation();
-    test_to_lower_case();
-    test_hash_table_creation();
-    test_hash_function();
-    test_ngram_generation();
-    test_short_text_ngram();
-    test_identical_similarity();
-    test_completely_different();
-    test_partial_similarity();
-    test_empty_text_similarity();
-    test_hash_table_counting();
-
-    // 输出测试结果
-    printf("\n====================\n");
-    printf("测试完成！\n");
-    printf("总计测试: %d\n", test_stats.total);
-    printf("通过: %d\n", test_stats.passed);
-    printf("失败: %d\n", test_stats.failed);
-    printf("通过率: %.1f%%\n", (test_stats.passed * 100.0) / test_stats.total);
-
-    if (test_stats.failed == 0)
+    const char alphabet[] = "abcdefgh ";
+    char *text = (char *)malloc(len + 1);
+    for (int i = 0; i < len; i++)
     {
-        printf("🎉 所有测试通过！\n");
-        return 0;
-    }
-    else
-    {
-        printf("❌ 有测试失败，请检查代码\n");
-        return 1;
+        seed = seed * 1103515245u + 12345u;
+        text[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
     }
+    text[len] = '\0';
+    return text;
 }
 
-// ==================== 被测试函数的实现 ====================
-// 这里需要包含你的实际函数实现
-// 或者将你的main.c文件中的函数实现复制到这里
-
-void remove_punctuation(char *str)
+// 测试12: 多线程写入同一张并发计数表，计数与单线程哈希表逐项相同
+void test_concurrent_table()
 {
-    char *src = str;
-    char *dst = str;
-
-    while (*src)
+    printf("\n=== 测试并发计数表 ===\n");
+
+    int len = 8 * MIN_CHUNK_SIZE + 12345;
+    char *text = make_test_text(len, 3u);
+    HashTable *serial = create_hash_table(HASH_TABLE_SIZE);
+    generate_ngrams(text, serial);
+    long long serial_distinct = 0;
+    for (int i = 0; i < serial->size; i++)
     {
-        // 检查是否是ASCII字母、数字或空格
-        if (isalnum((unsigned char)*src) || *src == ' ')
+        for (NGramNode *node = serial->table[i]; node != NULL; node = node->next)
         {
-            *dst++ = *src;
-            src++;
+            serial_distinct++;
         }
-        // 检查是否是中文字符（UTF-8编码）
-        else if ((unsigned char)*src & 0x80)
+    }
+
+    int thread_counts[] = {1, 2, 4, 8};
+    int all_equal = 1;
+    for (int t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++)
+    {
+        ConcurrentTable *ct = create_concurrent_table(len - N_GRAM + 1);
+        generate_ngrams_concurrent(text, ct, thread_counts[t]);
+
+        int same = 1;
+        for (int i = 0; same && i < serial->size; i++)
         {
-            // 获取完整的UTF-8字符
-            unsigned char byte1 = (unsigned char)*src;
-            unsigned char byte2 = (unsigned char)*(src + 1);
-
-            // 常见中文标点符号的UTF-8编码范围
-            // 中文逗号：EFBC8C, 中文句号：EFBC8E, 中文感叹号：EFBC81
-            // 中文冒号：EFBC9A, 中文分号：EFBC9B, 中文问号：EFBC9F
-            if (byte1 == 0xEF && byte2 == 0xBC)
+            for (NGramNode *node = serial->table[i]; same && node != NULL; node = node->next)
             {
-                // 这是中文标点，跳过3个字节
-                src += 3;
-            }
-            else
-            {
-                // 这是中文字符，保留3个字节
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
+                same = concurrent_table_get(ct, pack_gram(node->gram)) == node->count;
             }
         }
-        else
+        long long distinct = 0;
+        for (size_t slot = 0; slot <= ct->mask; slot++)
+        {
+            distinct += atomic_load(&ct->keys[slot]) != 0;
+        }
+        if (!same || distinct != serial_distinct)
         {
-            // 跳过ASCII标点符号
-            src++;
+            all_equal = 0;
+            printf("  %d 个线程时计数不同\n", thread_counts[t]);
         }
+        free_concurrent_table(ct);
     }
-    *dst = '\0';
+
+    TEST_ASSERT(all_equal, "1/2/4/8线程写入的并发表与单线程哈希表的计数逐项相同");
+
+    free_hash_table(serial);
+    free(text);
 }
 
-void to_lower_case(char *str)
+// 测试13: 相似度只在最后做一次除法
+void test_jaccard_from_counts()
 {
-    for (int i = 0; str[i]; i++)
+    printf("\n=== 测试整数计数求相似度 ===\n");
+
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, jaccard_from_counts(0, 0), "并集为空时相似度为0.0");
+    TEST_ASSERT_EQUAL_FLOAT(0.745f, jaccard_from_counts(745, 1000), "交集745/并集1000");
+
+    // 超过2^24的计数若先各自转成float会丢失精度，结果应等于一次double除法后的舍入
+    float large = jaccard_from_counts(16777217LL, 16777219LL);
+    TEST_ASSERT(large == (float)(16777217.0 / 16777219.0), "大计数只舍入一次");
+}
+
+// 测试14: 并行生成n-gram的结果与线程数无关
+void test_parallel_thread_count()
+{
+    printf("\n=== 测试并行结果与线程数无关 ===\n");
+
+    int len = 8 * MIN_CHUNK_SIZE + 12345;
+    char *text_a = make_test_text(len, 1u);
+    char *text_b = make_test_text(len, 1u);
+
+    // 改写b的后半段，使两篇文档部分相同
+    char *tail = make_test_text(len / 2, 7u);
+    memcpy(text_b + len / 2, tail, len / 2);
+    free(tail);
+
+    HashTable *serial_a = create_hash_table(HASH_TABLE_SIZE);
+    HashTable *serial_b = create_hash_table(HASH_TABLE_SIZE);
+    generate_ngrams(text_a, serial_a);
+    generate_ngrams(text_b, serial_b);
+    int expected_intersection = get_intersection_count(serial_a, serial_b);
+    float expected = calculate_jaccard_similarity(serial_a, serial_b);
+
+    int thread_counts[] = {2, 3, 4, 8};
+    int all_equal = 1;
+    for (int t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++)
     {
-        if (str[i] >= 'A' && str[i] <= 'Z')
+        HashTable *ht_a = create_hash_table(HASH_TABLE_SIZE);
+        HashTable *ht_b = create_hash_table(HASH_TABLE_SIZE);
+        generate_ngrams_parallel(text_a, ht_a, thread_counts[t]);
+        generate_ngrams_parallel(text_b, ht_b, thread_counts[t]);
+
+        float similarity = calculate_jaccard_similarity(ht_a, ht_b);
+        if (get_intersection_count(ht_a, ht_b) != expected_intersection ||
+            memcmp(&similarity, &expected, sizeof(float)) != 0)
         {
-            str[i] = str[i] + 32;
+            all_equal = 0;
+            printf("  %d 个线程时结果不同: %.9f / %.9f\n", thread_counts[t], similarity, expected);
         }
+        free_hash_table(ht_a);
+        free_hash_table(ht_b);
     }
+
+    TEST_ASSERT(all_equal, "2/3/4/8线程的交集与相似度与单线程逐位相同");
+    TEST_ASSERT(expected > 0.0f && expected < 1.0f, "测试文本部分相似");
+
+    free_hash_table(serial_a);
+    free_hash_table(serial_b);
+    free(text_a);
+    free(text_b);
 }
 
-HashTable *create_hash_table(int size)
+// 测试15: 倒排索引写入索引文件后再映射回来，内容与原索引一致
+static const char *const INDEX_FIXTURES[] = {
+    "text/orig.txt", "text/orig_0.8_add.txt", "text/orig_0.8_del.txt",
+    "text/orig_0.8_dis_1.txt", "text/orig_0.8_dis_10.txt", "text/orig_0.8_dis_15.txt",
+};
+#define INDEX_FIXTURE_COUNT ((int)(sizeof(INDEX_FIXTURES) / sizeof(INDEX_FIXTURES[0])))
+#define TEST_INDEX_FILE "ceshi_index.tmp"
+
+/**
+ * 读入整个文件，返回以'\0'结尾的内容，size返回字节数；文件无法读取时返回NULL
+ */
+static char *read_test_file(const char *path, size_t *size)
 {
-    HashTable *ht = (HashTable *)malloc(sizeof(HashTable));
-    ht->size = size;
-    ht->table = (NGramNode **)calloc(size, sizeof(NGramNode *));
-    return ht;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = length >= 0 ? (char *)malloc((size_t)length + 1) : NULL;
+    if (data == NULL || fread(data, 1, (size_t)length, file) != (size_t)length)
+    {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    data[length] = '\0';
+    *size = (size_t)length;
+    return data;
 }
 
-void free_hash_table(HashTable *ht)
+/**
+ * 预处理样例文档、建并发计数表，再由这些表建立倒排索引
+ */
+static CorpusIndex *build_fixture_index(void)
 {
-    for (int i = 0; i < ht->size; i++)
+    ConcurrentTable *tables[INDEX_FIXTURE_COUNT];
+    long long totals[INDEX_FIXTURE_COUNT];
+    int count = 0;
+
+    for (int i = 0; i < INDEX_FIXTURE_COUNT; i++)
     {
-        NGramNode *current = ht->table[i];
-        while (current != NULL)
+        size_t size;
+        char *text = read_test_file(INDEX_FIXTURES[i], &size);
+        if (text == NULL)
         {
-            NGramNode *temp = current;
-            current = current->next;
-            free(temp);
+            break;
         }
+        to_lower_case(text);
+        remove_punctuation(text);
+        long long positions = (long long)strlen(text) - N_GRAM + 1;
+        totals[i] = positions > 0 ? positions : 0;
+        tables[i] = create_concurrent_table(totals[i]);
+        generate_ngrams_concurrent(text, tables[i], 2);
+        free(text);
+        count++;
     }
-    free(ht->table);
-    free(ht);
+    CorpusIndex *index = count == INDEX_FIXTURE_COUNT
+                             ? build_corpus_index(INDEX_FIXTURES, totals, (const ConcurrentTable *const *)tables, count)
+                             : NULL;
+    for (int i = 0; i < count; i++)
+    {
+        free_concurrent_table(tables[i]);
+    }
+    return index;
 }
 
-unsigned int hash_function(const char *str, int table_size)
+void test_corpus_index_file()
 {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *str++))
+    printf("\n=== 测试倒排索引文件 ===\n");
+
+    CorpusIndex *built = build_fixture_index();
+    TEST_ASSERT_NOT_NULL(built, "由text目录的样例建立索引");
+    if (built == NULL)
+    {
+        return;
+    }
+    TEST_ASSERT_EQUAL(INDEX_FIXTURE_COUNT, built->num_docs, "样例文档全部读入");
+    TEST_ASSERT_EQUAL(0, write_corpus_index(built, TEST_INDEX_FILE), "写入索引文件");
+    TEST_ASSERT(is_index_file(TEST_INDEX_FILE), "识别索引文件头");
+
+    CorpusIndex *mapped = map_corpus_index(TEST_INDEX_FILE);
+    TEST_ASSERT_NOT_NULL(mapped, "映射索引文件");
+    if (mapped != NULL)
+    {
+        int same_docs = mapped->num_docs == built->num_docs;
+        for (int i = 0; same_docs && i < built->num_docs; i++)
+        {
+            same_docs = mapped->totals[i] == built->totals[i] && strcmp(mapped->paths[i], built->paths[i]) == 0;
+        }
+        TEST_ASSERT(same_docs, "文档路径与n-gram总数一致");
+
+        int same_keys = mapped->num_keys == built->num_keys;
+        for (size_t k = 0; same_keys && k < built->num_keys; k++)
+        {
+            long long found = corpus_index_find(mapped, built->keys[k]);
+            same_keys = found == (long long)k && mapped->offsets[k + 1] == built->offsets[k + 1];
+            for (size_t p = built->offsets[k]; same_keys && p < built->offsets[k + 1]; p++)
+            {
+                same_keys = mapped->postings[p].doc == built->postings[p].doc && mapped->postings[p].count == built->postings[p].count;
+            }
+        }
+        TEST_ASSERT(same_keys, "每个n-gram都能查到，倒排表一致");
+        TEST_ASSERT_EQUAL(-1, (int)corpus_index_find(mapped, pack_gram("\x01\x01\x01")), "不存在的n-gram返回-1");
+        free_corpus_index(mapped);
+    }
+    free_corpus_index(built);
+    remove(TEST_INDEX_FILE);
+}
+
+/**
+ * 把data写入测试索引文件后映射，返回映射是否被拒绝
+ */
+static int corrupt_index_rejected(const char *data, size_t size)
+{
+    FILE *file = fopen(TEST_INDEX_FILE, "wb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    fwrite(data, 1, size, file);
+    fclose(file);
+    CorpusIndex *index = map_corpus_index(TEST_INDEX_FILE);
+    if (index != NULL)
+    {
+        free_corpus_index(index);
+        return 0;
+    }
+    return 1;
+}
+
+// 测试16: 损坏的索引文件在映射时被拒绝，而不是在查询时越界
+void test_corrupt_index_file()
+{
+    printf("\n=== 测试损坏的索引文件 ===\n");
+
+    CorpusIndex *built = build_fixture_index();
+    TEST_ASSERT(built != NULL && write_corpus_index(built, TEST_INDEX_FILE) == 0, "写入索引文件");
+    if (built == NULL)
+    {
+        return;
+    }
+    free_corpus_index(built);
+
+    size_t got = 0;
+    char *original = read_test_file(TEST_INDEX_FILE, &got);
+    TEST_ASSERT(original != NULL && got >= sizeof(IndexFileHeader), "读回索引文件");
+    if (original == NULL || got < sizeof(IndexFileHeader))
+    {
+        free(original);
+        return;
+    }
+    char *data = (char *)malloc(got);
+
+    IndexFileHeader header;
+    memcpy(&header, original, sizeof(header));
+    size_t postings = sizeof(header) + header.num_docs * sizeof(long long) + (header.num_docs + 1) * sizeof(unsigned long long) +
+                      header.num_keys * sizeof(unsigned long long) + (header.num_keys + 1) * sizeof(size_t);
+
+    memcpy(data, original, got);
+    data[0] ^= 0x20;
+    TEST_ASSERT(corrupt_index_rejected(data, got), "文件头标识错误时拒绝映射");
+
+    memcpy(data, original, got);
+    ((IndexFileHeader *)data)->num_keys += 1;
+    TEST_ASSERT(corrupt_index_rejected(data, got), "文件头中的段长度与文件大小不符时拒绝映射");
+
+    memcpy(data, original, got);
+    Posting *posting = (Posting *)(data + postings);
+    posting[header.num_postings / 2].doc = 1000000;
+    TEST_ASSERT(corrupt_index_rejected(data, got), "倒排项的文档序号越界时拒绝映射");
+
+    memcpy(data, original, got);
+    unsigned int *slots = (unsigned int *)(data + postings + header.num_postings * sizeof(Posting));
+    for (size_t s = 0; s < header.num_slots; s++)
     {
-        hash = ((hash << 5) + hash) + c;
+        slots[s] = 1;
     }
-    return hash % table_size;
+    TEST_ASSERT(corrupt_index_rejected(data, got), "开放寻址表没有空槽时拒绝映射");
+
+    free(data);
+    free(original);
+    remove(TEST_INDEX_FILE);
 }
 
-void addhash(HashTable *ht, const char *gram)
+// 测试17: 阈值判定提前停止，但判定结果与先算出相似度再比较完全一致（哈希表、分区引擎与文档特征）
+void test_threshold_verdict()
 {
-    unsigned int index = hash_function(gram, ht->size);
-    NGramNode *current = ht->table[index];
-    while (current != NULL)
+    printf("\n=== 测试阈值判定 ===\n");
+
+    int len = 4 * MIN_CHUNK_SIZE + 777;
+    char *texts[2] = {make_test_text(len, 5u), make_test_text(len, 5u)};
+    char *tail = make_test_text(len / 3, 11u);
+    memcpy(texts[1] + len / 2, tail, len / 3);
+    free(tail);
+
+    HashTable *ht[2];
+    PartitionedGrams *parts[2];
+    long long totals[2];
+    int bits = choose_partition_bits(len);
+    for (int d = 0; d < 2; d++)
     {
-        if (strcmp(current->gram, gram) == 0)
+        totals[d] = (long long)strlen(texts[d]) - N_GRAM + 1;
+        ht[d] = create_hash_table(HASH_TABLE_SIZE);
+        generate_ngrams(texts[d], ht[d]);
+        parts[d] = scatter_grams(texts[d], bits, 2);
+    }
+    PlagProfile *profiles[2] = {plag_profile_create(texts[0], strlen(texts[0])), plag_profile_create(texts[1], strlen(texts[1]))};
+    float exact = calculate_jaccard_similarity(ht[0], ht[1]);
+    float exact_parts = partitioned_jaccard_similarity(parts[0], parts[1], 2);
+    TEST_ASSERT(exact == exact_parts && exact == plag_compare(profiles[0], profiles[1]) && exact > 0.0f && exact < 1.0f,
+                "三种实现的精确相似度相同且部分相似");
+
+    // 除了均匀分布的阈值，还要覆盖恰好等于精确值及其两侧相邻的float
+    float thresholds[] = {0.0f, 0.1f, 0.3f, 0.5f, 0.7f, 0.9f, 1.0f, exact, nextafterf(exact, 0.0f), nextafterf(exact, 1.0f)};
+    int all_agree = 1;
+    for (int t = 0; t < (int)(sizeof(thresholds) / sizeof(thresholds[0])); t++)
+    {
+        int expected = exact >= thresholds[t];
+        int by_hash = hash_table_threshold(ht[0], ht[1], totals[0], totals[1], thresholds[t]);
+        int by_hash_swapped = hash_table_threshold(ht[1], ht[0], totals[1], totals[0], thresholds[t]);
+        int by_parts = partitioned_threshold(parts[0], parts[1], 2, thresholds[t]);
+        int by_profile = profile_threshold(profiles[0], profiles[1], thresholds[t]);
+        int many[2] = {-1, -1};
+        profile_threshold_many(profiles[0], (const PlagProfile *const *)profiles, 2, thresholds[t], many, 2);
+        if (by_hash != expected || by_hash_swapped != expected || by_parts != expected || by_profile != expected ||
+            many[0] != (thresholds[t] <= 1.0f) || many[1] != expected)
         {
-            current->count++;
-            return;
+            all_agree = 0;
+            printf("  阈值 %.9f：精确 %d，哈希表 %d/%d，分区 %d，特征 %d/%d\n", thresholds[t], expected, by_hash, by_hash_swapped,
+                   by_parts, by_profile, many[1]);
         }
-        current = current->next;
-    }
-    NGramNode *new_node = (NGramNode *)malloc(sizeof(NGramNode));
-    strncpy(new_node->gram, gram, N_GRAM);
-    new_node->gram[N_GRAM] = '\0';
-    new_node->count = 1;
-    new_node->next = ht->table[index];
-    ht->table[index] = new_node;
+    }
+    TEST_ASSERT(all_agree, "各实现的阈值判定都等于 精确值 >= 阈值");
+
+    for (int d = 0; d < 2; d++)
+    {
+        free_hash_table(ht[d]);
+        free_partitioned_grams(parts[d]);
+        plag_profile_free(profiles[d]);
+        free(texts[d]);
+    }
 }
 
-int get_intersection_count(HashTable *ht1, HashTable *ht2)
+/**
+ * 按抽样比例rate给两篇文本建抽样表并估计相似度
+ */
+static SimilarityEstimate sample_estimate(char *texts[2], double rate)
 {
-    int intersection = 0;
-    for (int i = 0; i < ht1->size; i++)
+    unsigned int limit = sample_limit(rate);
+    ConcurrentTable *tables[2];
+    for (int d = 0; d < 2; d++)
     {
-        NGramNode *current = ht1->table[i];
-        while (current != NULL)
+        tables[d] = create_sample_table((long long)strlen(texts[d]) - N_GRAM + 1, limit);
+        generate_ngrams_sampled(texts[d], tables[d], 2, limit);
+    }
+    SimilarityEstimate estimate = sampled_jaccard_similarity(tables[0], tables[1], rate);
+    free_concurrent_table(tables[0]);
+    free_concurrent_table(tables[1]);
+    return estimate;
+}
+
+// 测试18: 抽样比例为1时结果与精确值相同，抽样时置信区间包含精确值
+void test_sampled_similarity()
+{
+    printf("\n=== 测试哈希抽样估计 ===\n");
+
+    // 大字母表让不同n-gram足够多，抽样才有意义
+    int len = 4 * MIN_CHUNK_SIZE;
+    char *texts[2] = {(char *)malloc(len + 1), (char *)malloc(len + 1)};
+    unsigned int seed = 9u;
+    for (int i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        texts[0][i] = texts[1][i] = (char)('0' + (seed >> 16) % 64);
+    }
+    for (int i = len / 3; i < len / 2; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        texts[1][i] = (char)('0' + (seed >> 16) % 64);
+    }
+    texts[0][len] = texts[1][len] = '\0';
+
+    HashTable *ht[2];
+    for (int d = 0; d < 2; d++)
+    {
+        ht[d] = create_hash_table(HASH_TABLE_SIZE);
+        generate_ngrams(texts[d], ht[d]);
+    }
+    float exact = calculate_jaccard_similarity(ht[0], ht[1]);
+
+    SimilarityEstimate full = sample_estimate(texts, 1.0);
+    TEST_ASSERT(full.exact && full.error == 0.0 && memcmp(&full.similarity, &exact, sizeof(float)) == 0,
+                "抽样比例为1时与精确值逐位相同");
+
+    double rates[] = {0.5, 0.2, 0.05};
+    int bracketed = 1;
+    for (int r = 0; r < (int)(sizeof(rates) / sizeof(rates[0])); r++)
+    {
+        SimilarityEstimate estimate = sample_estimate(texts, rates[r]);
+        if (estimate.exact || estimate.error <= 0.0 || fabs((double)estimate.similarity - (double)exact) > estimate.error)
         {
-            unsigned int index = hash_function(current->gram, ht2->size);
-            NGramNode *temp = ht2->table[index];
-            while (temp != NULL)
-            {
-                if (strcmp(current->gram, temp->gram) == 0)
-                {
-                    intersection += (current->count < temp->count) ? current->count : temp->count;
-                    break;
-                }
-                temp = temp->next;
-            }
-            current = current->next;
+            bracketed = 0;
+            printf("  抽样比例 %.2f：估计 %.4f ± %.4f，精确值 %.4f\n", rates[r], estimate.similarity, estimate.error, exact);
         }
     }
-    return intersection;
+    TEST_ASSERT(bracketed, "抽样估计的置信区间包含精确值");
+
+    for (int d = 0; d < 2; d++)
+    {
+        free_hash_table(ht[d]);
+        free(texts[d]);
+    }
 }
 
-int get_union_count(HashTable *ht1, HashTable *ht2)
+// 测试19: 文档特征接口与哈希表实现结果一致，且不修改调用者的缓冲区
+void test_profile_api()
 {
-    int union_count = 0;
-    for (int i = 0; i < ht1->size; i++)
+    printf("\n=== 测试文档特征接口 ===\n");
+
+    TEST_ASSERT_EQUAL(PLAG_ABI_VERSION, plag_abi_version(), "库与头文件的接口版本一致");
+
+    // 原始文本含大写字母和全角标点，特征接口应与 预处理→哈希表 的结果相同
+    int len = 3 * 65536 + 777;
+    char *raw_a = make_test_text(len, 3u);
+    char *raw_b = make_test_text(len, 3u);
+    char *tail = make_test_text(len / 3, 11u);
+    memcpy(raw_b + len / 3, tail, len / 3);
+    free(tail);
+    memcpy(raw_a + 100, "ABC，DEF。", strlen("ABC，DEF。"));
+    char *saved_a = strdup(raw_a);
+
+    PlagProfile *a = plag_profile_create(raw_a, strlen(raw_a));
+    PlagProfile *b = plag_profile_create(raw_b, strlen(raw_b));
+    TEST_ASSERT_NOT_NULL(a, "从缓冲区创建特征");
+    TEST_ASSERT(strcmp(saved_a, raw_a) == 0, "创建特征不修改调用者的缓冲区");
+
+    char *text_a = strdup(raw_a);
+    char *text_b = strdup(raw_b);
+    to_lower_case(text_a);
+    remove_punctuation(text_a);
+    to_lower_case(text_b);
+    remove_punctuation(text_b);
+    HashTable *ht_a = create_hash_table(HASH_TABLE_SIZE);
+    HashTable *ht_b = create_hash_table(HASH_TABLE_SIZE);
+    generate_ngrams(text_a, ht_a);
+    generate_ngrams(text_b, ht_b);
+    float expected = calculate_jaccard_similarity(ht_a, ht_b);
+
+    TEST_ASSERT(plag_profile_grams(a) == (long long)strlen(text_a) - N_GRAM + 1, "特征的n-gram总数正确");
+    TEST_ASSERT_EQUAL_FLOAT(expected, plag_compare(a, b), "特征比较与哈希表计算结果一致");
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, plag_compare(a, a), "相同特征相似度为1.0");
+
+    const PlagProfile *many[3] = {a, b, a};
+    float scores[3] = {0};
+    TEST_ASSERT_EQUAL(0, plag_compare_many(b, many, 3, scores, 2), "批量比较成功");
+    TEST_ASSERT(scores[0] == plag_compare(b, a) && scores[1] == 1.0f && scores[2] == scores[0], "批量比较与逐一比较结果相同");
+
+    PlagProfile *empty = plag_profile_create("", 0);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, plag_compare(empty, a), "空文档相似度为0.0");
+
+    plag_profile_free(empty);
+    plag_profile_free(a);
+    plag_profile_free(b);
+    free_hash_table(ht_a);
+    free_hash_table(ht_b);
+    free(text_a);
+    free(text_b);
+    free(saved_a);
+    free(raw_a);
+    free(raw_b);
+}
+
+// 测试20: 各SIMD内核（及标量版）逐个窗口与 hash_gram()、pack_gram()+gram_key_hash() 的结果相同
+// 文本取0-255全部字节，覆盖DJB2的符号扩展和打包键的无符号扩展；窗口数取遍各内核的整组与尾部
+typedef void (*Djb2Kernel)(const char *text, int count, unsigned int out[]);
+typedef void (*KeyKernel)(const char *text, int count, unsigned long long keys[], unsigned int hashes[]);
+
+static int check_djb2_kernel(Djb2Kernel kernel, const char *text, int len)
+{
+    unsigned int *out = (unsigned int *)malloc(len * sizeof(unsigned int));
+    int same = 1;
+    for (int count = 0; same && count <= len - N_GRAM + 1; count += count < 64 ? 1 : 997)
     {
-        NGramNode *current = ht1->table[i];
-        while (current != NULL)
+        kernel(text, count, out);
+        for (int i = 0; same && i < count; i++)
         {
-            union_count += current->count;
-            current = current->next;
+            same = out[i] % HASH_TABLE_SIZE == hash_gram(text + i, HASH_TABLE_SIZE) &&
+                   out[i] % 2147483647u == hash_gram(text + i, 2147483647);
         }
     }
-    for (int i = 0; i < ht2->size; i++)
+    free(out);
+    return same;
+}
+
+static int check_key_kernel(KeyKernel kernel, const char *text, int len)
+{
+    unsigned long long *keys = (unsigned long long *)malloc(len * sizeof(unsigned long long));
+    unsigned int *hashes = (unsigned int *)malloc(len * sizeof(unsigned int));
+    int same = 1;
+    for (int count = 0; same && count <= len - N_GRAM + 1; count += count < 64 ? 1 : 997)
     {
-        NGramNode *current = ht2->table[i];
-        while (current != NULL)
+        kernel(text, count, keys, hashes);
+        for (int i = 0; same && i < count; i++)
         {
-            union_count += current->count;
-            current = current->next;
+            unsigned long long key = pack_gram(text + i);
+            same = keys[i] == key && hashes[i] == gram_key_hash(key);
         }
     }
-    return union_count;
+    free(hashes);
+    free(keys);
+    return same;
 }
 
-float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized)
+void test_simd_kernels()
 {
-    int intersection = get_intersection_count(ht_original, ht_plagiarized);
-    int union_total = get_union_count(ht_original, ht_plagiarized);
-    union_total -= intersection;
+    printf("\n=== 测试SIMD哈希内核 ===\n");
+
+    int len = 20000;
+    char *text = (char *)malloc(len + 16);
+    unsigned int seed = 11u;
+    for (int i = 0; i < len + 16; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        text[i] = (char)(seed >> 16);
+    }
+    int high = 0;
+    for (int i = 0; i < len; i++)
+    {
+        high += (unsigned char)text[i] >= 0x80;
+    }
+    TEST_ASSERT(high > len / 4, "测试文本含有大量 >=0x80 的字节");
+
+    TEST_ASSERT(check_djb2_kernel(djb2_block_scalar, text, len), "标量DJB2内核与 hash_gram() 相同");
+    TEST_ASSERT(check_key_kernel(key_block_scalar, text, len), "标量打包键内核与 pack_gram()+gram_key_hash() 相同");
+    TEST_ASSERT(check_key_kernel(hash_key_block, text, len), "hash_key_block() 与 pack_gram()+gram_key_hash() 相同");
+
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+    {
+        TEST_ASSERT(check_djb2_kernel(djb2_block_avx2, text, len), "AVX2 DJB2内核与 hash_gram() 相同");
+        TEST_ASSERT(check_key_kernel(key_block_avx2, text, len), "AVX2打包键内核与 pack_gram()+gram_key_hash() 相同");
+    }
+    else
+    {
+        printf("  处理器不支持AVX2，跳过AVX2内核\n");
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        TEST_ASSERT(check_djb2_kernel(djb2_block_avx512, text, len), "AVX-512 DJB2内核与 hash_gram() 相同");
+    }
+    else
+    {
+        printf("  处理器不支持AVX-512F，跳过AVX-512 DJB2内核\n");
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    {
+        TEST_ASSERT(check_key_kernel(key_block_avx512, text, len), "AVX-512打包键内核与 pack_gram()+gram_key_hash() 相同");
+    }
+    else
+    {
+        printf("  处理器不支持AVX-512DQ，跳过AVX-512打包键内核\n");
+    }
+#endif
 
-    if (union_total == 0)
+    unsigned int indices[256];
+    int same = 1;
+    hash_gram_block(text, 256, HASH_TABLE_SIZE, indices);
+    for (int i = 0; i < 256; i++)
     {
-        return 0.0f;
+        same = same && indices[i] == hash_gram(text + i, HASH_TABLE_SIZE);
     }
-    return (float)intersection / union_total;
+    TEST_ASSERT(same, "hash_gram_block() 的桶号与 hash_gram() 相同");
+
+    free(text);
 }
 
-void generate_ngrams(const char *text, HashTable *ht)
+#ifndef _WIN32
+#define TEST_SHRINK_FILE "ceshi_shrink.tmp"
+
+// 测试21: 文件在打开（fstat）之后被截短时，pread_all() 只保留实际读到的字节
+void test_pread_after_truncate()
 {
-    int len = strlen(text);
-    for (int i = 0; i <= len - N_GRAM; i++)
+    printf("\n=== 测试读取中被截短的文件 ===\n");
+
+    int len = 10000;
+    int shrunk = 3000;
+    char *text = make_test_text(len, 5u);
+    FILE *file = fopen(TEST_SHRINK_FILE, "wb");
+    TEST_ASSERT_NOT_NULL(file, "写入测试文件");
+    if (file == NULL)
     {
-        char gram[N_GRAM + 1];
-        strncpy(gram, text + i, N_GRAM);
-        gram[N_GRAM] = '\0';
-        addhash(ht, gram);
+        free(text);
+        return;
     }
-}
\ No newline at end of file
+    fwrite(text, 1, len, file);
+    fclose(file);
+
+    // 先照常读一次完整文件，从中间的偏移量接着读
+    char *buffer = (char *)malloc(len + 1);
+    int fd = open(TEST_SHRINK_FILE, O_RDWR);
+    size_t length = (size_t)len;
+    memcpy(buffer, text, 100);
+    TEST_ASSERT(pread_all(fd, buffer, 100, &length) == 0 && length == (size_t)len && memcmp(buffer, text, len) == 0,
+                "未截短时从偏移量处读满整个文件");
+
+    // 打开后、读取前截短：期望长度仍是截短前的文件长度
+    TEST_ASSERT(ftruncate(fd, shrunk) == 0, "打开后截短文件");
+    memset(buffer, 0, len + 1);
+    length = (size_t)len;
+    TEST_ASSERT(pread_all(fd, buffer, 0, &length) == 0, "截短后读取不报错");
+    TEST_ASSERT_EQUAL(shrunk, (int)length, "长度改为实际读到的字节数");
+    TEST_ASSERT(memcmp(buffer, text, shrunk) == 0, "读到的内容与截短后的文件相同");
+
+    close(fd);
+    remove(TEST_SHRINK_FILE);
+    free(buffer);
+    free(text);
+}
+#endif
+
+// ==================== 主测试函数 ====================
+int main()
+{
+    printf("开始单元测试...\n");
+    printf("====================\n");
+
+    // 运行所有测试用例
+    test_remove_punctuation();
+    test_to_lower_case();
+    test_hash_table_creation();
+    test_hash_function();
+    test_ngram_generation();
+    test_short_text_ngram();
+    test_identical_similarity();
+    test_completely_different();
+    test_partial_similarity();
+    test_empty_text_similarity();
+    test_hash_table_counting();
+    test_concurrent_table();
+    test_jaccard_from_counts();
+    test_parallel_thread_count();
+    test_corpus_index_file();
+    test_corrupt_index_file();
+    test_threshold_verdict();
+    test_sampled_similarity();
+    test_profile_api();
+    test_simd_kernels();
+#ifndef _WIN32
+    test_pread_after_truncate();
+#endif
+
+    // 输出测试结果
+    printf("\n====================\n");
+    printf("测试完成！\n");
+    printf("总计测试: %d\n", test_stats.total);
+    printf("通过: %d\n", test_stats.passed);
+    printf("失败: %d\n", test_stats.failed);
+    printf("通过率: %.1f%%\n", (test_stats.passed * 100.0) / test_stats.total);
+
+    if (test_stats.failed == 0)
+    {
+        printf("🎉 所有测试通过！\n");
+        return 0;
+    }
+    else
+    {
+        printf("❌ 有测试失败，请检查代码\n");
+        return 1;
+    }
+}
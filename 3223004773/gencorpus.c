@@ -0,0 +1,735 @@
+/**
+ * 论文查重系统 - 合成抄袭语料生成器
+ * 以若干篇种子文本为素材，批量生成"原文 + 抄袭版"文档族，并给出每个文档对的标准答案，
+ * 用于语料模式（--batch / --corpus / --all-pairs / --publish-store）的吞吐量与准确率测试。
+ *
+ * 每个文档族包含一篇原文和若干篇抄袭版：
+ *   原文由种子文本中随机抽取的句子拼接而成，长度约为 --doc-bytes 字节；
+ *   抄袭版对原文逐字（UTF-8字符）施加与 text/ 下样例相同的三类改动：
+ *     插入  在原文字符之后插入从种子文本中截取的1-8个字符，插入总量约为原文的 add 倍
+ *     删除  每个字符以概率 del 被删除
+ *     乱序  每个字符以概率 dis 与其后 --dis-span 个字符内的随机一个字符交换位置
+ *   每篇抄袭版的三个比例分别在 [0, 上限] 内均匀抽取，使标准答案覆盖较宽的相似度区间。
+ * 同样的参数和随机种子总是生成逐字节相同的语料，与线程数无关。
+ *
+ * 输出目录中：
+ *   f000000/orig.txt, f000000/v00.txt ...  各文档族
+ *   corpus.txt  全部文档的路径（--corpus / --all-pairs / --publish-store 的语料列表）
+ *   pairs.txt   每篇抄袭版与其原文组成的文档对（--batch 的文档对列表）
+ *   truth.txt   pairs.txt 中每个文档对的精确相似度，格式与 --batch 的输出文件相同，可直接比对
+ *   labels.txt  原文、抄袭版、精确相似度（6位小数）、实际使用的插入/删除/乱序比例
+ * 标准答案由本库对生成的文本精确计算，与查重程序默认引擎的结果一致；不同文档族之间的文档对没有标注。
+ *
+ * 构建与运行（需先按 plagiarism.h 中的说明生成 libplagiarism.a）：
+ *   gcc -O2 gencorpus.c libplagiarism.a -pthread -lm -o gencorpus
+ *   ./gencorpus --total-bytes 10G corpus text/orig.txt
+ */
+#define _CRT_SECURE_NO_WARNINGS 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+
+#define MAX_PATH_LENGTH 1024
+#define MAX_FRAGMENT_CHARS 8
+#define DEFAULT_FAMILIES 10
+#define DEFAULT_VARIANTS 5
+#define DEFAULT_DOC_BYTES 32768
+#define DEFAULT_RATE 0.2
+#define DEFAULT_DIS_SPAN 10
+
+/**
+ * 生成参数
+ */
+typedef struct
+{
+    const char *out_dir;
+    unsigned long long seed;
+    long long families;
+    int variants;
+    size_t doc_bytes;
+    double add;
+    double del;
+    double dis;
+    int dis_span;
+    int num_threads;
+} GenConfig;
+
+/**
+ * 种子素材
+ * 所有种子文本首尾相接保存在text中；chars为每个UTF-8字符的起始偏移，
+ * sentences为每个句子的首字符在chars中的下标（末尾另有一个哨兵）
+ */
+typedef struct
+{
+    char *text;
+    size_t length;
+    unsigned *chars;
+    size_t num_chars;
+    size_t *sentences;
+    size_t num_sentences;
+} SeedPool;
+
+/**
+ * 一个文档对的标准答案
+ */
+typedef struct
+{
+    float similarity;
+    float add;
+    float del;
+    float dis;
+} DocLabel;
+
+/**
+ * 生成线程的参数与私有缓冲区
+ * 文档在内存中表示为种子素材的字符偏移数组，写文件前再展开为字节
+ */
+typedef struct
+{
+    const GenConfig *config;
+    const SeedPool *pool;
+    atomic_llong *next;
+    DocLabel *labels;
+    unsigned *source;
+    size_t source_capacity;
+    unsigned *variant;
+    size_t variant_capacity;
+    char *bytes;
+    size_t bytes_capacity;
+    long long written;
+    int failed;
+} GenWorker;
+
+/**
+ * splitmix64：由一个64位状态产生均匀分布的随机数
+ */
+static unsigned long long next_random(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * [0, 1) 内均匀分布的随机数
+ */
+static double random_unit(unsigned long long *state)
+{
+    return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * [0, n) 内均匀分布的随机整数
+ */
+static size_t random_below(unsigned long long *state, size_t n)
+{
+    return (size_t)(random_unit(state) * (double)n);
+}
+
+/**
+ * UTF-8首字节对应的字符长度，非法字节按单字节处理
+ */
+static int utf8_length(unsigned char lead)
+{
+    if (lead < 0x80)
+    {
+        return 1;
+    }
+    if ((lead >> 5) == 0x6)
+    {
+        return 2;
+    }
+    if ((lead >> 4) == 0xE)
+    {
+        return 3;
+    }
+    if ((lead >> 3) == 0x1E)
+    {
+        return 4;
+    }
+    return 1;
+}
+
+/**
+ * 字符是否结束一个句子（换行、中英文句号、问号、感叹号）
+ */
+static int ends_sentence(const char *c, int length)
+{
+    if (length == 1)
+    {
+        return *c == '\n' || *c == '.' || *c == '!' || *c == '?';
+    }
+    return length == 3 && (memcmp(c, "。", 3) == 0 || memcmp(c, "！", 3) == 0 || memcmp(c, "？", 3) == 0);
+}
+
+/**
+ * 解析带 K/M/G 后缀的字节数
+ * @return 字节数，格式不正确时返回0
+ */
+static unsigned long long parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    double scale = 1.0;
+    if (*end == 'K' || *end == 'k')
+    {
+        scale = 1024.0;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        scale = 1024.0 * 1024.0;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        scale = 1024.0 * 1024.0 * 1024.0;
+    }
+    else if (*end != '\0')
+    {
+        return 0;
+    }
+    if (scale != 1.0 && end[1] != '\0')
+    {
+        return 0;
+    }
+    return value > 0.0 ? (unsigned long long)(value * scale) : 0;
+}
+
+/**
+ * 读取种子文本并切分为字符和句子；UTF-8 BOM会被跳过
+ * @return 0表示成功，-1表示文件无法读取或素材为空
+ */
+static int load_seed_pool(SeedPool *pool, char *const paths[], int count)
+{
+    memset(pool, 0, sizeof(SeedPool));
+    size_t capacity = 0;
+    for (int i = 0; i < count; i++)
+    {
+        FILE *file = fopen(paths[i], "rb");
+        if (file == NULL)
+        {
+            printf("错误：无法打开种子文本: %s\n", paths[i]);
+            return -1;
+        }
+        char block[65536];
+        size_t got;
+        size_t start = pool->length;
+        while ((got = fread(block, 1, sizeof(block), file)) > 0)
+        {
+            if (pool->length + got + 1 > capacity)
+            {
+                capacity = (pool->length + got + 1) * 2;
+                pool->text = (char *)realloc(pool->text, capacity);
+            }
+            memcpy(pool->text + pool->length, block, got);
+            pool->length += got;
+        }
+        fclose(file);
+        if (pool->length - start >= 3 && memcmp(pool->text + start, "\xEF\xBB\xBF", 3) == 0)
+        {
+            memmove(pool->text + start, pool->text + start + 3, pool->length - start - 3);
+            pool->length -= 3;
+        }
+        // 每篇种子文本末尾补一个换行，避免两篇文本的首尾拼成一个句子
+        if (pool->length > start && pool->text[pool->length - 1] != '\n')
+        {
+            pool->text[pool->length++] = '\n';
+        }
+    }
+    if (pool->length == 0)
+    {
+        printf("错误：种子文本为空\n");
+        return -1;
+    }
+    if (pool->length > 0xFFFFFFFFULL)
+    {
+        printf("错误：种子文本总量不能超过4GB\n");
+        return -1;
+    }
+
+    pool->chars = (unsigned *)malloc(pool->length * sizeof(unsigned));
+    pool->sentences = (size_t *)malloc((pool->length + 1) * sizeof(size_t));
+    int at_start = 1;
+    for (size_t i = 0; i < pool->length;)
+    {
+        int length = utf8_length((unsigned char)pool->text[i]);
+        if (i + length > pool->length)
+        {
+            length = 1;
+        }
+        if (at_start)
+        {
+            pool->sentences[pool->num_sentences++] = pool->num_chars;
+            at_start = 0;
+        }
+        pool->chars[pool->num_chars++] = (unsigned)i;
+        at_start = ends_sentence(pool->text + i, length);
+        i += length;
+    }
+    pool->sentences[pool->num_sentences] = pool->num_chars;
+    return 0;
+}
+
+static void free_seed_pool(SeedPool *pool)
+{
+    free(pool->text);
+    free(pool->chars);
+    free(pool->sentences);
+}
+
+/**
+ * 保证数组至少能容纳need个元素
+ */
+static void *ensure_capacity(void *data, size_t *capacity, size_t need, size_t element)
+{
+    if (need <= *capacity)
+    {
+        return data;
+    }
+    *capacity = need * 2;
+    return realloc(data, *capacity * element);
+}
+
+/**
+ * 从种子素材中随机抽取句子拼接成原文
+ * @return 原文的字符数
+ */
+static size_t build_source(GenWorker *worker, unsigned long long *rng)
+{
+    const SeedPool *pool = worker->pool;
+    size_t count = 0;
+    size_t bytes = 0;
+    while (bytes < worker->config->doc_bytes)
+    {
+        size_t s = random_below(rng, pool->num_sentences);
+        size_t first = pool->sentences[s];
+        size_t last = pool->sentences[s + 1];
+        worker->source = (unsigned *)ensure_capacity(worker->source, &worker->source_capacity, count + last - first, sizeof(unsigned));
+        for (size_t c = first; c < last; c++)
+        {
+            worker->source[count++] = pool->chars[c];
+            bytes += utf8_length((unsigned char)pool->text[pool->chars[c]]);
+        }
+    }
+    return count;
+}
+
+/**
+ * 对原文施加插入、删除和乱序，结果写入worker->variant
+ * @return 抄袭版的字符数
+ */
+static size_t build_variant(GenWorker *worker, size_t source_count, const DocLabel *rates, unsigned long long *rng)
+{
+    const SeedPool *pool = worker->pool;
+    // 插入片段平均 (1+MAX_FRAGMENT_CHARS)/2 个字符，按此换算每个字符之后发生插入的概率
+    double insert_probability = rates->add * 2.0 / (1.0 + MAX_FRAGMENT_CHARS);
+    size_t count = 0;
+
+    for (size_t i = 0; i < source_count; i++)
+    {
+        worker->variant = (unsigned *)ensure_capacity(worker->variant, &worker->variant_capacity, count + 1 + MAX_FRAGMENT_CHARS, sizeof(unsigned));
+        if (random_unit(rng) >= rates->del)
+        {
+            worker->variant[count++] = worker->source[i];
+        }
+        if (random_unit(rng) < insert_probability)
+        {
+            size_t length = 1 + random_below(rng, MAX_FRAGMENT_CHARS);
+            size_t start = random_below(rng, pool->num_chars);
+            for (size_t c = start; c < start + length && c < pool->num_chars; c++)
+            {
+                worker->variant[count++] = pool->chars[c];
+            }
+        }
+    }
+
+    int span = worker->config->dis_span;
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+        if (random_unit(rng) < rates->dis)
+        {
+            size_t limit = count - i - 1 < (size_t)span ? count - i - 1 : (size_t)span;
+            size_t j = i + 1 + random_below(rng, limit);
+            unsigned swap = worker->variant[i];
+            worker->variant[i] = worker->variant[j];
+            worker->variant[j] = swap;
+        }
+    }
+    return count;
+}
+
+/**
+ * 把字符偏移数组展开为字节
+ * @return 字节数
+ */
+static size_t render(GenWorker *worker, const unsigned *chars, size_t count)
+{
+    const char *text = worker->pool->text;
+    size_t length = 0;
+    worker->bytes = (char *)ensure_capacity(worker->bytes, &worker->bytes_capacity, count * 4, 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        int n = utf8_length((unsigned char)text[chars[i]]);
+        memcpy(worker->bytes + length, text + chars[i], n);
+        length += n;
+    }
+    return length;
+}
+
+static int write_document(const char *path, const char *data, size_t length)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        printf("错误：无法创建文件: %s\n", path);
+        return -1;
+    }
+    size_t done = fwrite(data, 1, length, file);
+    if (fclose(file) != 0 || done != length)
+    {
+        printf("错误：写入文件失败: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_directory(const char *path)
+{
+#ifdef _WIN32
+    int status = _mkdir(path);
+#else
+    int status = mkdir(path, 0777);
+#endif
+    if (status != 0 && errno != EEXIST)
+    {
+        printf("错误：无法创建目录: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void family_path(char *path, const GenConfig *config, long long family, int variant)
+{
+    if (variant < 0)
+    {
+        snprintf(path, MAX_PATH_LENGTH, "%s/f%06lld/orig.txt", config->out_dir, family);
+    }
+    else
+    {
+        snprintf(path, MAX_PATH_LENGTH, "%s/f%06lld/v%02d.txt", config->out_dir, family, variant);
+    }
+}
+
+/**
+ * 生成一个文档族：写出原文和全部抄袭版，并精确计算每个文档对的相似度
+ * 随机数状态只由随机种子和族编号决定，因此结果与线程数和调度顺序无关
+ */
+static int generate_family(GenWorker *worker, long long family)
+{
+    const GenConfig *config = worker->config;
+    char path[MAX_PATH_LENGTH];
+    unsigned long long rng = config->seed ^ ((unsigned long long)family * 0xD1B54A32D192ED03ULL);
+    next_random(&rng);
+
+    snprintf(path, sizeof(path), "%s/f%06lld", config->out_dir, family);
+    if (make_directory(path) != 0)
+    {
+        return -1;
+    }
+
+    size_t source_count = build_source(worker, &rng);
+    size_t length = render(worker, worker->source, source_count);
+    family_path(path, config, family, -1);
+    if (write_document(path, worker->bytes, length) != 0)
+    {
+        return -1;
+    }
+    worker->written += (long long)length;
+    PlagProfile *original = plag_profile_create(worker->bytes, length);
+
+    for (int v = 0; v < config->variants; v++)
+    {
+        DocLabel *label = &worker->labels[family * config->variants + v];
+        label->add = (float)(config->add * random_unit(&rng));
+        label->del = (float)(config->del * random_unit(&rng));
+        label->dis = (float)(config->dis * random_unit(&rng));
+
+        size_t count = build_variant(worker, source_count, label, &rng);
+        length = render(worker, worker->variant, count);
+        family_path(path, config, family, v);
+        if (write_document(path, worker->bytes, length) != 0)
+        {
+            plag_profile_free(original);
+            return -1;
+        }
+        worker->written += (long long)length;
+
+        PlagProfile *plagiarized = plag_profile_create(worker->bytes, length);
+        label->similarity = original != NULL && plagiarized != NULL ? plag_compare(original, plagiarized) : 0.0f;
+        plag_profile_free(plagiarized);
+    }
+    plag_profile_free(original);
+    return 0;
+}
+
+static void *gen_worker(void *arg)
+{
+    GenWorker *worker = (GenWorker *)arg;
+    long long family;
+    while (!worker->failed && (family = atomic_fetch_add(worker->next, 1)) < worker->config->families)
+    {
+        worker->failed = generate_family(worker, family) != 0;
+    }
+    return NULL;
+}
+
+/**
+ * 写出语料列表、文档对列表和标准答案
+ */
+static int write_lists(const GenConfig *config, const DocLabel *labels)
+{
+    const char *names[4] = {"corpus.txt", "pairs.txt", "truth.txt", "labels.txt"};
+    FILE *files[4];
+    char path[MAX_PATH_LENGTH];
+    char original[MAX_PATH_LENGTH];
+    int status = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", config->out_dir, names[i]);
+        files[i] = fopen(path, "w");
+        if (files[i] == NULL)
+        {
+            printf("错误：无法创建输出文件: %s\n", path);
+            status = -1;
+        }
+    }
+
+    for (long long f = 0; status == 0 && f < config->families; f++)
+    {
+        family_path(original, config, f, -1);
+        fprintf(files[0], "%s\n", original);
+        for (int v = 0; v < config->variants; v++)
+        {
+            const DocLabel *label = &labels[f * config->variants + v];
+            family_path(path, config, f, v);
+            fprintf(files[0], "%s\n", path);
+            fprintf(files[1], "%s\t%s\n", original, path);
+            fprintf(files[2], "%s\t%s\t%.2f\n", original, path, label->similarity);
+            fprintf(files[3], "%s\t%s\t%.6f\t%.4f\t%.4f\t%.4f\n", original, path, label->similarity, label->add, label->del, label->dis);
+        }
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (files[i] != NULL && fclose(files[i]) != 0)
+        {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+static void print_usage(const char *program)
+{
+    printf("使用方法: %s [选项] <输出目录> <种子文本>...\n", program);
+    printf("  --families 族数        文档族数量（默认%d）\n", DEFAULT_FAMILIES);
+    printf("  --variants 篇数        每族的抄袭版数量（默认%d）\n", DEFAULT_VARIANTS);
+    printf("  --doc-bytes 字节数     每篇原文的大致字节数（默认%d，可加K/M/G后缀）\n", DEFAULT_DOC_BYTES);
+    printf("  --total-bytes 字节数   语料总量，给出时据此推算族数（可加K/M/G后缀）\n");
+    printf("  --add 比例             插入比例上限（默认%.1f）\n", DEFAULT_RATE);
+    printf("  --del 比例             删除比例上限（默认%.1f）\n", DEFAULT_RATE);
+    printf("  --dis 比例             乱序比例上限（默认%.1f）\n", DEFAULT_RATE);
+    printf("  --dis-span 字符数      乱序时交换位置的最大距离（默认%d）\n", DEFAULT_DIS_SPAN);
+    printf("  --seed 随机种子        相同参数与种子生成相同的语料（默认1）\n");
+    printf("  --threads 线程数       默认使用全部CPU核心\n");
+}
+
+/**
+ * 解析 [0, 1] 内的比例参数
+ * @return 0表示成功，-1表示超出范围
+ */
+static int parse_rate(const char *text, double *rate)
+{
+    *rate = atof(text);
+    if (*rate < 0.0 || *rate > 1.0)
+    {
+        printf("错误：比例必须在 [0, 1] 之间: %s\n", text);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    GenConfig config = {NULL, 1, DEFAULT_FAMILIES, DEFAULT_VARIANTS, DEFAULT_DOC_BYTES, DEFAULT_RATE, DEFAULT_RATE, DEFAULT_RATE, DEFAULT_DIS_SPAN, 0};
+    unsigned long long total_bytes = 0;
+    int first_positional = argc;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--families") == 0 && i + 1 < argc)
+        {
+            config.families = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--variants") == 0 && i + 1 < argc)
+        {
+            config.variants = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--doc-bytes") == 0 && i + 1 < argc)
+        {
+            config.doc_bytes = (size_t)parse_size(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--total-bytes") == 0 && i + 1 < argc)
+        {
+            total_bytes = parse_size(argv[++i]);
+            if (total_bytes == 0)
+            {
+                printf("错误：无效的语料总量: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--add") == 0 && i + 1 < argc)
+        {
+            if (parse_rate(argv[++i], &config.add) != 0)
+            {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--del") == 0 && i + 1 < argc)
+        {
+            if (parse_rate(argv[++i], &config.del) != 0)
+            {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--dis") == 0 && i + 1 < argc)
+        {
+            if (parse_rate(argv[++i], &config.dis) != 0)
+            {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--dis-span") == 0 && i + 1 < argc)
+        {
+            config.dis_span = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            config.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            config.num_threads = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            first_positional = i;
+            break;
+        }
+    }
+
+    if (argc - first_positional < 2 || config.families < 1 || config.variants < 1 || config.doc_bytes == 0 || config.dis_span < 1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    config.out_dir = argv[first_positional];
+
+    SeedPool pool;
+    if (load_seed_pool(&pool, argv + first_positional + 1, argc - first_positional - 1) != 0)
+    {
+        free_seed_pool(&pool);
+        return 1;
+    }
+
+    // 抄袭版的长度约为原文的 (1 + add/2 - del/2) 倍（比例在 [0, 上限] 内均匀抽取）
+    if (total_bytes > 0)
+    {
+        double family_bytes = (double)config.doc_bytes * (1.0 + config.variants * (1.0 + config.add / 2.0 - config.del / 2.0));
+        config.families = (long long)((double)total_bytes / family_bytes) + 1;
+    }
+    if (config.num_threads <= 0)
+    {
+        config.num_threads = get_cpu_count();
+    }
+    if (config.num_threads > MAX_THREADS)
+    {
+        config.num_threads = MAX_THREADS;
+    }
+    if ((long long)config.num_threads > config.families)
+    {
+        config.num_threads = (int)config.families;
+    }
+
+    if (make_directory(config.out_dir) != 0)
+    {
+        free_seed_pool(&pool);
+        return 1;
+    }
+
+    DocLabel *labels = (DocLabel *)calloc((size_t)config.families * config.variants, sizeof(DocLabel));
+    GenWorker *workers = (GenWorker *)calloc(config.num_threads, sizeof(GenWorker));
+    atomic_llong next = 0;
+    struct timespec start;
+    struct timespec end;
+    timespec_get(&start, TIME_UTC);
+
+    for (int t = 0; t < config.num_threads; t++)
+    {
+        workers[t].config = &config;
+        workers[t].pool = &pool;
+        workers[t].next = &next;
+        workers[t].labels = labels;
+    }
+    run_parallel(gen_worker, workers, sizeof(GenWorker), config.num_threads);
+
+    int failed = 0;
+    long long written = 0;
+    for (int t = 0; t < config.num_threads; t++)
+    {
+        failed |= workers[t].failed;
+        written += workers[t].written;
+        free(workers[t].source);
+        free(workers[t].variant);
+        free(workers[t].bytes);
+    }
+    if (!failed)
+    {
+        failed = write_lists(&config, labels) != 0;
+    }
+    timespec_get(&end, TIME_UTC);
+
+    if (!failed)
+    {
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("已生成 %lld 个文档族、%lld 篇文档，共 %.1f MB，用时 %.1f 秒（%.1f MB/秒）\n", config.families,
+               config.families * (config.variants + 1), (double)written / 1048576.0, seconds,
+               seconds > 0.0 ? (double)written / 1048576.0 / seconds : 0.0);
+    }
+
+    free(workers);
+    free(labels);
+    free_seed_pool(&pool);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/**
+ * 语料倒排索引 - 由各文档的n-gram计数表建立倒排索引，写入索引文件与只读映射索引文件
+ * 接口说明见 index.h
+ */
+#define _CRT_SECURE_NO_WARNINGS 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAVE_PREAD 1
+#endif
+
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+#include "index.h"
+
+typedef struct
+{
+    unsigned long long key;
+    int doc;
+    int count;
+} IndexEntry;
+
+static int compare_index_entry(const void *a, const void *b)
+{
+    const IndexEntry *x = (const IndexEntry *)a;
+    const IndexEntry *y = (const IndexEntry *)b;
+    if (x->key != y->key)
+    {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->doc - y->doc;
+}
+
+/**
+ * 倒排索引占用的字节数：从索引文件打开时为整个文件（映射或读入）加路径指针数组
+ */
+size_t corpus_index_bytes(const CorpusIndex *index)
+{
+    size_t bytes = sizeof(CorpusIndex) + (size_t)(index->num_docs + 1) * sizeof(char *);
+    if (index->storage != NULL)
+    {
+        return bytes + index->storage_size;
+    }
+    for (int i = 0; i < index->num_docs; i++)
+    {
+        bytes += strlen(index->paths[i]) + 1;
+    }
+    return bytes + (size_t)(index->num_docs + 1) * sizeof(long long) + (index->num_keys + 1) * (sizeof(unsigned long long) + sizeof(size_t)) +
+           (index->offsets[index->num_keys] + 1) * sizeof(Posting) + (index->mask + 1) * sizeof(unsigned int);
+}
+
+/**
+ * 由各文档的并发计数表构建倒排索引，文档序号即在数组中的下标
+ * @param paths 每篇文档的路径
+ * @param totals 每篇文档的n-gram总数
+ * @param tables 每篇文档的n-gram计数表
+ * @param count 文档数量
+ * @return 新建的倒排索引
+ */
+CorpusIndex *build_corpus_index(const char *const paths[], const long long totals[], const ConcurrentTable *const tables[], int count)
+{
+    CorpusIndex *index = (CorpusIndex *)calloc(1, sizeof(CorpusIndex));
+    size_t entries = 0;
+
+    index->num_docs = count;
+    index->paths = (char **)malloc((count + 1) * sizeof(char *));
+    index->totals = (long long *)malloc((count + 1) * sizeof(long long));
+    for (int i = 0; i < count; i++)
+    {
+        for (size_t slot = 0; slot <= tables[i]->mask; slot++)
+        {
+            entries += atomic_load_explicit(&tables[i]->keys[slot], memory_order_relaxed) != 0;
+        }
+    }
+
+    // 收集所有 (键, 文档, 次数) 后按键排序，相同键的各项就是该键的倒排表
+    IndexEntry *all = (IndexEntry *)malloc((entries + 1) * sizeof(IndexEntry));
+    size_t n = 0;
+    for (int doc = 0; doc < count; doc++)
+    {
+        const ConcurrentTable *ct = tables[doc];
+        size_t len = strlen(paths[doc]);
+        index->paths[doc] = (char *)malloc(len + 1);
+        memcpy(index->paths[doc], paths[doc], len + 1);
+        index->totals[doc] = totals[doc];
+
+        for (size_t slot = 0; slot <= ct->mask; slot++)
+        {
+            unsigned long long key = atomic_load_explicit(&ct->keys[slot], memory_order_relaxed);
+            if (key != 0)
+            {
+                all[n].key = key;
+                all[n].doc = doc;
+                all[n].count = atomic_load_explicit(&ct->counts[slot], memory_order_relaxed);
+                n++;
+            }
+        }
+    }
+    qsort(all, n, sizeof(IndexEntry), compare_index_entry);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        index->num_keys += i == 0 || all[i].key != all[i - 1].key;
+    }
+    index->keys = (unsigned long long *)malloc((index->num_keys + 1) * sizeof(unsigned long long));
+    index->offsets = (size_t *)malloc((index->num_keys + 1) * sizeof(size_t));
+    index->postings = (Posting *)malloc((n + 1) * sizeof(Posting));
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == 0 || all[i].key != all[i - 1].key)
+        {
+            index->keys[k] = all[i].key;
+            index->offsets[k++] = i;
+        }
+        index->postings[i].doc = all[i].doc;
+        index->postings[i].count = all[i].count;
+    }
+    index->offsets[k] = n;
+    free(all);
+
+    size_t capacity = 16;
+    while (capacity < index->num_keys * 2)
+    {
+        capacity <<= 1;
+    }
+    index->slots = (unsigned int *)calloc(capacity, sizeof(unsigned int));
+    index->mask = capacity - 1;
+    for (size_t i = 0; i < index->num_keys; i++)
+    {
+        size_t slot = gram_key_hash(index->keys[i]) & index->mask;
+        while (index->slots[slot] != 0)
+        {
+            slot = (slot + 1) & index->mask;
+        }
+        index->slots[slot] = (unsigned int)(i + 1);
+    }
+    return index;
+}
+
+/**
+ * 在倒排索引中查找n-gram
+ * @param index 倒排索引
+ * @param key 打包后的键
+ * @return 键的序号，不存在时返回-1
+ */
+long long corpus_index_find(const CorpusIndex *index, unsigned long long key)
+{
+    size_t slot = gram_key_hash(key) & index->mask;
+
+    while (index->slots[slot] != 0)
+    {
+        size_t i = index->slots[slot] - 1;
+        if (index->keys[i] == key)
+        {
+            return (long long)i;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return -1;
+}
+
+/**
+ * 判断序号为key_index的n-gram是否出现在文档doc中（倒排表按文档序号有序，二分查找）
+ */
+int posting_has_doc(const CorpusIndex *index, long long key_index, int doc)
+{
+    size_t low = index->offsets[key_index];
+    size_t high = index->offsets[key_index + 1];
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (index->postings[mid].doc < doc)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low < index->offsets[key_index + 1] && index->postings[low].doc == doc;
+}
+
+/**
+ * 释放倒排索引
+ * @param index 要释放的倒排索引
+ */
+void free_corpus_index(CorpusIndex *index)
+{
+    if (index->storage != NULL)
+    {
+        // 从索引文件打开的索引：各段都在storage中，只有路径指针数组是单独分配的
+#ifdef HAVE_PREAD
+        if (index->mapped)
+        {
+            munmap(index->storage, index->storage_size);
+        }
+        else
+#endif
+        {
+            free(index->storage);
+        }
+        free(index->paths);
+        free(index);
+        return;
+    }
+    for (int i = 0; i < index->num_docs; i++)
+    {
+        free(index->paths[i]);
+    }
+    free(index->paths);
+    free(index->totals);
+    free(index->keys);
+    free(index->offsets);
+    free(index->postings);
+    free(index->slots);
+    free(index);
+}
+
+static const char INDEX_FILE_MAGIC[8] = {'N', 'G', 'R', 'A', 'M', 'I', 'D', 'X'};
+
+/**
+ * 把倒排索引写入索引文件
+ * 先写到 <文件>.tmp 再改名，正在使用旧文件的进程映射的仍是旧文件，不会读到写了一半的内容
+ * @param index 倒排索引
+ * @param path 索引文件路径
+ * @return 0表示成功，-1表示写入失败
+ */
+int write_corpus_index(const CorpusIndex *index, const char *path)
+{
+    size_t len = strlen(path);
+    char *temp = (char *)malloc(len + 5);
+    memcpy(temp, path, len);
+    memcpy(temp + len, ".tmp", 5);
+
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL)
+    {
+        free(temp);
+        return -1;
+    }
+
+    IndexFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.n_gram = N_GRAM;
+    header.num_docs = (unsigned long long)index->num_docs;
+    header.num_keys = index->num_keys;
+    header.num_postings = index->offsets[index->num_keys];
+    header.num_slots = index->mask + 1;
+
+    unsigned long long *path_offsets = (unsigned long long *)malloc((index->num_docs + 1) * sizeof(unsigned long long));
+    for (int i = 0; i < index->num_docs; i++)
+    {
+        path_offsets[i] = header.path_bytes;
+        header.path_bytes += strlen(index->paths[i]) + 1;
+    }
+    path_offsets[index->num_docs] = header.path_bytes;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(index->totals, sizeof(long long), index->num_docs, file) == (size_t)index->num_docs;
+    ok = ok && fwrite(path_offsets, sizeof(unsigned long long), index->num_docs + 1, file) == (size_t)index->num_docs + 1;
+    ok = ok && fwrite(index->keys, sizeof(unsigned long long), index->num_keys, file) == index->num_keys;
+    ok = ok && fwrite(index->offsets, sizeof(size_t), index->num_keys + 1, file) == index->num_keys + 1;
+    ok = ok && fwrite(index->postings, sizeof(Posting), header.num_postings, file) == header.num_postings;
+    ok = ok && fwrite(index->slots, sizeof(unsigned int), header.num_slots, file) == header.num_slots;
+    for (int i = 0; ok && i < index->num_docs; i++)
+    {
+        ok = fwrite(index->paths[i], 1, strlen(index->paths[i]) + 1, file) == strlen(index->paths[i]) + 1;
+    }
+    free(path_offsets);
+
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp, path) == 0;
+    if (!ok)
+    {
+        remove(temp);
+    }
+    free(temp);
+    return ok ? 0 : -1;
+}
+
+/**
+ * 逐项检查索引文件中的各段，保证查询时不会越界或陷入死循环：
+ * offsets从0开始单调不减并以倒排项总数结束；每个倒排表内文档序号严格递增且都在范围内、次数为正；
+ * slots中的序号不超过键数，且至少留有一个空槽（否则查找不存在的键时会一直探测下去）
+ * @return 1表示合法，0表示文件已损坏
+ */
+static int index_sections_valid(const CorpusIndex *index, size_t num_postings)
+{
+    for (int i = 0; i < index->num_docs; i++)
+    {
+        if (index->totals[i] < 0)
+        {
+            return 0;
+        }
+    }
+    if (index->offsets[0] != 0 || index->offsets[index->num_keys] != num_postings)
+    {
+        return 0;
+    }
+    for (size_t k = 0; k < index->num_keys; k++)
+    {
+        if (index->offsets[k] > index->offsets[k + 1])
+        {
+            return 0;
+        }
+        int previous = -1;
+        for (size_t p = index->offsets[k]; p < index->offsets[k + 1]; p++)
+        {
+            const Posting *posting = &index->postings[p];
+            if (posting->doc <= previous || posting->doc >= index->num_docs || posting->count <= 0)
+            {
+                return 0;
+            }
+            previous = posting->doc;
+        }
+    }
+
+    size_t used = 0;
+    for (size_t slot = 0; slot <= index->mask; slot++)
+    {
+        if (index->slots[slot] > index->num_keys)
+        {
+            return 0;
+        }
+        used += index->slots[slot] != 0;
+    }
+    return used <= index->mask;
+}
+
+/**
+ * 在一块完整的索引文件内容上建立索引视图（不复制数据），内容不合法时返回NULL
+ */
+static CorpusIndex *index_from_storage(char *data, size_t size)
+{
+    IndexFileHeader header;
+    if (size < sizeof(header))
+    {
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != 1 ||
+        header.n_gram != N_GRAM || header.num_slots == 0 || (header.num_slots & (header.num_slots - 1)) != 0 ||
+        header.num_docs > (unsigned long long)INT_MAX)
+    {
+        return NULL;
+    }
+
+    // 各段的起点；先用除法检查每段的元素数，避免乘法溢出
+    unsigned long long limit = size;
+    if (header.num_docs > limit / 16 || header.num_keys > limit / 16 || header.num_postings > limit / 8 ||
+        header.num_slots > limit / 4 || header.path_bytes > limit)
+    {
+        return NULL;
+    }
+    size_t totals = sizeof(header);
+    size_t path_offsets = totals + header.num_docs * sizeof(long long);
+    size_t keys = path_offsets + (header.num_docs + 1) * sizeof(unsigned long long);
+    size_t offsets = keys + header.num_keys * sizeof(unsigned long long);
+    size_t postings = offsets + (header.num_keys + 1) * sizeof(size_t);
+    size_t slots = postings + header.num_postings * sizeof(Posting);
+    size_t paths = slots + header.num_slots * sizeof(unsigned int);
+    if (paths > size || size - paths != header.path_bytes ||
+        (header.path_bytes > 0 && data[size - 1] != '\0'))
+    {
+        return NULL;
+    }
+
+    CorpusIndex *index = (CorpusIndex *)calloc(1, sizeof(CorpusIndex));
+    const unsigned long long *path_offset = (const unsigned long long *)(data + path_offsets);
+    index->num_docs = (int)header.num_docs;
+    index->paths = (char **)malloc((header.num_docs + 1) * sizeof(char *));
+    for (unsigned long long i = 0; i < header.num_docs; i++)
+    {
+        if (path_offset[i] >= header.path_bytes)
+        {
+            free(index->paths);
+            free(index);
+            return NULL;
+        }
+        index->paths[i] = data + paths + path_offset[i];
+    }
+    index->totals = (long long *)(data + totals);
+    index->num_keys = header.num_keys;
+    index->keys = (unsigned long long *)(data + keys);
+    index->offsets = (size_t *)(data + offsets);
+    index->postings = (Posting *)(data + postings);
+    index->slots = (unsigned int *)(data + slots);
+    index->mask = header.num_slots - 1;
+    index->storage = data;
+    index->storage_size = size;
+    if (!index_sections_valid(index, header.num_postings))
+    {
+        free(index->paths);
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * 判断文件是否为索引文件（以索引文件头开头）
+ */
+int is_index_file(const char *path)
+{
+    char magic[sizeof(INDEX_FILE_MAGIC)];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, INDEX_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+/**
+ * 打开索引文件：支持mmap的平台直接只读映射，各段原地使用，不必重新建表；
+ * 其他平台读入内存。两种方式都会先顺序校验一遍各段，损坏的文件返回NULL
+ * @param path 索引文件路径
+ * @return 倒排索引，文件无法打开或内容不合法时返回NULL
+ */
+CorpusIndex *map_corpus_index(const char *path)
+{
+#ifdef HAVE_PREAD
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    CorpusIndex *index = index_from_storage(data, size);
+    if (index == NULL)
+    {
+        munmap(data, size);
+        return NULL;
+    }
+    index->mapped = 1;
+    return index;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_size <= 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+    size_t size = 0;
+    char *data = (char *)malloc((size_t)file_size);
+    size = fread(data, 1, (size_t)file_size, file);
+    fclose(file);
+    CorpusIndex *index = size == (size_t)file_size ? index_from_storage(data, size) : NULL;
+    if (index == NULL)
+    {
+        free(data);
+    }
+    return index;
+#endif
+}
@@ -0,0 +1,69 @@
+/**
+ * 语料倒排索引 - 常驻查重服务使用的倒排索引与索引文件
+ * 与计算库一起编入静态库 libplagiarism.a（构建方式见 plagiarism.h），依赖计算库的内部接口，不随动态库导出。
+ */
+#ifndef INDEX_H
+#define INDEX_H
+
+#ifndef PLAGIARISM_INTERNAL
+#define PLAGIARISM_INTERNAL 1
+#endif
+#include "plagiarism.h"
+
+/**
+ * 倒排表中的一项：文档序号与该n-gram在文档中出现的次数
+ */
+typedef struct
+{
+    int doc;
+    int count;
+} Posting;
+
+/**
+ * 语料倒排索引（常驻服务使用）
+ * keys按键值升序排列，第i个键的倒排表为 postings[offsets[i], offsets[i+1])，表内按文档序号升序；
+ * slots是由键查序号的开放寻址表，存 序号+1，0表示空槽
+ * 从索引文件打开时storage为整个文件的内容（通常是只读映射），各数组直接指向其中
+ */
+typedef struct
+{
+    int num_docs;
+    char **paths;
+    long long *totals;
+    size_t num_keys;
+    unsigned long long *keys;
+    size_t *offsets;
+    Posting *postings;
+    unsigned int *slots;
+    size_t mask;
+    char *storage;
+    size_t storage_size;
+    int mapped;
+} CorpusIndex;
+
+/**
+ * 索引文件头，其后依次为：totals、路径偏移、keys、offsets、postings、slots、路径字符串
+ * 各段长度都是8字节的整数倍，因此映射到内存后每一段都自然对齐，可以直接当数组使用
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int n_gram;
+    unsigned long long num_docs;
+    unsigned long long num_keys;
+    unsigned long long num_postings;
+    unsigned long long num_slots;
+    unsigned long long path_bytes;
+} IndexFileHeader;
+
+CorpusIndex *build_corpus_index(const char *const paths[], const long long totals[], const ConcurrentTable *const tables[], int count);
+long long corpus_index_find(const CorpusIndex *index, unsigned long long key);
+int posting_has_doc(const CorpusIndex *index, long long key_index, int doc);
+size_t corpus_index_bytes(const CorpusIndex *index);
+void free_corpus_index(CorpusIndex *index);
+int write_corpus_index(const CorpusIndex *index, const char *path);
+int is_index_file(const char *path);
+CorpusIndex *map_corpus_index(const char *path);
+
+#endif
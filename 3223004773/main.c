@@ -6,371 +6,5365 @@
  * 输出: 相似度分数（0.00-1.00）
  */
 #define _CRT_SECURE_NO_WARNINGS 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 
-#define MAX_FILE_SIZE 1000000
-#define N_GRAM 3
-#define MAX_NGRAMS 50000
-#define HASH_TABLE_SIZE 100003
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#define HAVE_PREAD 1
+#define HAVE_UNIX_SOCKET 1
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS 1
+#endif
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#define HAVE_NUMA 1
+#endif
+
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+#include "index.h"
+
+#define READ_BLOCK_SIZE 65536
+#define PIPELINE_DEPTH 4
+#define SPLIT_SIZE (16 * MIN_CHUNK_SIZE)
+#define MAX_LINE_LENGTH 4096
+#define ANYTIME_MIN_BITS 6
+#define PARTITION_MIN_FILE_SIZE (1 << 20)
+#define EVALUATE_THRESHOLD 0.7f
+#define IO_QUEUE_DEPTH 64
+#define IO_THREADS 8
+#define MAX_NUMA_NODES 64
+#define SERVER_MAX_RESULTS 10
+#define SERVER_MAX_CONNECTIONS 256
+#define SERVER_MAX_REQUEST (64 << 20)
+#define SERVER_MAX_BATCH 32
+#define SERVER_BATCH_MEMORY (64 << 20)
+#define SERVER_BATCH_TEXT (4 << 20)
+#define SERVER_INTERACTIVE_QUEUE 256
+#define SERVER_BULK_QUEUE 64
+#define SERVER_INTERACTIVE_WEIGHT 8
+#define SERVER_BULK_NICE 10
+#define SERVER_DEADLINE_CHECK 256
+#define SERVER_DEADLINE_MIN_GRAMS 256
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+
+
+/**
+ * 有界块队列
+ * 读取线程把文件内容按块放入队列，处理线程取出后做预处理；
+ * 队列满时读取线程阻塞，保证内存占用不超过 PIPELINE_DEPTH 个块
+ */
+typedef struct
+{
+    char *blocks[PIPELINE_DEPTH];
+    size_t lengths[PIPELINE_DEPTH];
+    int head;
+    int count;
+    int finished;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} BlockQueue;
+
+/**
+ * 相似度计算引擎
+ * ENGINE_HASH 为原有的链地址哈希表；ENGINE_PARTITION 先按哈希高位把n-gram分散到多个
+ * 缓存大小的分区，再逐个分区建表比较；ENGINE_SAMPLE 只保留哈希值落在抽样范围内的n-gram，
+ * 给出带置信区间的估计值；ENGINE_AUTO 按文件大小自动选择
+ */
+typedef enum
+{
+    ENGINE_AUTO,
+    ENGINE_HASH,
+    ENGINE_PARTITION,
+    ENGINE_SAMPLE
+} Engine;
+
+/**
+ * 文档结构体
+ * 保存一篇文档在 读取→预处理→n-gram 流水线中的全部状态
+ */
+typedef struct
+{
+    const char *path;
+    FILE *file;
+    char *text;
+    size_t length;
+    size_t capacity;
+    HashTable *ht;
+    PartitionedGrams *parts;
+    ConcurrentTable *ct;
+    Engine engine;
+    int partition_bits;
+    unsigned int sample_limit;
+    int num_threads;
+    int status;
+    BlockQueue queue;
+} Document;
+
+/**
+ * 调度器任务：函数指针加参数
+ */
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct
+{
+    TaskFunc fn;
+    void *arg;
+} Task;
+
+/**
+ * 任务双端队列（环形数组，容量不足时自动扩容）
+ * 所属线程从尾部压入、弹出（后进先出，刚拆出的子任务数据还在缓存中）；
+ * 空闲线程从头部窃取（先进先出，窃取到的往往是粒度较大的早期任务）
+ */
+typedef struct
+{
+    Task *items;
+    int head;
+    int count;
+    int capacity;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+/**
+ * NUMA拓扑：每个节点的编号与CPU集合（读取 /sys/devices/system/node）
+ * 检测不到时视为只有一个节点，此时不绑定线程
+ */
+typedef struct
+{
+    int num_nodes;
+    int node_ids[MAX_NUMA_NODES];
+#ifdef HAVE_NUMA
+    cpu_set_t cpus[MAX_NUMA_NODES];
+#endif
+} NumaTopology;
+
+/**
+ * 工作窃取调度器
+ * 每个工作线程拥有一个任务队列，自己的队列空了就去别的线程队列里窃取任务，
+ * 因此一篇超大文档拆出的子任务会被所有空闲线程分担，直到作业结束都不会有核心闲置
+ */
+typedef struct
+{
+    TaskDeque *deques;
+    pthread_t *threads;
+    int num_workers;
+    const NumaTopology *topology;
+    int num_nodes;
+    int queued;
+    int active;
+    int next;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t idle;
+} Scheduler;
+
+/**
+ * 批量模式中的一篇文档
+ * 超大文档按SPLIT_SIZE拆成多个子任务，所有子任务直接写入同一张并发计数表
+ */
+typedef struct
+{
+    Document doc;
+    Scheduler *scheduler;
+    ConcurrentTable *ct;
+    struct CorpusChunk *chunks;
+    int num_chunks;
+    int node;
+} CorpusDoc;
+
+typedef struct CorpusChunk
+{
+    CorpusDoc *owner;
+    int start;
+    int end;
+} CorpusChunk;
+
+/**
+ * 批量模式中的一次两两比较
+ * 较大的比较同样按槽区间拆成子任务，最后一个完成的子任务按区间顺序汇总交集并计算相似度；
+ * threshold大于0时只判定相似度是否达到阈值，结果记在above中，各子任务共享bounds，结果确定后都提前结束
+ */
+typedef struct PairJob
+{
+    CorpusDoc *a;
+    CorpusDoc *b;
+    CorpusDoc *outer;
+    CorpusDoc *inner;
+    float similarity;
+    int valid;
+    float threshold;
+    ThresholdState bounds;
+    int above;
+    Scheduler *scheduler;
+    struct PairPart *parts;
+    int num_parts;
+    atomic_int remaining;
+} PairJob;
+
+typedef struct PairPart
+{
+    PairJob *job;
+    size_t slot_start;
+    size_t slot_end;
+    long long intersection;
+} PairPart;
+
+/**
+ * 批量作业：去重后的文档集合与待比较的文档对
+ */
+typedef struct
+{
+    CorpusDoc **docs;
+    int num_docs;
+    int doc_capacity;
+    CorpusDoc **index;
+    int index_size;
+    PairJob *pairs;
+    int num_pairs;
+    int pair_capacity;
+    NumaTopology topology;
+    int num_nodes;
+    int num_workers;
+    float threshold;
+} CorpusJob;
+
+/**
+ * 计时的处理阶段
+ */
+typedef enum
+{
+    STAGE_READ,
+    STAGE_NORMALIZE,
+    STAGE_NGRAM,
+    STAGE_INTERSECT,
+    STAGE_COUNT
+} Stage;
+
+/**
+ * 耗时直方图（HDR风格的对数-线性分桶，单位纳秒）
+ * 小于2^HISTOGRAM_SUB_BITS的值各占一桶；更大的值先按最高位分段，每段再线性分成2^HISTOGRAM_SUB_BITS个子桶，
+ * 桶宽不超过桶内数值的1/16；计数都是原子变量，各线程直接累加，无需加锁
+ */
+typedef struct
+{
+    atomic_ullong buckets[HISTOGRAM_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;
+} Histogram;
+
+/**
+ * 计数的硬件事件
+ */
+typedef enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_TLB_MISSES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+/**
+ * 一次计数器读数：每个事件的计数值，以及事件的启用时间和实际计数时间
+ */
+typedef struct
+{
+    unsigned long long value[PERF_EVENT_COUNT];
+    unsigned long long enabled[PERF_EVENT_COUNT];
+    unsigned long long running[PERF_EVENT_COUNT];
+} PerfSample;
+
+/**
+ * 内存统计的组件
+ * text为预处理后的文档文本，buffers为读取流水线的块缓冲区，其余为各引擎与索引的数据结构
+ */
+typedef enum
+{
+    MEM_TEXT,
+    MEM_BUFFERS,
+    MEM_HASH_BUCKETS,
+    MEM_HASH_NODES,
+    MEM_CONCURRENT,
+    MEM_PARTITIONS,
+    MEM_INDEX,
+    MEM_COMPONENT_COUNT
+} MemComponent;
+
+/**
+ * 命令行选项
+ */
+typedef struct
+{
+    int num_threads;
+    Engine engine;
+    int show_stats;
+    int batch_window_us;
+    float threshold;
+    double sample_rate;
+    int deadline_ms;
+} Options;
+
+// 函数声明
+void *process_document(void *arg);
+int process_documents(Document *docs, int count);
+void free_document(Document *doc);
+int load_document(Document *doc);
+long long get_file_size(const char *path);
+int detect_numa_topology(NumaTopology *topology);
+Scheduler *create_scheduler(int num_workers, const NumaTopology *topology);
+void scheduler_submit(Scheduler *s, TaskFunc fn, void *arg);
+void scheduler_submit_on(Scheduler *s, TaskFunc fn, void *arg, int node);
+void scheduler_wait(Scheduler *s);
+void free_scheduler(Scheduler *s);
+CorpusDoc *corpus_add_document(CorpusJob *job, const char *path);
+void corpus_add_pair(CorpusJob *job, CorpusDoc *a, CorpusDoc *b);
+int read_corpus_io_uring(CorpusJob *job, Scheduler *s);
+int read_corpus_pread(CorpusJob *job, Scheduler *s);
+int run_corpus_job(CorpusJob *job, int num_threads);
+void print_shard_layout(const CorpusJob *job);
+void free_corpus_job(CorpusJob *job);
+int run_batch_mode(const char *pairs_file, const char *output_file, const Options *options);
+int run_corpus_mode(const char *original_file, const char *list_file, const char *output_file, const Options *options);
+int run_all_pairs_mode(const char *list_file, const char *output_file, const Options *options);
+int histogram_bucket(unsigned long long value);
+unsigned long long histogram_bucket_limit(int bucket);
+long long metrics_start(void);
+long long metrics_elapsed(long long start);
+void metrics_add(Stage stage, long long ns);
+void metrics_record(Stage stage, long long start);
+void write_metrics(FILE *out);
+void enable_metrics(const char *path);
+void perf_begin(PerfSample *sample);
+void perf_end(Stage stage, const PerfSample *start);
+void perf_add_grams(long long grams);
+int enable_perf_counters(void);
+void enable_memory_accounting(long long budget);
+void memory_track(MemComponent component, Stage stage, long long bytes, long long allocations);
+long long hash_table_nodes(const HashTable *ht);
+void memory_track_hash_table(const HashTable *ht, int sign);
+void memory_track_concurrent_table(const ConcurrentTable *ct, int sign);
+void memory_track_partitioned_grams(const PartitionedGrams *pg, int sign);
+void memory_track_corpus_index(const CorpusIndex *index, int sign);
+long long peak_rss_bytes(void);
+void print_memory_stats(void);
+long long parse_byte_size(const char *text);
+const char *format_byte_size(long long bytes, char *buffer, size_t size);
+long long estimate_pair_memory(Engine engine, long long size_a, long long size_b, int num_threads, int partition_bits,
+                               unsigned int limit);
+int check_memory_budget(long long need, const char *what);
+int check_corpus_memory_budget(const CorpusJob *job);
+int run_build_index_mode(const char *list_file, const char *index_file, const Options *options);
+int run_publish_store_mode(const char *list_file, const char *name, const Options *options);
+int run_corpus_store_mode(const char *original_file, const char *name, const char *output_file, const Options *options);
+int run_evaluate_mode(const char *labels_file, const char *output_file, const Options *options);
+int run_serve_mode(const char *source, const char *socket_path, const Options *options);
+int threshold_check(Document docs[2], Engine engine, int num_threads, float threshold);
+int finish_threshold_check(Document docs[2], Engine engine, int num_threads, float threshold, const char *output_file);
+
+/**
+ * 程序主入口
+ * @param argc 命令行参数个数（包括程序名本身）
+ * @param argv 命令行参数数组（字符串数组）
+ * @return 程序退出状态码（0表示成功，非0表示失败）
+ */
+int main(int argc, char *argv[])
+{
+    long long started = monotonic_ns();
+    int num_threads = get_cpu_count();
+    Engine engine = ENGINE_AUTO;
+    int show_stats = 0;
+    int batch_window_us = 0;
+    int deadline_ms = 0;
+    float threshold = 0.0f;
+    double sample_rate = 0.0;
+    const char *metrics_path = NULL;
+    int perf_counters = 0;
+    long long memory_budget = 0;
+    const char *mode = NULL;
+    int expected = 3;
+    char *positional[3];
+    int positional_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "hash") == 0)
+            {
+                engine = ENGINE_HASH;
+            }
+            else if (strcmp(argv[i], "partition") == 0)
+            {
+                engine = ENGINE_PARTITION;
+            }
+            else
+            {
+                printf("错误：未知的计算引擎: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--batch-window-us") == 0 && i + 1 < argc)
+        {
+            batch_window_us = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc)
+        {
+            deadline_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+        {
+            threshold = (float)atof(argv[++i]);
+            if (threshold <= 0.0f || threshold > 1.0f)
+            {
+                printf("错误：阈值必须在 (0, 1] 之间: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+        {
+            sample_rate = atof(argv[++i]);
+            if (sample_rate <= 0.0 || sample_rate > 1.0)
+            {
+                printf("错误：抽样比例必须在 (0, 1] 之间: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            metrics_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            show_stats = 1;
+        }
+        else if (strcmp(argv[i], "--perf-counters") == 0)
+        {
+            perf_counters = 1;
+        }
+        else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc)
+        {
+            memory_budget = parse_byte_size(argv[++i]);
+            if (memory_budget <= 0)
+            {
+                printf("错误：无效的内存预算: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--all-pairs") == 0)
+        {
+            mode = argv[i];
+            expected = 2;
+        }
+        else if (strcmp(argv[i], "--corpus") == 0)
+        {
+            mode = argv[i];
+            expected = 3;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--build-index") == 0 ||
+                 strcmp(argv[i], "--publish-store") == 0)
+        {
+            mode = argv[i];
+            expected = 2;
+        }
+        else if (strcmp(argv[i], "--corpus-store") == 0)
+        {
+            mode = argv[i];
+            expected = 3;
+        }
+        else if (strcmp(argv[i], "--evaluate") == 0)
+        {
+            mode = argv[i];
+            expected = 2;
+        }
+        else if (strcmp(argv[i], "--remove-store") == 0)
+        {
+            mode = argv[i];
+            expected = 1;
+        }
+        else if (positional_count < 3)
+        {
+            positional[positional_count++] = argv[i];
+        }
+        else
+        {
+            positional_count++;
+        }
+    }
+
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+
+    if (positional_count != expected)
+    {
+        printf("错误: 参数数量不正确！\n");
+        printf("使用方法: %s [--threads 线程数] [--engine hash|partition] [--deadline-ms 毫秒|--threshold 阈值|--sample 比例] [--stats] [--memory-budget 字节数] <原文文件> <抄袭版文件> <输出文件>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--stats] [--threshold 阈值] --batch <文档对列表> <输出文件>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--stats] [--threshold 阈值] --corpus <原文文件> <语料列表> <输出文件>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--stats] [--threshold 阈值] --all-pairs <语料列表> <输出文件>\n", argv[0]);
+        printf("          %s [--threads 线程数] --build-index <语料列表> <索引文件>\n", argv[0]);
+        printf("          %s [--threads 线程数] --publish-store <语料列表> <共享内存名>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--threshold 阈值] --corpus-store <原文文件> <共享内存名> <输出文件>\n", argv[0]);
+        printf("          %s --remove-store <共享内存名>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--batch-window-us 微秒] [--deadline-ms 毫秒] --serve <语料列表|索引文件> <套接字路径>\n", argv[0]);
+        printf("          %s [--threads 线程数] [--threshold 判定线] [--sample 比例] --evaluate <标注文件> <报告文件>\n", argv[0]);
+        printf("各模式均可加 --metrics <统计文件>，退出时以Prometheus文本格式写出各阶段耗时直方图\n");
+        printf("各模式均可加 --perf-counters，退出时打印各阶段的周期、指令、缓存/分支/TLB未命中、IPC与每个n-gram的未命中次数\n");
+        printf("--stats 同时打印各组件的内存占用与峰值、进程峰值RSS和各阶段的分配次数\n");
+        printf("--memory-budget 字节数（可加K/M/G后缀）：预计超出预算时，两篇文档比较先尝试改用内存更少的分区引擎，仍超出或批量模式超出时直接报错退出\n");
+        printf("--deadline-ms 限时计算，来不及比较完时给出估计值及误差；服务模式下是每条查询的默认时限（从请求到达时算起）\n");
+        printf("--threshold 只判定重复率是否达到阈值，结果确定后立即停止比较\n");
+        printf("--sample 只按哈希抽取该比例的n-gram进行比较，给出估计值及95%%置信区间\n");
+        printf("--evaluate 用每种计算引擎比较标注文件（如 gencorpus 生成的 labels.txt）中的文档对，报告误差、精确率与召回率、吞吐量和内存\n");
+        return 1;
+    }
+    // 评估模式用 --threshold 作判定线、--sample 作抽样比例，两者可以同时给出
+    int evaluating = mode != NULL && strcmp(mode, "--evaluate") == 0;
+    if ((deadline_ms > 0) + (threshold > 0.0f) + (sample_rate > 0.0) > 1 && !evaluating)
+    {
+        printf("错误：--deadline-ms、--threshold 与 --sample 不能同时使用\n");
+        return 1;
+    }
+
+    Options options = {num_threads, engine, show_stats, batch_window_us > 0 ? batch_window_us : 0, threshold, sample_rate, deadline_ms};
+    if (metrics_path != NULL)
+    {
+        enable_metrics(metrics_path);
+    }
+    if (perf_counters)
+    {
+        enable_perf_counters();
+    }
+    if (show_stats || memory_budget > 0)
+    {
+        enable_memory_accounting(memory_budget);
+    }
+    if (mode != NULL && strcmp(mode, "--batch") == 0)
+    {
+        return run_batch_mode(positional[0], positional[1], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--corpus") == 0)
+    {
+        return run_corpus_mode(positional[0], positional[1], positional[2], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--all-pairs") == 0)
+    {
+        return run_all_pairs_mode(positional[0], positional[1], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--build-index") == 0)
+    {
+        return run_build_index_mode(positional[0], positional[1], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--publish-store") == 0)
+    {
+        return run_publish_store_mode(positional[0], positional[1], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--corpus-store") == 0)
+    {
+        return run_corpus_store_mode(positional[0], positional[1], positional[2], &options);
+    }
+    if (mode != NULL && strcmp(mode, "--remove-store") == 0)
+    {
+        if (plag_store_remove(positional[0]) != 0)
+        {
+            printf("错误：无法删除特征库: %s\n", positional[0]);
+            return 1;
+        }
+        return 0;
+    }
+    if (mode != NULL && strcmp(mode, "--serve") == 0)
+    {
+        return run_serve_mode(positional[0], positional[1], &options);
+    }
+    if (evaluating)
+    {
+        return run_evaluate_mode(positional[0], positional[1], &options);
+    }
+
+    // 两篇文档比较有多个退出点，内存统计在退出时打印
+    if (show_stats)
+    {
+        atexit(print_memory_stats);
+    }
+
+    char *original_file = positional[0];
+    char *plagiarized_file = positional[1];
+    char *output_file = positional[2];
+
+    // 两篇文档的 读取→预处理→n-gram生成 流水线并发执行
+    Document docs[2];
+    memset(docs, 0, sizeof(docs));
+    docs[0].path = original_file;
+    docs[1].path = plagiarized_file;
+    docs[0].num_threads = docs[1].num_threads = num_threads > 1 ? (num_threads + 1) / 2 : 1;
+
+    // 哈希表超出缓存后随机访问代价陡增，大文件改用分区引擎；分区数由较大的文件决定，两篇文档必须一致
+    long long largest = get_file_size(original_file);
+    long long size = get_file_size(plagiarized_file);
+    largest = size > largest ? size : largest;
+    int partition_bits = choose_partition_bits(largest);
+    if (deadline_ms > 0)
+    {
+        // 限时计算按分区逐个比较，到期时用已比较的分区估计相似度，分区不能太少
+        if (engine == ENGINE_HASH)
+        {
+            printf("错误：--deadline-ms 只能使用分区引擎\n");
+            return 1;
+        }
+        engine = ENGINE_PARTITION;
+        partition_bits = partition_bits > ANYTIME_MIN_BITS ? partition_bits : ANYTIME_MIN_BITS;
+    }
+    if (sample_rate > 0.0)
+    {
+        // 抽样估计只把抽中的n-gram写入并发表，建表和比较的代价都与抽样比例成正比
+        if (engine != ENGINE_AUTO)
+        {
+            printf("错误：--sample 不能与 --engine 同时使用\n");
+            return 1;
+        }
+        engine = ENGINE_SAMPLE;
+        docs[0].sample_limit = docs[1].sample_limit = sample_limit(sample_rate);
+    }
+    int engine_chosen = engine != ENGINE_AUTO;
+    if (engine == ENGINE_AUTO)
+    {
+        engine = largest >= PARTITION_MIN_FILE_SIZE ? ENGINE_PARTITION : ENGINE_HASH;
+    }
+    if (memory_budget > 0)
+    {
+        // 超出预算时，未指定引擎的精确计算改用每个n-gram只占8字节的分区引擎；仍然超出则在读取文件前报错
+        long long size_a = get_file_size(original_file);
+        long long need = estimate_pair_memory(engine, size_a, size, num_threads, partition_bits, docs[0].sample_limit);
+        if (need > memory_budget && engine == ENGINE_HASH && !engine_chosen)
+        {
+            long long partitioned = estimate_pair_memory(ENGINE_PARTITION, size_a, size, num_threads, partition_bits, 0);
+            if (partitioned < need)
+            {
+                char need_text[32];
+                printf("提示：哈希表引擎预计需要 %s 内存，超出预算，改用分区引擎\n", format_byte_size(need, need_text, sizeof(need_text)));
+                engine = ENGINE_PARTITION;
+                need = partitioned;
+            }
+        }
+        if (check_memory_budget(need, "比较") != 0)
+        {
+            return 1;
+        }
+    }
+    docs[0].engine = docs[1].engine = engine;
+    docs[0].partition_bits = docs[1].partition_bits = partition_bits;
+
+    process_documents(docs, 2);
+
+    if (docs[0].status != 0 || docs[1].status != 0)
+    {
+        if (docs[0].status != 0)
+        {
+            printf("错误：无法打开原文文件: %s\n", original_file);
+        }
+        else
+        {
+            printf("错误：无法打开抄袭版文件: %s\n", plagiarized_file);
+        }
+        free_document(&docs[0]);
+        free_document(&docs[1]);
+        return 1;
+    }
+
+    if (threshold > 0.0f)
+    {
+        return finish_threshold_check(docs, engine, num_threads, threshold, output_file);
+    }
+
+    // 计算Jaccard相似度
+    SimilarityEstimate estimate = {0.0f, 0.0, 1, 0, 0};
+    float similarity;
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    if (deadline_ms > 0)
+    {
+        estimate = anytime_jaccard_similarity(docs[0].parts, docs[1].parts, num_threads, started + deadline_ms * 1000000LL);
+        similarity = estimate.similarity;
+    }
+    else if (engine == ENGINE_SAMPLE)
+    {
+        estimate = sampled_jaccard_similarity(docs[0].ct, docs[1].ct, sample_rate);
+        similarity = estimate.similarity;
+    }
+    else if (engine == ENGINE_PARTITION)
+    {
+        similarity = partitioned_jaccard_similarity(docs[0].parts, docs[1].parts, num_threads);
+    }
+    else
+    {
+        similarity = calculate_jaccard_similarity(docs[0].ht, docs[1].ht);
+    }
+    metrics_record(STAGE_INTERSECT, start);
+    perf_end(STAGE_INTERSECT, &perf);
+
+    // 输出结果到文件
+    FILE *file = fopen(output_file, "w");
+    if (file == NULL)
+    {
+        printf("错误：无法创建输出文件: %s\n", output_file);
+        free_document(&docs[0]);
+        free_document(&docs[1]);
+        return 1;
+    }
+    // 限时计算和抽样估计时在结果后注明是精确值还是近似值（近似值附95%置信区间的半宽）
+    if (!estimate.exact)
+    {
+        fprintf(file, "%.2f approx %.2f\n", similarity, estimate.error);
+    }
+    else if (deadline_ms > 0 || sample_rate > 0.0)
+    {
+        fprintf(file, "%.2f exact\n", similarity);
+    }
+    else
+    {
+        fprintf(file, "%.2f\n", similarity);
+    }
+    fclose(file);
+
+    // 释放内存
+    free_document(&docs[0]);
+    free_document(&docs[1]);
+
+    if (!estimate.exact && sample_rate > 0.0)
+    {
+        printf("查重完成！重复率约为: %.2f%% ± %.2f%%（抽样比例 %.2f%%）\n", similarity * 100, estimate.error * 100, sample_rate * 100);
+        return 0;
+    }
+    if (!estimate.exact)
+    {
+        printf("查重完成！重复率约为: %.2f%% ± %.2f%%（%d 毫秒内比较了 %zu/%zu 个分区）\n", similarity * 100, estimate.error * 100,
+               deadline_ms, estimate.partitions_done, estimate.partitions);
+        return 0;
+    }
+    printf("查重完成！重复率: %.2f%%\n", similarity * 100);
+    return 0;
+}
+
+/**
+ * 获取文件大小
+ * @param path 文件路径
+ * @return 文件字节数，无法获取时返回-1
+ */
+long long get_file_size(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return -1;
+    }
+    return (long long)st.st_size;
+}
+
+/**
+ * 判定两篇已处理好的文档的重复率是否达到阈值，结果确定后立即停止比较
+ * @param docs 已处理好的两篇文档（哈希表或分区引擎）
+ * @return 1表示达到阈值，0表示未达到
+ */
+int threshold_check(Document docs[2], Engine engine, int num_threads, float threshold)
+{
+    if (engine == ENGINE_PARTITION)
+    {
+        return partitioned_threshold(docs[0].parts, docs[1].parts, num_threads, threshold);
+    }
+
+    long long total_a = (long long)docs[0].length - N_GRAM + 1;
+    long long total_b = (long long)docs[1].length - N_GRAM + 1;
+    return hash_table_threshold(docs[0].ht, docs[1].ht, total_a > 0 ? total_a : 0, total_b > 0 ? total_b : 0, threshold);
+}
+
+/**
+ * 阈值模式下的两篇文档比较：只判定重复率是否达到阈值，结果确定后立即停止
+ * @param docs 已处理好的两篇文档
+ * @return 程序退出状态码
+ */
+int finish_threshold_check(Document docs[2], Engine engine, int num_threads, float threshold, const char *output_file)
+{
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    int above = threshold_check(docs, engine, num_threads, threshold);
+    metrics_record(STAGE_INTERSECT, start);
+    perf_end(STAGE_INTERSECT, &perf);
+
+    free_document(&docs[0]);
+    free_document(&docs[1]);
+
+    FILE *file = fopen(output_file, "w");
+    if (file == NULL)
+    {
+        printf("错误：无法创建输出文件: %s\n", output_file);
+        return 1;
+    }
+    fprintf(file, "%s%.2f\n", above ? ">=" : "<", threshold);
+    fclose(file);
+
+    printf("查重完成！重复率%s %.2f%%\n", above ? "达到" : "低于", threshold * 100);
+    return 0;
+}
+
+/**
+ * 读取线程：按块读取文件放入有界队列，文件读完后标记队列结束
+ */
+static void *document_reader(void *arg)
+{
+    Document *doc = (Document *)arg;
+    BlockQueue *queue = &doc->queue;
+    int slot = 0;
+    long long read_ns = 0;
+    PerfSample perf;
+    perf_begin(&perf);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == PIPELINE_DEPTH)
+        {
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        slot = (queue->head + queue->count) % PIPELINE_DEPTH;
+        pthread_mutex_unlock(&queue->lock);
+
+        // 空槽只属于读取线程，读文件时无需持锁
+        long long start = metrics_start();
+        size_t got = fread(queue->blocks[slot], 1, READ_BLOCK_SIZE, doc->file);
+        read_ns += metrics_elapsed(start);
+
+        pthread_mutex_lock(&queue->lock);
+        if (got > 0)
+        {
+            queue->lengths[slot] = got;
+            queue->count++;
+        }
+        if (got < READ_BLOCK_SIZE)
+        {
+            queue->finished = 1;
+        }
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (got < READ_BLOCK_SIZE)
+        {
+            metrics_add(STAGE_READ, read_ns);
+            perf_end(STAGE_READ, &perf);
+            return NULL;
+        }
+    }
+}
+
+/**
+ * 把一块原始文本预处理后追加到文档文本末尾
+ * carry中保存上一块末尾被切断的多字节字符，处理时会先拼接在本块之前
+ */
+static void append_normalized(Document *doc, char *carry, size_t *carry_len, const char *block, size_t len, int last)
+{
+    memcpy(carry + *carry_len, block, len);
+    size_t total = *carry_len + len;
+
+    if (doc->length + total + 1 > doc->capacity)
+    {
+        size_t old_capacity = doc->capacity;
+        doc->capacity = (doc->length + total + 1) * 2;
+        doc->text = (char *)realloc(doc->text, doc->capacity);
+        memory_track(MEM_TEXT, STAGE_NORMALIZE, (long long)(doc->capacity - old_capacity), 1);
+    }
+
+    size_t consumed = 0;
+    doc->length += normalize_block(carry, total, doc->text + doc->length, &consumed, last);
+    *carry_len = total - consumed;
+    memmove(carry, carry + consumed, *carry_len);
+}
+
+/**
+ * 结束文档文本：处理残留字节并补上字符串结束符
+ */
+static void finish_text(Document *doc, char *carry, size_t carry_len)
+{
+    if (carry_len > 0)
+    {
+        append_normalized(doc, carry, &carry_len, carry, 0, 1);
+    }
+    if (doc->text == NULL)
+    {
+        doc->capacity = 1;
+        doc->text = (char *)malloc(1);
+        memory_track(MEM_TEXT, STAGE_NORMALIZE, 1, 1);
+    }
+    doc->text[doc->length] = '\0';
+}
+
+/**
+ * 处理线程：依次取出读取线程送来的块并预处理，追加到文档文本末尾
+ */
+static void normalize_document(Document *doc)
+{
+    BlockQueue *queue = &doc->queue;
+    char carry[READ_BLOCK_SIZE + 3];
+    size_t carry_len = 0;
+    long long normalize_ns = 0;
+    PerfSample perf;
+    perf_begin(&perf);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->finished)
+        {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        if (queue->count == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        int slot = queue->head;
+        int last = queue->finished && queue->count == 1;
+        pthread_mutex_unlock(&queue->lock);
+
+        long long start = metrics_start();
+        append_normalized(doc, carry, &carry_len, queue->blocks[slot], queue->lengths[slot], last);
+        normalize_ns += metrics_elapsed(start);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->head = (queue->head + 1) % PIPELINE_DEPTH;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    long long start = metrics_start();
+    finish_text(doc, carry, carry_len);
+    metrics_add(STAGE_NORMALIZE, normalize_ns + metrics_elapsed(start));
+    perf_end(STAGE_NORMALIZE, &perf);
+}
+
+/**
+ * 在当前线程中读取并预处理一篇文档（不生成n-gram）
+ * 供调度器中的任务使用，任务本身已经在工作线程里运行，不再另开读取线程
+ * @param doc 文档（path需预先填好）
+ * @return 0表示成功，-1表示文件无法打开
+ */
+int load_document(Document *doc)
+{
+    FILE *file = fopen(doc->path, "r");
+    if (file == NULL)
+    {
+        doc->status = -1;
+        return -1;
+    }
+
+    char *block = (char *)malloc(READ_BLOCK_SIZE);
+    char *carry = (char *)malloc(READ_BLOCK_SIZE + 3);
+    memory_track(MEM_BUFFERS, STAGE_READ, 2 * READ_BLOCK_SIZE + 3, 2);
+    size_t carry_len = 0;
+    size_t got;
+    long long read_ns = 0;
+    long long normalize_ns = 0;
+
+    PerfSample perf;
+    for (;;)
+    {
+        long long start = metrics_start();
+        perf_begin(&perf);
+        got = fread(block, 1, READ_BLOCK_SIZE, file);
+        perf_end(STAGE_READ, &perf);
+        read_ns += metrics_elapsed(start);
+        if (got == 0)
+        {
+            break;
+        }
+        start = metrics_start();
+        perf_begin(&perf);
+        append_normalized(doc, carry, &carry_len, block, got, got < READ_BLOCK_SIZE);
+        perf_end(STAGE_NORMALIZE, &perf);
+        normalize_ns += metrics_elapsed(start);
+    }
+    long long start = metrics_start();
+    perf_begin(&perf);
+    finish_text(doc, carry, carry_len);
+    perf_end(STAGE_NORMALIZE, &perf);
+    metrics_add(STAGE_READ, read_ns);
+    metrics_add(STAGE_NORMALIZE, normalize_ns + metrics_elapsed(start));
+
+    free(carry);
+    free(block);
+    memory_track(MEM_BUFFERS, STAGE_READ, -(2 * READ_BLOCK_SIZE + 3), 0);
+    fclose(file);
+    doc->status = 0;
+    return 0;
+}
+
+/**
+ * 单篇文档的完整流水线：读取线程与预处理并行，随后多线程生成n-gram
+ * 可直接作为线程入口使用，结果保存在doc中，doc->status非0表示文件无法打开
+ * @param arg 指向Document的指针
+ * @return 总是返回NULL
+ */
+void *process_document(void *arg)
+{
+    Document *doc = (Document *)arg;
+    BlockQueue *queue = &doc->queue;
+
+    doc->file = fopen(doc->path, "r");
+    if (doc->file == NULL)
+    {
+        doc->status = -1;
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        queue->blocks[i] = (char *)malloc(READ_BLOCK_SIZE);
+    }
+    memory_track(MEM_BUFFERS, STAGE_READ, PIPELINE_DEPTH * READ_BLOCK_SIZE, PIPELINE_DEPTH);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, document_reader, doc) == 0)
+    {
+        normalize_document(doc);
+        pthread_join(reader, NULL);
+    }
+    else
+    {
+        // 无法创建读取线程时，先读完再处理
+        document_reader(doc);
+        normalize_document(doc);
+    }
+
+    fclose(doc->file);
+    doc->file = NULL;
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        free(queue->blocks[i]);
+        queue->blocks[i] = NULL;
+    }
+    memory_track(MEM_BUFFERS, STAGE_READ, -PIPELINE_DEPTH * READ_BLOCK_SIZE, 0);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    if (doc->engine == ENGINE_PARTITION)
+    {
+        doc->parts = scatter_grams(doc->text, doc->partition_bits, doc->num_threads);
+        memory_track_partitioned_grams(doc->parts, 1);
+    }
+    else if (doc->engine == ENGINE_SAMPLE)
+    {
+        doc->ct = create_sample_table((long long)doc->length - N_GRAM + 1, doc->sample_limit);
+        memory_track_concurrent_table(doc->ct, 1);
+        generate_ngrams_sampled(doc->text, doc->ct, doc->num_threads, doc->sample_limit);
+    }
+    else
+    {
+        doc->ht = create_hash_table(HASH_TABLE_SIZE);
+        generate_ngrams_parallel(doc->text, doc->ht, doc->num_threads);
+        memory_track_hash_table(doc->ht, 1);
+    }
+    metrics_record(STAGE_NGRAM, start);
+    perf_end(STAGE_NGRAM, &perf);
+    perf_add_grams((long long)doc->length - N_GRAM + 1);
+    doc->status = 0;
+    return NULL;
+}
+
+/**
+ * 并发处理多篇文档，每篇文档各占一条流水线
+ * @param docs 文档数组（path与num_threads需预先填好）
+ * @param count 文档数量
+ * @return 成功处理的文档数
+ */
+int process_documents(Document *docs, int count)
+{
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    int ok = 0;
+
+    for (int base = 0; base < count; base += MAX_THREADS)
+    {
+        int batch = count - base < MAX_THREADS ? count - base : MAX_THREADS;
+
+        for (int i = 0; i < batch; i++)
+        {
+            started[i] = pthread_create(&threads[i], NULL, process_document, &docs[base + i]) == 0;
+            if (!started[i])
+            {
+                process_document(&docs[base + i]);
+            }
+        }
+        for (int i = 0; i < batch; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(threads[i], NULL);
+            }
+            if (docs[base + i].status == 0)
+            {
+                ok++;
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * 释放文档占用的文本和哈希表
+ * @param doc 要释放的文档
+ */
+void free_document(Document *doc)
+{
+    if (doc->text != NULL)
+    {
+        memory_track(MEM_TEXT, STAGE_NORMALIZE, -(long long)doc->capacity, 0);
+    }
+    free(doc->text);
+    doc->text = NULL;
+    doc->capacity = 0;
+    if (doc->ht != NULL)
+    {
+        memory_track_hash_table(doc->ht, -1);
+        free_hash_table(doc->ht);
+        doc->ht = NULL;
+    }
+    if (doc->parts != NULL)
+    {
+        memory_track_partitioned_grams(doc->parts, -1);
+        free_partitioned_grams(doc->parts);
+        doc->parts = NULL;
+    }
+    if (doc->ct != NULL)
+    {
+        memory_track_concurrent_table(doc->ct, -1);
+        free_concurrent_table(doc->ct);
+        doc->ct = NULL;
+    }
+}
+
+// ==================== 阶段耗时统计 ====================
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = {"read", "normalize", "ngram", "intersect"};
+static Histogram stage_histograms[STAGE_COUNT];
+static int metrics_enabled = 0;
+static const char *metrics_file = NULL;
+
+/**
+ * 计算数值所在的直方图桶
+ */
+int histogram_bucket(unsigned long long value)
+{
+    if (value < (1ULL << HISTOGRAM_SUB_BITS))
+    {
+        return (int)value;
+    }
+#if defined(__GNUC__)
+    int top = 63 - __builtin_clzll(value);
+#else
+    int top = 0;
+    while ((value >> top) > 1)
+    {
+        top++;
+    }
+#endif
+    int group = top - HISTOGRAM_SUB_BITS + 1;
+    int sub = (int)(value >> (top - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (group << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/**
+ * 直方图桶内的最大值（含），即Prometheus桶的上界le
+ */
+unsigned long long histogram_bucket_limit(int bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    {
+        return (unsigned long long)bucket;
+    }
+    int group = bucket >> HISTOGRAM_SUB_BITS;
+    int sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    unsigned long long low = (unsigned long long)((1 << HISTOGRAM_SUB_BITS) + sub) << (group - 1);
+    return low + (1ULL << (group - 1)) - 1;
+}
+
+/**
+ * 开始计时，未启用统计时不读时钟，返回0
+ */
+long long metrics_start(void)
+{
+    return metrics_enabled ? monotonic_ns() : 0;
+}
+
+/**
+ * 距metrics_start()的纳秒数，未启用统计时返回0；用于把一个阶段的多段耗时累加后一次记录
+ */
+long long metrics_elapsed(long long start)
+{
+    return metrics_enabled ? monotonic_ns() - start : 0;
+}
+
+/**
+ * 给某个阶段记录一次耗时
+ * @param stage 阶段
+ * @param ns 耗时（纳秒）
+ */
+void metrics_add(Stage stage, long long ns)
+{
+    if (!metrics_enabled)
+    {
+        return;
+    }
+    Histogram *h = &stage_histograms[stage];
+    unsigned long long value = ns > 0 ? (unsigned long long)ns : 0;
+    atomic_fetch_add_explicit(&h->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+/**
+ * 记录从metrics_start()到现在的耗时
+ */
+void metrics_record(Stage stage, long long start)
+{
+    metrics_add(stage, metrics_elapsed(start));
+}
+
+/**
+ * 以Prometheus文本格式输出各阶段的耗时直方图
+ * 桶计数是累计值，只输出有样本的桶的上界（以及+Inf），桶的数量不随样本数增长
+ */
+void write_metrics(FILE *out)
+{
+    fprintf(out, "# HELP plagiarism_stage_duration_seconds 各处理阶段的耗时\n");
+    fprintf(out, "# TYPE plagiarism_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        Histogram *h = &stage_histograms[stage];
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        {
+            unsigned long long n = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            if (n == 0)
+            {
+                continue;
+            }
+            cumulative += n;
+            fprintf(out, "plagiarism_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n", STAGE_NAMES[stage],
+                    (double)histogram_bucket_limit(b) / 1e9, cumulative);
+        }
+        fprintf(out, "plagiarism_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", STAGE_NAMES[stage], cumulative);
+        fprintf(out, "plagiarism_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", STAGE_NAMES[stage],
+                (double)atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+        fprintf(out, "plagiarism_stage_duration_seconds_count{stage=\"%s\"} %llu\n", STAGE_NAMES[stage], cumulative);
+    }
+}
+
+/**
+ * 程序退出时把统计写入--metrics指定的文件
+ */
+static void write_metrics_file(void)
+{
+    FILE *out = fopen(metrics_file, "w");
+    if (out == NULL)
+    {
+        printf("错误：无法写入统计文件: %s\n", metrics_file);
+        return;
+    }
+    write_metrics(out);
+    fclose(out);
+}
+
+/**
+ * 启用阶段耗时统计，退出时写入指定文件
+ * @param path 统计文件路径
+ */
+void enable_metrics(const char *path)
+{
+    metrics_enabled = 1;
+    metrics_file = path;
+    atexit(write_metrics_file);
+}
+
+// ==================== 硬件性能计数器 ====================
+
+static const char *const PERF_EVENT_NAMES[PERF_EVENT_COUNT] = {"cycles", "instructions", "cache-misses", "branch-misses", "dtlb-misses"};
+static int perf_enabled = 0;
+static atomic_int perf_available[PERF_EVENT_COUNT];
+static atomic_ullong perf_totals[STAGE_COUNT][PERF_EVENT_COUNT];
+static atomic_llong perf_grams;
+
+#ifdef HAVE_PERF_EVENTS
+static _Thread_local int perf_fds[PERF_EVENT_COUNT];
+static _Thread_local int perf_opened = 0;
+static pthread_key_t perf_key;
+
+/**
+ * 线程退出时关闭它打开的计数器
+ */
+static void perf_close_thread(void *arg)
+{
+    int *fds = (int *)arg;
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        if (fds[e] >= 0)
+        {
+            close(fds[e]);
+        }
+    }
+}
+
+/**
+ * 为当前线程打开计数器（每个线程第一次使用时调用）
+ * 只统计用户态；设置inherit后，该线程随后创建的子线程（如并行生成n-gram的线程）退出时计数会并入本线程的计数器
+ */
+static void perf_open_thread(void)
+{
+    static const unsigned int types[PERF_EVENT_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                          PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    static const unsigned long long configs[PERF_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf_fds[e] >= 0)
+        {
+            atomic_store(&perf_available[e], 1);
+        }
+    }
+    perf_opened = 1;
+    pthread_setspecific(perf_key, perf_fds);
+}
+#endif
+
+/**
+ * 读取当前线程的全部计数器，作为一个阶段的起点
+ * 未启用 --perf-counters 时什么也不做
+ */
+void perf_begin(PerfSample *sample)
+{
+    if (!perf_enabled)
+    {
+        return;
+    }
+#ifdef HAVE_PERF_EVENTS
+    if (!perf_opened)
+    {
+        perf_open_thread();
+    }
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        unsigned long long values[3] = {0, 0, 0};
+        if (perf_fds[e] < 0 || read(perf_fds[e], values, sizeof(values)) != (ssize_t)sizeof(values))
+        {
+            values[0] = values[1] = values[2] = 0;
+        }
+        sample->value[e] = values[0];
+        sample->enabled[e] = values[1];
+        sample->running[e] = values[2];
+    }
+#else
+    (void)sample;
+#endif
+}
+
+/**
+ * 把从perf_begin()到现在的计数累加到阶段上
+ * 事件多于硬件计数器时内核会轮流调度各事件，计数按 启用时间/实际计数时间 换算
+ */
+void perf_end(Stage stage, const PerfSample *start)
+{
+    if (!perf_enabled)
+    {
+        return;
+    }
+    PerfSample now;
+    perf_begin(&now);
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        unsigned long long value = now.value[e] - start->value[e];
+        unsigned long long enabled = now.enabled[e] - start->enabled[e];
+        unsigned long long running = now.running[e] - start->running[e];
+        if (running > 0 && running < enabled)
+        {
+            value = (unsigned long long)((double)value * (double)enabled / (double)running);
+        }
+        atomic_fetch_add_explicit(&perf_totals[stage][e], value, memory_order_relaxed);
+    }
+}
+
+/**
+ * 记录建表处理的n-gram数量，作为"每个n-gram的未命中次数"的分母
+ */
+void perf_add_grams(long long grams)
+{
+    if (perf_enabled && grams > 0)
+    {
+        atomic_fetch_add_explicit(&perf_grams, grams, memory_order_relaxed);
+    }
+}
+
+/**
+ * 程序退出时打印各阶段的计数、IPC与每个n-gram的未命中次数
+ */
+static void print_perf_counters(void)
+{
+    long long grams = atomic_load(&perf_grams);
+    printf("硬件性能计数器（仅用户态，n-gram共 %lld 个）：\n", grams);
+    printf("%-10s", "stage");
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        printf(" %14s", PERF_EVENT_NAMES[e]);
+    }
+    printf(" %6s %12s %12s %12s\n", "IPC", "cache/gram", "branch/gram", "dtlb/gram");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        double v[PERF_EVENT_COUNT];
+        printf("%-10s", STAGE_NAMES[stage]);
+        for (int e = 0; e < PERF_EVENT_COUNT; e++)
+        {
+            v[e] = (double)atomic_load(&perf_totals[stage][e]);
+            if (atomic_load(&perf_available[e]))
+            {
+                printf(" %14.0f", v[e]);
+            }
+            else
+            {
+                printf(" %14s", "-");
+            }
+        }
+        int has_ipc = atomic_load(&perf_available[PERF_CYCLES]) && atomic_load(&perf_available[PERF_INSTRUCTIONS]) && v[PERF_CYCLES] > 0;
+        if (has_ipc)
+        {
+            printf(" %6.2f", v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+        }
+        else
+        {
+            printf(" %6s", "-");
+        }
+        for (int e = PERF_CACHE_MISSES; e < PERF_EVENT_COUNT; e++)
+        {
+            if (atomic_load(&perf_available[e]) && grams > 0)
+            {
+                printf(" %12.4f", v[e] / (double)grams);
+            }
+            else
+            {
+                printf(" %12s", "-");
+            }
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * 启用 --perf-counters：先在当前线程试开一次计数器，一个事件都打不开时给出提示并保持关闭
+ * @return 0表示已启用，-1表示当前环境无法读取硬件计数器
+ */
+int enable_perf_counters(void)
+{
+#ifdef HAVE_PERF_EVENTS
+    pthread_key_create(&perf_key, perf_close_thread);
+    perf_open_thread();
+    for (int e = 0; e < PERF_EVENT_COUNT; e++)
+    {
+        if (atomic_load(&perf_available[e]))
+        {
+            perf_enabled = 1;
+        }
+    }
+    if (perf_enabled)
+    {
+        atexit(print_perf_counters);
+        return 0;
+    }
+    printf("警告：无法打开硬件性能计数器（%s），--perf-counters 被忽略；"
+           "请确认CPU的性能计数器对本机（或虚拟机）可见，且 /proc/sys/kernel/perf_event_paranoid 不大于2\n",
+           strerror(errno));
+    return -1;
+#else
+    printf("警告：当前平台不支持 perf_event_open，--perf-counters 被忽略\n");
+    return -1;
+#endif
+}
+
+// ==================== 内存统计 ====================
+
+static const char *const MEM_COMPONENT_NAMES[MEM_COMPONENT_COUNT] = {"text", "buffers", "hash-buckets", "hash-nodes",
+                                                                     "concurrent", "partitions", "index"};
+static int memory_enabled = 0;
+static long long memory_budget = 0;
+static atomic_llong memory_current[MEM_COMPONENT_COUNT];
+static atomic_llong memory_peak[MEM_COMPONENT_COUNT];
+static atomic_llong memory_total;
+static atomic_llong memory_total_peak;
+static atomic_llong stage_allocations[STAGE_COUNT];
+static atomic_llong stage_allocated[STAGE_COUNT];
+
+/**
+ * 把value并入peak记录的最大值
+ */
+static void atomic_max(atomic_llong *peak, long long value)
+{
+    long long seen = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(peak, &seen, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+/**
+ * 启用内存统计（--stats 或 --memory-budget）
+ * @param budget 内存预算（字节），0表示不限制
+ */
+void enable_memory_accounting(long long budget)
+{
+    memory_enabled = 1;
+    memory_budget = budget;
+}
+
+/**
+ * 记录某个组件的一次分配或释放
+ * 统计的是各数据结构申请的字节数（不含malloc自身的开销），由创建和释放这些结构的地方调用；未启用统计时什么也不做
+ * @param component 组件
+ * @param stage 发生分配的阶段（释放时忽略）
+ * @param bytes 分配为正，释放为负
+ * @param allocations 本次记录包含的分配次数
+ */
+void memory_track(MemComponent component, Stage stage, long long bytes, long long allocations)
+{
+    if (!memory_enabled || bytes == 0)
+    {
+        return;
+    }
+    long long current = atomic_fetch_add_explicit(&memory_current[component], bytes, memory_order_relaxed) + bytes;
+    long long total = atomic_fetch_add_explicit(&memory_total, bytes, memory_order_relaxed) + bytes;
+    if (bytes > 0)
+    {
+        atomic_max(&memory_peak[component], current);
+        atomic_max(&memory_total_peak, total);
+        atomic_fetch_add_explicit(&stage_allocations[stage], allocations, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stage_allocated[stage], bytes, memory_order_relaxed);
+    }
+}
+
+/**
+ * 哈希表中的节点数（遍历全部链表，只在启用内存统计时调用）
+ */
+long long hash_table_nodes(const HashTable *ht)
+{
+    long long nodes = 0;
+    for (int i = 0; i < ht->size; i++)
+    {
+        for (const NGramNode *node = ht->table[i]; node != NULL; node = node->next)
+        {
+            nodes++;
+        }
+    }
+    return nodes;
+}
+
+/**
+ * 记录（sign为1）或撤销（sign为-1）一张已建好的哈希表：桶数组计入hash-buckets，节点计入hash-nodes
+ */
+void memory_track_hash_table(const HashTable *ht, int sign)
+{
+    if (!memory_enabled)
+    {
+        return;
+    }
+    long long nodes = hash_table_nodes(ht);
+    memory_track(MEM_HASH_BUCKETS, STAGE_NGRAM, sign * (long long)(sizeof(HashTable) + (size_t)ht->size * sizeof(NGramNode *)), 2);
+    memory_track(MEM_HASH_NODES, STAGE_NGRAM, sign * nodes * (long long)sizeof(NGramNode), nodes);
+}
+
+/**
+ * 记录（sign为1）或撤销（sign为-1）一张并发计数表，计入concurrent
+ */
+void memory_track_concurrent_table(const ConcurrentTable *ct, int sign)
+{
+    memory_track(MEM_CONCURRENT, STAGE_NGRAM, sign * (long long)concurrent_table_bytes(ct), sign > 0 ? 3 : 0);
+}
+
+/**
+ * 记录（sign为1）或撤销（sign为-1）一组分区后的n-gram键，计入partitions
+ */
+void memory_track_partitioned_grams(const PartitionedGrams *pg, int sign)
+{
+    memory_track(MEM_PARTITIONS, STAGE_NGRAM, sign * (long long)partitioned_grams_bytes(pg), sign > 0 ? 3 : 0);
+}
+
+/**
+ * 记录（sign为1）或撤销（sign为-1）一个倒排索引，计入index；
+ * 由语料建立的索引记在ngram阶段，从索引文件打开的记在read阶段
+ */
+void memory_track_corpus_index(const CorpusIndex *index, int sign)
+{
+    Stage stage = index->storage != NULL ? STAGE_READ : STAGE_NGRAM;
+    long long allocations = index->storage != NULL ? 2 : 7 + index->num_docs;
+    memory_track(MEM_INDEX, stage, sign * (long long)corpus_index_bytes(index), sign > 0 ? allocations : 0);
+}
+
+/**
+ * 进程的峰值常驻内存（字节），无法获取时返回-1
+ */
+long long peak_rss_bytes(void)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return -1;
+    }
+#ifdef __APPLE__
+    return (long long)usage.ru_maxrss;
+#else
+    return (long long)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+/**
+ * 打印内存统计：各组件当前与峰值占用、全部组件同时占用的峰值、进程峰值RSS，以及各阶段的分配次数与字节数
+ */
+void print_memory_stats(void)
+{
+    printf("内存统计（数据结构申请的字节数，单位MB）：\n");
+    printf("  %-14s %10s %10s\n", "component", "current", "peak");
+    for (int c = 0; c < MEM_COMPONENT_COUNT; c++)
+    {
+        long long peak = atomic_load(&memory_peak[c]);
+        if (peak > 0)
+        {
+            printf("  %-14s %10.2f %10.2f\n", MEM_COMPONENT_NAMES[c], (double)atomic_load(&memory_current[c]) / 1048576.0,
+                   (double)peak / 1048576.0);
+        }
+    }
+    printf("  %-14s %10.2f %10.2f\n", "total", (double)atomic_load(&memory_total) / 1048576.0,
+           (double)atomic_load(&memory_total_peak) / 1048576.0);
+    long long rss = peak_rss_bytes();
+    if (rss >= 0)
+    {
+        printf("  进程峰值RSS: %.2f MB\n", (double)rss / 1048576.0);
+    }
+    if (memory_budget > 0)
+    {
+        char budget_text[32];
+        printf("  内存预算: %s\n", format_byte_size(memory_budget, budget_text, sizeof(budget_text)));
+    }
+    printf("  %-14s %12s %10s\n", "stage", "allocations", "MB");
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        printf("  %-14s %12lld %10.2f\n", STAGE_NAMES[stage], atomic_load(&stage_allocations[stage]),
+               (double)atomic_load(&stage_allocated[stage]) / 1048576.0);
+    }
+}
+
+/**
+ * 解析带 K/M/G 后缀的字节数（如 "512M"）
+ * @return 字节数，格式不正确时返回-1
+ */
+long long parse_byte_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    double scale = 1.0;
+    if (*end == 'K' || *end == 'k')
+    {
+        scale = 1024.0;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        scale = 1048576.0;
+        end++;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        scale = 1073741824.0;
+        end++;
+    }
+    if (end == text || *end != '\0' || value <= 0.0)
+    {
+        return -1;
+    }
+    return (long long)(value * scale);
+}
+
+/**
+ * 按 parse_byte_size() 接受的 K/M/G 后缀格式化字节数（如 "10K"、"147.2M"），不足1K时直接写字节数
+ * @return buffer
+ */
+const char *format_byte_size(long long bytes, char *buffer, size_t size)
+{
+    if (bytes < 1024)
+    {
+        snprintf(buffer, size, "%lld 字节", bytes);
+    }
+    else if (bytes < 1048576)
+    {
+        snprintf(buffer, size, "%.4gK", (double)bytes / 1024.0);
+    }
+    else if (bytes < 1073741824)
+    {
+        snprintf(buffer, size, "%.4gM", (double)bytes / 1048576.0);
+    }
+    else
+    {
+        snprintf(buffer, size, "%.4gG", (double)bytes / 1073741824.0);
+    }
+    return buffer;
+}
+
+/**
+ * 预处理后文本缓冲区的上界：流水线按需把容量翻倍，最多是原文件大小的2倍
+ */
+static long long estimate_text_bytes(long long file_size)
+{
+    return 2 * (file_size > 0 ? file_size : 0) + 1;
+}
+
+/**
+ * 估计比较两篇文档所需的内存上界（字节）
+ * n-gram数按文件字节数估计（预处理只会让文本变短），不同n-gram数按最坏情况等于n-gram数；
+ * 哈希表引擎并行建表时每个线程还有一张私有表的桶数组，分区引擎还有每个线程一张缓存大小的比较用表
+ * @param engine 计算引擎
+ * @param size_a 第一篇文档的字节数
+ * @param size_b 第二篇文档的字节数
+ * @param num_threads 线程数
+ * @param partition_bits 分区位数（分区引擎）
+ * @param limit 抽样上限（抽样引擎）
+ */
+long long estimate_pair_memory(Engine engine, long long size_a, long long size_b, int num_threads, int partition_bits,
+                               unsigned int limit)
+{
+    long long sizes[2] = {size_a > 0 ? size_a : 0, size_b > 0 ? size_b : 0};
+    long long bytes = PIPELINE_DEPTH * READ_BLOCK_SIZE * 2;
+    int doc_threads = num_threads > 1 ? (num_threads + 1) / 2 : 1;
+    for (int d = 0; d < 2; d++)
+    {
+        bytes += estimate_text_bytes(sizes[d]);
+        if (engine == ENGINE_PARTITION)
+        {
+            bytes += sizes[d] * (long long)sizeof(unsigned long long) +
+                     ((1LL << partition_bits) + 1) * (long long)sizeof(size_t) * (doc_threads + 1);
+        }
+        else if (engine == ENGINE_SAMPLE)
+        {
+            double expected = (double)sizes[d] * ((double)limit + 1.0) / 4294967296.0;
+            bytes += concurrent_table_capacity((long long)(expected + 8.0 * sqrt(expected)) + 64) *
+                     (long long)(sizeof(unsigned long long) + sizeof(int));
+        }
+        else
+        {
+            long long threads = sizes[d] / MIN_CHUNK_SIZE < doc_threads ? sizes[d] / MIN_CHUNK_SIZE : doc_threads;
+            bytes += (threads + 1) * HASH_TABLE_SIZE * (long long)sizeof(NGramNode *) + sizes[d] * (long long)sizeof(NGramNode);
+        }
+    }
+    if (engine == ENGINE_PARTITION)
+    {
+        bytes += (long long)num_threads * PARTITION_CACHE_BYTES;
+    }
+    return bytes;
+}
+
+/**
+ * 检查估计的内存需求是否超出预算，超出时打印错误
+ * @return 0表示在预算内（或未设置预算），-1表示超出
+ */
+int check_memory_budget(long long need, const char *what)
+{
+    if (memory_budget <= 0 || need <= memory_budget)
+    {
+        return 0;
+    }
+    char need_text[32];
+    char budget_text[32];
+    printf("错误：%s预计需要 %s 内存，超出内存预算 %s\n", what, format_byte_size(need, need_text, sizeof(need_text)),
+           format_byte_size(memory_budget, budget_text, sizeof(budget_text)));
+    return -1;
+}
+
+/**
+ * 检查批量作业的内存需求：每篇文档的文本（整篇读入）加一张并发计数表，所有文档同时驻留
+ * @return 0表示在预算内，-1表示超出
+ */
+int check_corpus_memory_budget(const CorpusJob *job)
+{
+    if (memory_budget <= 0)
+    {
+        return 0;
+    }
+    long long need = 0;
+    for (int i = 0; i < job->num_docs; i++)
+    {
+        long long size = get_file_size(job->docs[i]->doc.path);
+        size = size > 0 ? size : 0;
+        need += size + 1 + concurrent_table_capacity(size) * (long long)(sizeof(unsigned long long) + sizeof(int));
+    }
+    return check_memory_budget(need, "语料");
+}
+
+// ==================== 工作窃取调度器 ====================
+
+#ifdef HAVE_NUMA
+/**
+ * 解析cpulist格式的CPU列表（如 "0-3,8-11"）
+ */
+static void parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list)
+        {
+            break;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            CPU_SET(cpu, cpus);
+        }
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
+#endif
+
+/**
+ * 检测NUMA拓扑，只保留当前进程允许运行的CPU（兼容taskset与cgroup限制）
+ * @param topology 输出的拓扑信息
+ * @return 节点数（至少为1）
+ */
+int detect_numa_topology(NumaTopology *topology)
+{
+    memset(topology, 0, sizeof(NumaTopology));
+#ifdef HAVE_NUMA
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int id = 0; id < MAX_NUMA_NODES; id++)
+        {
+            char path[64];
+            char list[1024];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            FILE *file = fopen(path, "r");
+            if (file == NULL)
+            {
+                continue;
+            }
+            int ok = fgets(list, sizeof(list), file) != NULL;
+            fclose(file);
+
+            cpu_set_t *cpus = &topology->cpus[topology->num_nodes];
+            if (ok)
+            {
+                parse_cpu_list(list, cpus);
+                CPU_AND(cpus, cpus, &allowed);
+            }
+            // 没有可用CPU的节点（纯内存节点或被限制掉的节点）不参与分片
+            if (ok && CPU_COUNT(cpus) > 0)
+            {
+                topology->node_ids[topology->num_nodes++] = id;
+            }
+        }
+    }
+#endif
+    if (topology->num_nodes == 0)
+    {
+        topology->num_nodes = 1;
+    }
+    return topology->num_nodes;
+}
+
+/**
+ * 工作线程所在的节点：第i个线程放在第 i % num_nodes 个节点上
+ */
+static int worker_node(const Scheduler *s, int id)
+{
+    return id % s->num_nodes;
+}
+
+static _Thread_local Scheduler *current_scheduler = NULL;
+static _Thread_local int current_worker = -1;
+
+typedef struct
+{
+    Scheduler *scheduler;
+    int id;
+} WorkerContext;
+
+static void deque_push(TaskDeque *deque, Task task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity)
+    {
+        int capacity = deque->capacity * 2;
+        Task *items = (Task *)malloc(capacity * sizeof(Task));
+        for (int i = 0; i < deque->count; i++)
+        {
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int deque_pop_tail(TaskDeque *deque, Task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        deque->count--;
+        *task = deque->items[(deque->head + deque->count) % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal_head(TaskDeque *deque, Task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        *task = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * 为工作线程取下一个任务：先取自己队列的尾部，再依次窃取其他队列的头部
+ * 优先窃取同一节点上的线程（任务要访问的表在本地内存），本节点都空了才跨节点窃取
+ */
+static int scheduler_take(Scheduler *s, int id, Task *task)
+{
+    if (deque_pop_tail(&s->deques[id], task))
+    {
+        return 1;
+    }
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 1; i < s->num_workers; i++)
+        {
+            int victim = (id + i) % s->num_workers;
+            int same_node = worker_node(s, victim) == worker_node(s, id);
+            if (same_node == (pass == 0) && deque_steal_head(&s->deques[victim], task))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *scheduler_worker(void *arg)
+{
+    WorkerContext *context = (WorkerContext *)arg;
+    Scheduler *s = context->scheduler;
+    int id = context->id;
+    free(context);
+
+    current_scheduler = s;
+    current_worker = id;
+
+#ifdef HAVE_NUMA
+    // 多节点时把线程绑定到所属节点的CPU上，它建出的表按首次访问原则分配在本地内存
+    if (s->num_nodes > 1)
+    {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &s->topology->cpus[worker_node(s, id)]);
+    }
+#endif
+
+    for (;;)
+    {
+        Task task;
+        if (scheduler_take(s, id, &task))
+        {
+            pthread_mutex_lock(&s->lock);
+            s->queued--;
+            pthread_mutex_unlock(&s->lock);
+
+            task.fn(task.arg);
+
+            pthread_mutex_lock(&s->lock);
+            if (--s->active == 0)
+            {
+                pthread_cond_broadcast(&s->idle);
+            }
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while (s->queued == 0 && !s->stop)
+        {
+            pthread_cond_wait(&s->has_work, &s->lock);
+        }
+        int stop = s->stop && s->queued == 0;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 创建工作窃取调度器并启动工作线程
+ * @param num_workers 工作线程数
+ * @param topology NUMA拓扑，为NULL时不绑定线程
+ * @return 新创建的调度器
+ */
+Scheduler *create_scheduler(int num_workers, const NumaTopology *topology)
+{
+    Scheduler *s = (Scheduler *)calloc(1, sizeof(Scheduler));
+    s->num_workers = num_workers;
+    s->topology = topology;
+    s->num_nodes = 1;
+    if (topology != NULL)
+    {
+        s->num_nodes = topology->num_nodes < num_workers ? topology->num_nodes : num_workers;
+    }
+    s->deques = (TaskDeque *)calloc(num_workers, sizeof(TaskDeque));
+    s->threads = (pthread_t *)calloc(num_workers, sizeof(pthread_t));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->has_work, NULL);
+    pthread_cond_init(&s->idle, NULL);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        s->deques[i].capacity = 64;
+        s->deques[i].items = (Task *)malloc(64 * sizeof(Task));
+        pthread_mutex_init(&s->deques[i].lock, NULL);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        WorkerContext *context = (WorkerContext *)malloc(sizeof(WorkerContext));
+        context->scheduler = s;
+        context->id = i;
+        pthread_create(&s->threads[i], NULL, scheduler_worker, context);
+    }
+    return s;
+}
+
+/**
+ * 提交任务
+ * 工作线程内提交的子任务进入自己的队列，外部线程提交的任务轮流分配到各个队列
+ * @param s 调度器
+ * @param fn 任务函数
+ * @param arg 任务参数
+ */
+void scheduler_submit(Scheduler *s, TaskFunc fn, void *arg)
+{
+    scheduler_submit_on(s, fn, arg, -1);
+}
+
+/**
+ * 提交绑定到指定节点的任务：进入该节点上某个工作线程的队列
+ * 当前线程已在该节点上时直接进入自己的队列
+ * @param s 调度器
+ * @param fn 任务函数
+ * @param arg 任务参数
+ * @param node 节点序号，-1表示不限节点
+ */
+void scheduler_submit_on(Scheduler *s, TaskFunc fn, void *arg, int node)
+{
+    Task task = {fn, arg};
+    int local = current_scheduler == s && (node < 0 || worker_node(s, current_worker) == node % s->num_nodes);
+
+    pthread_mutex_lock(&s->lock);
+    int id;
+    if (local)
+    {
+        id = current_worker;
+    }
+    else if (node < 0)
+    {
+        id = s->next++ % s->num_workers;
+    }
+    else
+    {
+        node %= s->num_nodes;
+        int per_node = (s->num_workers - node + s->num_nodes - 1) / s->num_nodes;
+        id = node + (s->next++ % per_node) * s->num_nodes;
+    }
+    deque_push(&s->deques[id], task);
+    s->queued++;
+    s->active++;
+    pthread_cond_signal(&s->has_work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * 等待所有已提交的任务（包括任务执行中派生出的子任务）全部完成
+ * @param s 调度器
+ */
+void scheduler_wait(Scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->active > 0)
+    {
+        pthread_cond_wait(&s->idle, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * 停止工作线程并释放调度器
+ * @param s 要释放的调度器
+ */
+void free_scheduler(Scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->has_work);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->num_workers; i++)
+    {
+        pthread_join(s->threads[i], NULL);
+    }
+    for (int i = 0; i < s->num_workers; i++)
+    {
+        free(s->deques[i].items);
+        pthread_mutex_destroy(&s->deques[i].lock);
+    }
+    pthread_cond_destroy(&s->idle);
+    pthread_cond_destroy(&s->has_work);
+    pthread_mutex_destroy(&s->lock);
+    free(s->threads);
+    free(s->deques);
+    free(s);
+}
+
+// ==================== 批量比较作业 ====================
+
+static void corpus_chunk_task(void *arg)
+{
+    CorpusChunk *chunk = (CorpusChunk *)arg;
+    CorpusDoc *cd = chunk->owner;
+
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    generate_ngrams_concurrent_range(cd->doc.text, chunk->start, chunk->end, cd->ct);
+    metrics_record(STAGE_NGRAM, start);
+    perf_end(STAGE_NGRAM, &perf);
+}
+
+/**
+ * 为已读取并预处理好的文档建表，超大文档拆成子任务
+ */
+static void corpus_build(CorpusDoc *cd)
+{
+    int positions = (int)cd->doc.length - N_GRAM + 1;
+    cd->ct = create_concurrent_table(positions);
+    memory_track_concurrent_table(cd->ct, 1);
+    perf_add_grams(positions);
+
+    if (positions <= SPLIT_SIZE)
+    {
+        long long start = metrics_start();
+        PerfSample perf;
+        perf_begin(&perf);
+        generate_ngrams_concurrent_range(cd->doc.text, 0, positions, cd->ct);
+        metrics_record(STAGE_NGRAM, start);
+        perf_end(STAGE_NGRAM, &perf);
+        return;
+    }
+
+    // 超大文档：拆成若干子任务，由空闲线程窃取执行，全部直接写入同一张并发表
+    int n = (positions + SPLIT_SIZE - 1) / SPLIT_SIZE;
+    cd->num_chunks = n;
+    cd->chunks = (CorpusChunk *)malloc(n * sizeof(CorpusChunk));
+
+    for (int i = 0; i < n; i++)
+    {
+        cd->chunks[i].owner = cd;
+        cd->chunks[i].start = (int)((long long)positions * i / n);
+        cd->chunks[i].end = (int)((long long)positions * (i + 1) / n);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        scheduler_submit_on(cd->scheduler, corpus_chunk_task, &cd->chunks[i], cd->node);
+    }
+}
+
+static void corpus_load_task(void *arg)
+{
+    CorpusDoc *cd = (CorpusDoc *)arg;
+
+    if (load_document(&cd->doc) == 0)
+    {
+        corpus_build(cd);
+    }
+}
+
+/**
+ * 异步读取完成后的分词任务：doc.text中是整个文件的原始内容，原地预处理后建表
+ * normalize_block() 的输出永远不会超过输入位置，因此可以原地改写
+ */
+static void corpus_tokenize_task(void *arg)
+{
+    CorpusDoc *cd = (CorpusDoc *)arg;
+    size_t consumed = 0;
+
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    cd->doc.length = normalize_block(cd->doc.text, cd->doc.length, cd->doc.text, &consumed, 1);
+    cd->doc.text[cd->doc.length] = '\0';
+    metrics_record(STAGE_NORMALIZE, start);
+    perf_end(STAGE_NORMALIZE, &perf);
+    cd->doc.status = 0;
+    corpus_build(cd);
+}
+
+/**
+ * 整个文件读完后交给文档所属节点上的线程分词建表
+ */
+static void corpus_read_done(CorpusDoc *cd, Scheduler *s)
+{
+    scheduler_submit_on(s, corpus_tokenize_task, cd, cd->node);
+}
+
+#ifdef HAVE_PREAD
+/**
+ * 打开文档并按文件大小分配读缓冲（多留一个字节放字符串结束符）
+ * @return 文件描述符，失败时返回-1并把文档标记为无法打开
+ */
+static int open_for_read(CorpusDoc *cd)
+{
+    int fd = open(cd->doc.path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        cd->doc.status = -1;
+        return -1;
+    }
+    cd->doc.length = (size_t)st.st_size;
+    cd->doc.capacity = cd->doc.length + 1;
+    cd->doc.text = (char *)malloc(cd->doc.capacity);
+    memory_track(MEM_TEXT, STAGE_READ, (long long)cd->doc.capacity, 1);
+    return fd;
+}
+
+typedef struct
+{
+    CorpusJob *job;
+    Scheduler *scheduler;
+    atomic_int *next;
+} ReaderWorker;
+
+static void *pread_worker(void *arg)
+{
+    ReaderWorker *worker = (ReaderWorker *)arg;
+
+    for (;;)
+    {
+        int i = atomic_fetch_add(worker->next, 1);
+        if (i >= worker->job->num_docs)
+        {
+            return NULL;
+        }
+
+        CorpusDoc *cd = worker->job->docs[i];
+        long long start = metrics_start();
+        PerfSample perf;
+        perf_begin(&perf);
+        int fd = open_for_read(cd);
+        if (fd < 0)
+        {
+            continue;
+        }
+        int error = pread_all(fd, cd->doc.text, 0, &cd->doc.length);
+        close(fd);
+        metrics_record(STAGE_READ, start);
+        perf_end(STAGE_READ, &perf);
+        if (error != 0)
+        {
+            cd->doc.status = -1;
+            continue;
+        }
+        corpus_read_done(cd, worker->scheduler);
+    }
+}
+#endif
+
+/**
+ * 用读线程池加载语料：IO_THREADS个线程各自阻塞在pread上，读完一个文件就交给调度器分词
+ * @param job 批量作业
+ * @param s 负责分词建表的调度器
+ * @return 0表示已处理全部文档，-1表示当前平台不支持
+ */
+int read_corpus_pread(CorpusJob *job, Scheduler *s)
+{
+#ifdef HAVE_PREAD
+    ReaderWorker workers[IO_THREADS];
+    atomic_int next = 0;
+
+    for (int i = 0; i < IO_THREADS; i++)
+    {
+        workers[i].job = job;
+        workers[i].scheduler = s;
+        workers[i].next = &next;
+    }
+    run_parallel(pread_worker, workers, sizeof(ReaderWorker), IO_THREADS);
+    return 0;
+#else
+    (void)job;
+    (void)s;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * 最小化的io_uring封装（直接使用系统调用，不依赖liburing）
+ */
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;
+} Ring;
+
+static int ring_init(Ring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Ring));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    char *cq = (char *)ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void ring_free(Ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * 排入一个读请求（尚未提交给内核）
+ */
+static void ring_queue_read(Ring *ring, int fd, void *buffer, unsigned length, unsigned long long offset, unsigned long long user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(size_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+/**
+ * 提交所有排队的请求，并至少等待wait个完成事件
+ */
+static int ring_submit(Ring *ring, unsigned wait)
+{
+    int ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0)
+    {
+        ring->pending -= (unsigned)ret;
+    }
+    return ret;
+}
+
+/**
+ * 取出一个完成事件
+ * @return 有事件返回1，否则返回0
+ */
+static int ring_reap(Ring *ring, unsigned long long *user_data, int *result)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif
+
+/**
+ * 用io_uring加载语料：调用线程保持最多IO_QUEUE_DEPTH个读请求在途，
+ * 一个文件读完立即交给调度器分词，读取与分词互相重叠。
+ * 单次读取不足（大文件或被信号打断）时从已读位置继续提交；内核不支持READ操作码时改用pread补读
+ * @param job 批量作业
+ * @param s 负责分词建表的调度器
+ * @return 0表示已处理全部文档，-1表示io_uring不可用（调用者应改用读线程池）
+ */
+int read_corpus_io_uring(CorpusJob *job, Scheduler *s)
+{
+#ifdef HAVE_IO_URING
+    Ring ring;
+    if (ring_init(&ring, IO_QUEUE_DEPTH) != 0)
+    {
+        return -1;
+    }
+
+    int count = job->num_docs > 0 ? job->num_docs : 1;
+    int *fds = (int *)malloc(count * sizeof(int));
+    size_t *done = (size_t *)calloc(count, sizeof(size_t));
+    char *inflight_flags = (char *)calloc(count, 1);
+    long long *started = (long long *)malloc(count * sizeof(long long));
+    int next = 0;
+    int inflight = 0;
+
+    while (next < job->num_docs || inflight > 0)
+    {
+        while (inflight < IO_QUEUE_DEPTH && next < job->num_docs)
+        {
+            CorpusDoc *cd = job->docs[next];
+            started[next] = metrics_start();
+            fds[next] = open_for_read(cd);
+            if (fds[next] >= 0 && cd->doc.length == 0)
+            {
+                close(fds[next]);
+                corpus_read_done(cd, s);
+            }
+            else if (fds[next] >= 0)
+            {
+                size_t length = cd->doc.length > 0x40000000 ? 0x40000000 : cd->doc.length;
+                ring_queue_read(&ring, fds[next], cd->doc.text, (unsigned)length, 0, (unsigned long long)next);
+                inflight_flags[next] = 1;
+                inflight++;
+            }
+            next++;
+        }
+
+        if (inflight == 0)
+        {
+            continue;
+        }
+        int submitted = ring_submit(&ring, 1);
+        if (submitted < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (submitted < 0)
+        {
+            break;
+        }
+
+        unsigned long long id;
+        int result;
+        while (ring_reap(&ring, &id, &result))
+        {
+            CorpusDoc *cd = job->docs[id];
+            int fd = fds[id];
+            inflight--;
+
+            if (result > 0)
+            {
+                done[id] += (size_t)result;
+            }
+            else if (result == 0)
+            {
+                // 提前读到文件尾：文件在fstat之后被截短，只保留实际读到的部分
+                cd->doc.length = done[id];
+            }
+            if (result > 0 && done[id] < cd->doc.length)
+            {
+                size_t length = cd->doc.length - done[id];
+                length = length > 0x40000000 ? 0x40000000 : length;
+                ring_queue_read(&ring, fd, cd->doc.text + done[id], (unsigned)length, done[id], id);
+                inflight++;
+                continue;
+            }
+
+            inflight_flags[id] = 0;
+            if (result < 0 && pread_all(fd, cd->doc.text, done[id], &cd->doc.length) != 0)
+            {
+                cd->doc.status = -1;
+            }
+            close(fd);
+            if (cd->doc.status == 0)
+            {
+                // 读取耗时从提交到完成，包含在队列中等待的时间
+                metrics_record(STAGE_READ, started[id]);
+                corpus_read_done(cd, s);
+            }
+        }
+    }
+    ring_free(&ring);
+
+    // io_uring中途出错：在途和尚未开始的文档改用pread同步读完（内核迟到的写入内容与pread相同，不影响结果）
+    for (int i = 0; i < job->num_docs; i++)
+    {
+        CorpusDoc *cd = job->docs[i];
+        int fd = inflight_flags[i] ? fds[i] : (i >= next ? open_for_read(cd) : -1);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (pread_all(fd, cd->doc.text, 0, &cd->doc.length) != 0)
+        {
+            cd->doc.status = -1;
+        }
+        close(fd);
+        if (cd->doc.status == 0)
+        {
+            corpus_read_done(cd, s);
+        }
+    }
+
+    free(started);
+    free(inflight_flags);
+    free(fds);
+    free(done);
+    return 0;
+#else
+    (void)job;
+    (void)s;
+    return -1;
+#endif
+}
+
+/**
+ * 由交集与两篇文档的n-gram总数计算Jaccard相似度
+ * 文档的n-gram总数即滑动窗口的位置数，因此无需再遍历哈希表求并集
+ */
+static void finish_pair(PairJob *job, long long intersection)
+{
+    long long total_a = (long long)job->a->doc.length - N_GRAM + 1;
+    long long total_b = (long long)job->b->doc.length - N_GRAM + 1;
+    long long union_total = (total_a > 0 ? total_a : 0) + (total_b > 0 ? total_b : 0) - intersection;
+
+    job->similarity = jaccard_from_counts(intersection, union_total);
+    job->valid = 1;
+}
+
+/**
+ * 阈值判定的比较结束（子任务可能提前结束，此时结果已经确定）
+ */
+static void finish_threshold_pair(PairJob *job)
+{
+    job->above = threshold_outcome(&job->bounds) == 1;
+    job->valid = 1;
+}
+
+static void pair_part_task(void *arg)
+{
+    PairPart *part = (PairPart *)arg;
+    PairJob *job = part->job;
+
+    long long start = metrics_start();
+    PerfSample perf;
+    perf_begin(&perf);
+    if (job->threshold > 0)
+    {
+        concurrent_threshold_range(job->outer->ct, job->inner->ct, part->slot_start, part->slot_end, &job->bounds);
+    }
+    else
+    {
+        part->intersection = concurrent_intersection_range(job->outer->ct, job->inner->ct, part->slot_start, part->slot_end);
+    }
+    metrics_record(STAGE_INTERSECT, start);
+    perf_end(STAGE_INTERSECT, &perf);
+
+    // remaining的递减带有获取-释放语义，最后一个子任务能看到其他子任务写入的结果
+    if (atomic_fetch_sub(&job->remaining, 1) != 1)
+    {
+        return;
+    }
+    if (job->threshold > 0)
+    {
+        finish_threshold_pair(job);
+        return;
+    }
+    long long intersection = 0;
+    for (int i = 0; i < job->num_parts; i++)
+    {
+        intersection += job->parts[i].intersection;
+    }
+    finish_pair(job, intersection);
+}
+
+static void pair_task(void *arg)
+{
+    PairJob *job = (PairJob *)arg;
+
+    if (job->a->doc.status != 0 || job->b->doc.status != 0)
+    {
+        return;
+    }
+
+    // 遍历较小文档的表、查询较大文档的表
+    int a_smaller = job->a->doc.length <= job->b->doc.length;
+    job->outer = a_smaller ? job->a : job->b;
+    job->inner = a_smaller ? job->b : job->a;
+
+    ConcurrentTable *ct = job->outer->ct;
+    size_t slots = ct->mask + 1;
+    int positions = (int)job->outer->doc.length - N_GRAM + 1;
+
+    // 阈值判定：交集不会超过较小文档的n-gram总数，长度相差悬殊的文档对在这里就能直接排除
+    if (job->threshold > 0)
+    {
+        long long total_inner = (long long)job->inner->doc.length - N_GRAM + 1;
+        long long total_outer = positions > 0 ? positions : 0;
+        total_inner = total_inner > 0 ? total_inner : 0;
+        init_threshold(&job->bounds, threshold_need(total_outer, total_inner, job->threshold), total_outer);
+        if (threshold_outcome(&job->bounds) >= 0)
+        {
+            finish_threshold_pair(job);
+            return;
+        }
+    }
+
+    if (positions <= SPLIT_SIZE)
+    {
+        long long start = metrics_start();
+        PerfSample perf;
+        perf_begin(&perf);
+        if (job->threshold > 0)
+        {
+            concurrent_threshold_range(ct, job->inner->ct, 0, slots, &job->bounds);
+            metrics_record(STAGE_INTERSECT, start);
+            perf_end(STAGE_INTERSECT, &perf);
+            finish_threshold_pair(job);
+            return;
+        }
+        long long intersection = concurrent_intersection_range(ct, job->inner->ct, 0, slots);
+        metrics_record(STAGE_INTERSECT, start);
+        perf_end(STAGE_INTERSECT, &perf);
+        finish_pair(job, intersection);
+        return;
+    }
+
+    int n = (positions + SPLIT_SIZE - 1) / SPLIT_SIZE;
+    job->parts = (PairPart *)malloc(n * sizeof(PairPart));
+    job->num_parts = n;
+    atomic_store(&job->remaining, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        job->parts[i].job = job;
+        job->parts[i].slot_start = slots * i / n;
+        job->parts[i].slot_end = slots * (i + 1) / n;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        scheduler_submit_on(job->scheduler, pair_part_task, &job->parts[i], job->inner->node);
+    }
+}
+
+/**
+ * 向作业中加入一篇文档，同一路径只会加载一次
+ * @param job 批量作业
+ * @param path 文档路径
+ * @return 对应的文档
+ */
+CorpusDoc *corpus_add_document(CorpusJob *job, const char *path)
+{
+    if (job->num_docs * 2 >= job->index_size)
+    {
+        int size = job->index_size == 0 ? 1021 : job->index_size * 2 + 1;
+        CorpusDoc **index = (CorpusDoc **)calloc(size, sizeof(CorpusDoc *));
+        for (int i = 0; i < job->num_docs; i++)
+        {
+            unsigned int slot = hash_function(job->docs[i]->doc.path, size);
+            while (index[slot] != NULL)
+            {
+                slot = (slot + 1) % size;
+            }
+            index[slot] = job->docs[i];
+        }
+        free(job->index);
+        job->index = index;
+        job->index_size = size;
+    }
+
+    unsigned int slot = hash_function(path, job->index_size);
+    while (job->index[slot] != NULL)
+    {
+        if (strcmp(job->index[slot]->doc.path, path) == 0)
+        {
+            return job->index[slot];
+        }
+        slot = (slot + 1) % job->index_size;
+    }
+
+    if (job->num_docs == job->doc_capacity)
+    {
+        job->doc_capacity = job->doc_capacity == 0 ? 16 : job->doc_capacity * 2;
+        job->docs = (CorpusDoc **)realloc(job->docs, job->doc_capacity * sizeof(CorpusDoc *));
+    }
+
+    CorpusDoc *cd = (CorpusDoc *)calloc(1, sizeof(CorpusDoc));
+    size_t len = strlen(path);
+    char *copy = (char *)malloc(len + 1);
+    memcpy(copy, path, len + 1);
+    cd->doc.path = copy;
+
+    job->docs[job->num_docs++] = cd;
+    job->index[slot] = cd;
+    return cd;
+}
+
+/**
+ * 向作业中加入一次两两比较
+ * @param job 批量作业
+ * @param a 第一篇文档
+ * @param b 第二篇文档
+ */
+void corpus_add_pair(CorpusJob *job, CorpusDoc *a, CorpusDoc *b)
+{
+    if (job->num_pairs == job->pair_capacity)
+    {
+        job->pair_capacity = job->pair_capacity == 0 ? 16 : job->pair_capacity * 2;
+        job->pairs = (PairJob *)realloc(job->pairs, job->pair_capacity * sizeof(PairJob));
+    }
+
+    PairJob *pair = &job->pairs[job->num_pairs++];
+    memset(pair, 0, sizeof(PairJob));
+    pair->a = a;
+    pair->b = b;
+}
+
+/**
+ * 执行批量作业：先并行加载所有文档并建表，再并行完成所有比较
+ * 两个阶段都交给工作窃取调度器，超大文档和超大比较会被拆成子任务
+ * @param job 批量作业
+ * @param num_threads 工作线程数
+ * @return 0表示成功，-1表示预计的内存需求超出 --memory-budget（此时不读取任何文档）
+ */
+int run_corpus_job(CorpusJob *job, int num_threads)
+{
+    if (check_corpus_memory_budget(job) != 0)
+    {
+        return -1;
+    }
+    detect_numa_topology(&job->topology);
+    Scheduler *s = create_scheduler(num_threads, &job->topology);
+    job->num_nodes = s->num_nodes;
+    job->num_workers = num_threads;
+
+    // 按文档分片：每篇文档分给当前字节数最少的节点，由该节点上的线程建表
+    long long node_bytes[MAX_NUMA_NODES] = {0};
+    for (int i = 0; i < job->num_docs; i++)
+    {
+        CorpusDoc *cd = job->docs[i];
+        int node = 0;
+        for (int n = 1; n < job->num_nodes; n++)
+        {
+            if (node_bytes[n] < node_bytes[node])
+            {
+                node = n;
+            }
+        }
+        long long size = job->num_nodes > 1 ? get_file_size(cd->doc.path) : 0;
+        node_bytes[node] += size > 0 ? size : 0;
+        cd->node = node;
+        cd->scheduler = s;
+    }
+
+    // 优先用io_uring保持大量读请求在途，其次用pread读线程池，都不可用时由任务自己读文件
+    if (read_corpus_io_uring(job, s) != 0 && read_corpus_pread(job, s) != 0)
+    {
+        for (int i = 0; i < job->num_docs; i++)
+        {
+            scheduler_submit_on(s, corpus_load_task, job->docs[i], job->docs[i]->node);
+        }
+    }
+    scheduler_wait(s);
+
+    // 比较任务放在较大文档所在的节点上：较小文档的表顺序扫描，较大文档的表随机查询
+    for (int i = 0; i < job->num_pairs; i++)
+    {
+        PairJob *pair = &job->pairs[i];
+        CorpusDoc *larger = pair->a->doc.length > pair->b->doc.length ? pair->a : pair->b;
+        pair->scheduler = s;
+        pair->threshold = job->threshold;
+        scheduler_submit_on(s, pair_task, pair, larger->node);
+    }
+    scheduler_wait(s);
+
+    free_scheduler(s);
+    return 0;
+}
+
+/**
+ * 打印分片布局：每个节点上的工作线程数、文档数、n-gram数与计数表占用的内存
+ * @param job 已执行完的批量作业
+ */
+void print_shard_layout(const CorpusJob *job)
+{
+    printf("分片布局：%d 个NUMA节点，%d 个工作线程\n", job->num_nodes, job->num_workers);
+    for (int n = 0; n < job->num_nodes; n++)
+    {
+        int docs = 0;
+        long long grams = 0;
+        size_t table_bytes = 0;
+        for (int i = 0; i < job->num_docs; i++)
+        {
+            CorpusDoc *cd = job->docs[i];
+            if (cd->node != n || cd->ct == NULL)
+            {
+                continue;
+            }
+            long long positions = (long long)cd->doc.length - N_GRAM + 1;
+            docs++;
+            grams += positions > 0 ? positions : 0;
+            table_bytes += (cd->ct->mask + 1) * (sizeof(unsigned long long) + sizeof(int));
+        }
+        int workers = (job->num_workers - n + job->num_nodes - 1) / job->num_nodes;
+        printf("  节点 %d：工作线程 %d 个，文档 %d 篇，n-gram %lld 个，计数表 %.1f MB\n",
+               job->topology.node_ids[n], workers, docs, grams, table_bytes / (1024.0 * 1024.0));
+    }
+}
+
+/**
+ * 释放批量作业中的所有文档与比较结果
+ * @param job 要释放的批量作业
+ */
+void free_corpus_job(CorpusJob *job)
+{
+    for (int i = 0; i < job->num_docs; i++)
+    {
+        free((char *)job->docs[i]->doc.path);
+        free_document(&job->docs[i]->doc);
+        if (job->docs[i]->ct != NULL)
+        {
+            memory_track_concurrent_table(job->docs[i]->ct, -1);
+            free_concurrent_table(job->docs[i]->ct);
+        }
+        free(job->docs[i]->chunks);
+        free(job->docs[i]);
+    }
+    for (int i = 0; i < job->num_pairs; i++)
+    {
+        free(job->pairs[i].parts);
+    }
+    free(job->docs);
+    free(job->index);
+    free(job->pairs);
+    memset(job, 0, sizeof(CorpusJob));
+}
+
+/**
+ * 读取列表文件中的下一行（去掉行尾换行符），空行会被跳过
+ * @return 成功返回1，文件结束返回0
+ */
+static int read_list_line(FILE *file, char *line)
+{
+    while (fgets(line, MAX_LINE_LENGTH, file) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 报告无法打开的文档
+ * @return 无法打开的文档数
+ */
+static int report_missing(CorpusJob *job)
+{
+    int missing = 0;
+    for (int i = 0; i < job->num_docs; i++)
+    {
+        if (job->docs[i]->doc.status != 0)
+        {
+            printf("错误：无法打开文件: %s\n", job->docs[i]->doc.path);
+            missing++;
+        }
+    }
+    return missing;
+}
+
+/**
+ * 把比较结果逐行写入输出文件：文档A<TAB>文档B<TAB>相似度
+ * 阈值判定时相似度一栏为 >=阈值 或 <阈值；无法比较的文档对相似度记为 N/A
+ */
+static int write_pair_results(CorpusJob *job, const char *output_file, int with_first)
+{
+    FILE *file = fopen(output_file, "w");
+    if (file == NULL)
+    {
+        printf("错误：无法创建输出文件: %s\n", output_file);
+        return 1;
+    }
+
+    for (int i = 0; i < job->num_pairs; i++)
+    {
+        PairJob *pair = &job->pairs[i];
+        if (with_first)
+        {
+            fprintf(file, "%s\t", pair->a->doc.path);
+        }
+        if (pair->valid && job->threshold > 0)
+        {
+            fprintf(file, "%s\t%s%.2f\n", pair->b->doc.path, pair->above ? ">=" : "<", job->threshold);
+        }
+        else if (pair->valid)
+        {
+            fprintf(file, "%s\t%.2f\n", pair->b->doc.path, pair->similarity);
+        }
+        else
+        {
+            fprintf(file, "%s\tN/A\n", pair->b->doc.path);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * 批量模式：列表文件每行为一对文档（原文与抄袭版以制表符或空格分隔）
+ * @param pairs_file 文档对列表
+ * @param output_file 输出文件
+ * @param options 命令行选项
+ * @return 程序退出状态码
+ */
+int run_batch_mode(const char *pairs_file, const char *output_file, const Options *options)
+{
+    FILE *file = fopen(pairs_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开列表文件: %s\n", pairs_file);
+        return 1;
+    }
+
+    CorpusJob job;
+    memset(&job, 0, sizeof(job));
+    char line[MAX_LINE_LENGTH];
+
+    while (read_list_line(file, line))
+    {
+        char *split = strchr(line, '\t');
+        if (split == NULL)
+        {
+            split = strchr(line, ' ');
+        }
+        if (split == NULL)
+        {
+            printf("错误：列表格式不正确: %s\n", line);
+            continue;
+        }
+        *split++ = '\0';
+        while (*split == ' ' || *split == '\t')
+        {
+            split++;
+        }
+        CorpusDoc *a = corpus_add_document(&job, line);
+        CorpusDoc *b = corpus_add_document(&job, split);
+        corpus_add_pair(&job, a, b);
+    }
+    fclose(file);
+
+    job.threshold = options->threshold;
+    if (run_corpus_job(&job, options->num_threads) != 0)
+    {
+        free_corpus_job(&job);
+        return 1;
+    }
+    report_missing(&job);
+    if (options->show_stats)
+    {
+        print_shard_layout(&job);
+        print_memory_stats();
+    }
+    int status = write_pair_results(&job, output_file, 1);
+    if (status == 0)
+    {
+        printf("查重完成！共比较 %d 对文档\n", job.num_pairs);
+    }
+    free_corpus_job(&job);
+    return status;
+}
+
+/**
+ * 一对多模式：用一篇原文与语料列表中的每篇文档逐一比较
+ * @param original_file 原文文件
+ * @param list_file 语料列表（每行一个文件路径）
+ * @param output_file 输出文件
+ * @param options 命令行选项
+ * @return 程序退出状态码
+ */
+int run_corpus_mode(const char *original_file, const char *list_file, const char *output_file, const Options *options)
+{
+    FILE *file = fopen(list_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开列表文件: %s\n", list_file);
+        return 1;
+    }
+
+    CorpusJob job;
+    memset(&job, 0, sizeof(job));
+    char line[MAX_LINE_LENGTH];
+    CorpusDoc *original = corpus_add_document(&job, original_file);
+
+    while (read_list_line(file, line))
+    {
+        corpus_add_pair(&job, original, corpus_add_document(&job, line));
+    }
+    fclose(file);
+
+    job.threshold = options->threshold;
+    if (run_corpus_job(&job, options->num_threads) != 0)
+    {
+        free_corpus_job(&job);
+        return 1;
+    }
+    report_missing(&job);
+    if (options->show_stats)
+    {
+        print_shard_layout(&job);
+        print_memory_stats();
+    }
+    int status = write_pair_results(&job, output_file, 0);
+    if (status == 0)
+    {
+        printf("查重完成！共比较 %d 篇文档\n", job.num_pairs);
+    }
+    free_corpus_job(&job);
+    return status;
+}
+
+/**
+ * 两两比较模式：语料列表中任意两篇文档都比较一次（N×N的上三角）
+ * @param list_file 语料列表（每行一个文件路径）
+ * @param output_file 输出文件
+ * @param options 命令行选项
+ * @return 程序退出状态码
+ */
+int run_all_pairs_mode(const char *list_file, const char *output_file, const Options *options)
+{
+    FILE *file = fopen(list_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开列表文件: %s\n", list_file);
+        return 1;
+    }
+
+    CorpusJob job;
+    memset(&job, 0, sizeof(job));
+    char line[MAX_LINE_LENGTH];
+
+    while (read_list_line(file, line))
+    {
+        corpus_add_document(&job, line);
+    }
+    fclose(file);
+
+    for (int i = 0; i < job.num_docs; i++)
+    {
+        for (int j = i + 1; j < job.num_docs; j++)
+        {
+            corpus_add_pair(&job, job.docs[i], job.docs[j]);
+        }
+    }
+
+    job.threshold = options->threshold;
+    if (run_corpus_job(&job, options->num_threads) != 0)
+    {
+        free_corpus_job(&job);
+        return 1;
+    }
+    report_missing(&job);
+    if (options->show_stats)
+    {
+        print_shard_layout(&job);
+        print_memory_stats();
+    }
+    int status = write_pair_results(&job, output_file, 1);
+    if (status == 0)
+    {
+        printf("查重完成！共比较 %d 对文档\n", job.num_pairs);
+    }
+    free_corpus_job(&job);
+    return status;
+}
+
+// ==================== 共享内存特征库 ====================
+
+/**
+ * 读取一篇文档并生成特征
+ * @return 文档特征，文件无法读取时返回NULL
+ */
+static PlagProfile *profile_from_file(const char *path)
+{
+    long long size = get_file_size(path);
+    FILE *file = size >= 0 ? fopen(path, "rb") : NULL;
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    char *data = (char *)malloc(size > 0 ? (size_t)size : 1);
+    size_t length = fread(data, 1, (size_t)size, file);
+    fclose(file);
+
+    PlagProfile *profile = plag_profile_create(data, length);
+    free(data);
+    return profile;
+}
+
+typedef struct
+{
+    char **paths;
+    PlagProfile **profiles;
+    size_t count;
+    atomic_size_t *next;
+} ProfileWorker;
+
+/**
+ * 逐个领取文档生成特征（文档大小可能相差悬殊，不预先平分）
+ */
+static void *profile_worker(void *arg)
+{
+    ProfileWorker *worker = (ProfileWorker *)arg;
+    for (;;)
+    {
+        size_t k = atomic_fetch_add(worker->next, 1);
+        if (k >= worker->count)
+        {
+            return NULL;
+        }
+        worker->profiles[k] = profile_from_file(worker->paths[k]);
+    }
+}
+
+/**
+ * 发布特征库模式：多线程为语料列表中的每篇文档生成特征，平铺写入命名共享内存，
+ * 之后各个进程用 --corpus-store 或 plag_store_attach() 直接映射，不再各自读取和建表；
+ * 有文档无法打开时不发布，免得替换掉上一次完整的特征库
+ * @param list_file 语料列表（每行一个文件路径）
+ * @param name 共享内存名
+ * @param options 命令行选项
+ * @return 程序退出状态码
+ */
+int run_publish_store_mode(const char *list_file, const char *name, const Options *options)
+{
+    FILE *file = fopen(list_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开列表文件: %s\n", list_file);
+        return 1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 16;
+    char **ids = (char **)malloc(capacity * sizeof(char *));
+    char line[MAX_LINE_LENGTH];
+    while (read_list_line(file, line))
+    {
+        if (count == capacity)
+        {
+            capacity *= 2;
+            ids = (char **)realloc(ids, capacity * sizeof(char *));
+        }
+        ids[count++] = strdup(line);
+    }
+    fclose(file);
+
+    PlagProfile **profiles = (PlagProfile **)calloc(count > 0 ? count : 1, sizeof(PlagProfile *));
+    int num_threads = options->num_threads < MAX_THREADS ? options->num_threads : MAX_THREADS;
+    if ((size_t)num_threads > count)
+    {
+        num_threads = (int)count;
+    }
+    atomic_size_t next = 0;
+    ProfileWorker workers[MAX_THREADS];
+    for (int t = 0; t < num_threads; t++)
+    {
+        workers[t].paths = ids;
+        workers[t].profiles = profiles;
+        workers[t].count = count;
+        workers[t].next = &next;
+    }
+    long long start = metrics_start();
+    run_parallel(profile_worker, workers, sizeof(ProfileWorker), num_threads);
+    metrics_record(STAGE_NGRAM, start);
+
+    int missing = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (profiles[i] == NULL)
+        {
+            printf("错误：无法打开文档: %s\n", ids[i]);
+            missing++;
+        }
+    }
+
+    int status = 0;
+    if (missing > 0 || count == 0)
+    {
+        printf("错误：语料不完整（%d 篇文档无法打开，可用 %zu 篇），未发布特征库\n", missing, count - (size_t)missing);
+        status = 1;
+    }
+    else if (plag_store_create(name, (const PlagProfile *const *)profiles, (const char *const *)ids, count) != 0)
+    {
+        printf("错误：无法创建特征库: %s\n", name);
+        status = 1;
+    }
+    else
+    {
+        printf("特征库已发布：文档 %zu 篇，共享内存 %s\n", count, name);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        plag_profile_free(profiles[i]);
+        free(ids[i]);
+    }
+    free(profiles);
+    free(ids);
+    return status;
+}
+
+/**
+ * 特征库比较模式：把一篇文档与共享内存特征库中的全部文档比较，输出格式与 --corpus 相同；
+ * 指定阈值时只判定每篇文档是否达到阈值，结果确定后即停止该篇的比较
+ * @param original_file 原文文件
+ * @param name 共享内存名
+ * @param output_file 输出文件
+ * @param options 命令行选项
+ * @return 程序退出状态码
+ */
+int run_corpus_store_mode(const char *original_file, const char *name, const char *output_file, const Options *options)
+{
+    PlagStore *store = plag_store_attach(name);
+    if (store == NULL)
+    {
+        printf("错误：无法打开特征库: %s\n", name);
+        return 1;
+    }
+    PlagProfile *original = profile_from_file(original_file);
+    if (original == NULL)
+    {
+        printf("错误：无法打开原文文件: %s\n", original_file);
+        plag_store_detach(store);
+        return 1;
+    }
+
+    size_t count = plag_store_count(store);
+    const PlagProfile **profiles = (const PlagProfile **)malloc((count > 0 ? count : 1) * sizeof(PlagProfile *));
+    float *scores = (float *)malloc((count > 0 ? count : 1) * sizeof(float));
+    int *above = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+    for (size_t i = 0; i < count; i++)
+    {
+        profiles[i] = plag_store_profile(store, i);
+    }
+    long long start = metrics_start();
+    if (options->threshold > 0)
+    {
+        profile_threshold_many(original, profiles, count, options->threshold, above, options->num_threads);
+    }
+    else
+    {
+        plag_compare_many(original, profiles, count, scores, options->num_threads);
+    }
+    metrics_record(STAGE_INTERSECT, start);
+
+    int status = 0;
+    FILE *file = fopen(output_file, "w");
+    if (file == NULL)
+    {
+        printf("错误：无法创建输出文件: %s\n", output_file);
+        status = 1;
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (options->threshold > 0)
+            {
+                fprintf(file, "%s\t%s%.2f\n", plag_store_id(store, i), above[i] ? ">=" : "<", options->threshold);
+            }
+            else
+            {
+                fprintf(file, "%s\t%.2f\n", plag_store_id(store, i), scores[i]);
+            }
+        }
+        fclose(file);
+        printf("查重完成！共比较 %zu 篇文档\n", count);
+    }
+
+    free(above);
+    free(scores);
+    free(profiles);
+    plag_profile_free(original);
+    plag_store_detach(store);
+    return status;
+}
+
+// ==================== 准确率与速度评估 ====================
+
+/**
+ * 评估中的一种计算方式
+ * 每种方式对全部标注文档对各完整运行一次（读取、预处理、建表、比较），
+ * 与标注的精确相似度比较误差，按阈值统计判定的精确率与召回率，并记录吞吐量与峰值内存
+ */
+typedef enum
+{
+    EVAL_HASH,
+    EVAL_PARTITION,
+    EVAL_PROFILE,
+    EVAL_SAMPLE,
+    EVAL_THRESHOLD
+} EvalKind;
+
+typedef struct
+{
+    char name[32];
+    EvalKind kind;
+    double rate;
+    double *errors;
+    int evaluated;
+    int scored;
+    double error_sum;
+    double signed_sum;
+    int true_positive;
+    int false_positive;
+    int false_negative;
+    int failed;
+    long long ns;
+    long long bytes;
+    size_t peak_memory;
+} EvalEngine;
+
+/**
+ * 标注文件中的一个文档对
+ */
+typedef struct
+{
+    char *a;
+    char *b;
+    float label;
+} LabeledPair;
+
+/**
+ * 哈希表占用的内存（桶数组加全部节点）
+ */
+static size_t hash_table_memory(const HashTable *ht)
+{
+    return sizeof(HashTable) + (size_t)ht->size * sizeof(NGramNode *) + (size_t)hash_table_nodes(ht) * sizeof(NGramNode);
+}
+
+/**
+ * 处理好的文档占用的内存：预处理后的文本加所用引擎的数据结构
+ */
+static size_t document_memory(const Document *doc)
+{
+    size_t bytes = doc->capacity;
+    if (doc->ht != NULL)
+    {
+        bytes += hash_table_memory(doc->ht);
+    }
+    if (doc->parts != NULL)
+    {
+        bytes += partitioned_grams_bytes(doc->parts);
+    }
+    if (doc->ct != NULL)
+    {
+        bytes += (doc->ct->mask + 1) * (sizeof(unsigned long long) + sizeof(int));
+    }
+    return bytes;
+}
+
+/**
+ * 用一种计算方式完整比较一个文档对
+ * @param ns 返回从开始读取到得出结果的耗时（纳秒）
+ * @param memory 返回两篇文档的数据结构占用的内存
+ * @return 0表示成功，-1表示文件无法打开
+ */
+static int evaluate_pair(const EvalEngine *engine, const LabeledPair *pair, int num_threads, float threshold, float *score,
+                         int *above, long long *ns, size_t *memory)
+{
+    long long start = monotonic_ns();
+    if (engine->kind == EVAL_PROFILE)
+    {
+        PlagProfile *a = profile_from_file(pair->a);
+        PlagProfile *b = profile_from_file(pair->b);
+        if (a != NULL && b != NULL)
+        {
+            *score = plag_compare(a, b);
+            *ns = monotonic_ns() - start;
+            *memory = profile_memory(a) + profile_memory(b);
+        }
+        int status = a != NULL && b != NULL ? 0 : -1;
+        plag_profile_free(a);
+        plag_profile_free(b);
+        return status;
+    }
+
+    Document docs[2];
+    memset(docs, 0, sizeof(docs));
+    docs[0].path = pair->a;
+    docs[1].path = pair->b;
+    docs[0].num_threads = docs[1].num_threads = num_threads > 1 ? (num_threads + 1) / 2 : 1;
+    Engine kind = engine->kind == EVAL_PARTITION ? ENGINE_PARTITION : engine->kind == EVAL_SAMPLE ? ENGINE_SAMPLE : ENGINE_HASH;
+    docs[0].engine = docs[1].engine = kind;
+    if (kind == ENGINE_PARTITION)
+    {
+        long long largest = get_file_size(pair->a);
+        long long size = get_file_size(pair->b);
+        docs[0].partition_bits = docs[1].partition_bits = choose_partition_bits(size > largest ? size : largest);
+    }
+    if (kind == ENGINE_SAMPLE)
+    {
+        docs[0].sample_limit = docs[1].sample_limit = sample_limit(engine->rate);
+    }
+
+    process_documents(docs, 2);
+    int status = docs[0].status != 0 || docs[1].status != 0 ? -1 : 0;
+    if (status == 0)
+    {
+        if (engine->kind == EVAL_THRESHOLD)
+        {
+            *above = threshold_check(docs, kind, num_threads, threshold);
+        }
+        else if (kind == ENGINE_SAMPLE)
+        {
+            *score = sampled_jaccard_similarity(docs[0].ct, docs[1].ct, engine->rate).similarity;
+        }
+        else if (kind == ENGINE_PARTITION)
+        {
+            *score = partitioned_jaccard_similarity(docs[0].parts, docs[1].parts, num_threads);
+        }
+        else
+        {
+            *score = calculate_jaccard_similarity(docs[0].ht, docs[1].ht);
+        }
+        *ns = monotonic_ns() - start;
+        *memory = document_memory(&docs[0]) + document_memory(&docs[1]);
+    }
+    free_document(&docs[0]);
+    free_document(&docs[1]);
+    return status;
+}
+
+static int compare_errors(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * 读取标注文件：每行为 原文<TAB>抄袭版<TAB>相似度，其后的列被忽略
+ * （gencorpus 生成的 labels.txt 和 truth.txt 都是这种格式）
+ * @return 文档对数量，文件无法打开时返回-1
+ */
+static int load_labeled_pairs(const char *labels_file, LabeledPair **pairs)
+{
+    FILE *file = fopen(labels_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开标注文件: %s\n", labels_file);
+        return -1;
+    }
+
+    int count = 0;
+    int capacity = 64;
+    *pairs = (LabeledPair *)malloc(capacity * sizeof(LabeledPair));
+    char line[MAX_LINE_LENGTH];
+    while (read_list_line(file, line))
+    {
+        char *b = strchr(line, '\t');
+        char *label = b != NULL ? strchr(b + 1, '\t') : NULL;
+        char *end = NULL;
+        float value = 0.0f;
+        if (label != NULL)
+        {
+            *b++ = '\0';
+            *label++ = '\0';
+            value = strtof(label, &end);
+        }
+        if (end == NULL || end == label || (*end != '\0' && *end != '\t'))
+        {
+            printf("错误：标注格式不正确: %s\n", line);
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            *pairs = (LabeledPair *)realloc(*pairs, capacity * sizeof(LabeledPair));
+        }
+        (*pairs)[count].label = value;
+        (*pairs)[count].a = strdup(line);
+        (*pairs)[count].b = strdup(b);
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static void free_labeled_pairs(LabeledPair *pairs, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(pairs[i].a);
+        free(pairs[i].b);
+    }
+    free(pairs);
+}
+
+/**
+ * 打印并写出一种计算方式的评估结果
+ */
+static void report_engine(FILE *out, const EvalEngine *engine)
+{
+    char precision[16] = "-";
+    char recall[16] = "-";
+    if (engine->true_positive + engine->false_positive > 0)
+    {
+        snprintf(precision, sizeof(precision), "%.4f", (double)engine->true_positive / (engine->true_positive + engine->false_positive));
+    }
+    if (engine->true_positive + engine->false_negative > 0)
+    {
+        snprintf(recall, sizeof(recall), "%.4f", (double)engine->true_positive / (engine->true_positive + engine->false_negative));
+    }
+
+    char mae[16] = "-";
+    char p95[16] = "-";
+    char max[16] = "-";
+    char bias[16] = "-";
+    if (engine->scored > 0)
+    {
+        snprintf(mae, sizeof(mae), "%.4f", engine->error_sum / engine->scored);
+        snprintf(p95, sizeof(p95), "%.4f", engine->errors[(int)ceil(0.95 * engine->scored) - 1]);
+        snprintf(max, sizeof(max), "%.4f", engine->errors[engine->scored - 1]);
+        snprintf(bias, sizeof(bias), "%+.4f", engine->signed_sum / engine->scored);
+    }
+
+    double seconds = (double)engine->ns / 1e9;
+    double mb_per_second = seconds > 0.0 ? (double)engine->bytes / 1048576.0 / seconds : 0.0;
+    double peak = (double)engine->peak_memory / 1048576.0;
+
+    printf("%-14s %8s %8s %8s %8s %8s %8s %10.1f %10.1f %10.2f\n", engine->name, mae, p95, max, bias, precision, recall,
+           mb_per_second, peak, seconds);
+    fprintf(out, "%s\t%d\t%s\t%s\t%s\t%s\t%s\t%s\t%.2f\t%.2f\t%.3f\n", engine->name, engine->evaluated, mae, p95, max, bias, precision,
+            recall, mb_per_second, peak, seconds);
+}
+
+/**
+ * 评估模式：用每种计算方式比较标注文件中的全部文档对，报告误差分布、阈值判定的精确率与召回率、吞吐量与峰值内存
+ * 参与评估的方式：hash（链地址哈希表）、partition（分区引擎）、profile（plag_* 接口的有序特征）、
+ * sample（哈希抽样估计，默认抽样10%和1%，给出 --sample 时只评估该比例）、threshold（阈值判定，只参与精确率与召回率）
+ * @param labels_file 标注文件（每行为 原文<TAB>抄袭版<TAB>相似度）
+ * @param output_file 报告文件（制表符分隔，每种方式一行）
+ * @param options 命令行选项；threshold 为精确率与召回率使用的判定线，未给出时为 EVALUATE_THRESHOLD
+ * @return 程序退出状态码
+ */
+int run_evaluate_mode(const char *labels_file, const char *output_file, const Options *options)
+{
+    LabeledPair *pairs;
+    int num_pairs = load_labeled_pairs(labels_file, &pairs);
+    if (num_pairs < 0)
+    {
+        return 1;
+    }
+    FILE *out = fopen(output_file, "w");
+    if (out == NULL)
+    {
+        printf("错误：无法创建输出文件: %s\n", output_file);
+        free_labeled_pairs(pairs, num_pairs);
+        return 1;
+    }
+
+    float threshold = options->threshold > 0.0f ? options->threshold : EVALUATE_THRESHOLD;
+    EvalEngine engines[6];
+    int num_engines = 0;
+    memset(engines, 0, sizeof(engines));
+    snprintf(engines[num_engines].name, sizeof(engines[0].name), "hash");
+    engines[num_engines++].kind = EVAL_HASH;
+    snprintf(engines[num_engines].name, sizeof(engines[0].name), "partition");
+    engines[num_engines++].kind = EVAL_PARTITION;
+    snprintf(engines[num_engines].name, sizeof(engines[0].name), "profile");
+    engines[num_engines++].kind = EVAL_PROFILE;
+    double rates[2] = {0.1, 0.01};
+    int num_rates = options->sample_rate > 0.0 ? 1 : 2;
+    if (options->sample_rate > 0.0)
+    {
+        rates[0] = options->sample_rate;
+    }
+    for (int r = 0; r < num_rates; r++)
+    {
+        snprintf(engines[num_engines].name, sizeof(engines[0].name), "sample@%g%%", rates[r] * 100);
+        engines[num_engines].rate = rates[r];
+        engines[num_engines++].kind = EVAL_SAMPLE;
+    }
+    snprintf(engines[num_engines].name, sizeof(engines[0].name), "threshold");
+    engines[num_engines++].kind = EVAL_THRESHOLD;
+
+    printf("评估 %d 个文档对，判定线 %.2f\n", num_pairs, threshold);
+    printf("%-14s %8s %8s %8s %8s %8s %8s %10s %10s %10s\n", "engine", "mae", "p95", "max", "bias", "precision", "recall",
+           "MB/s", "peak MB", "seconds");
+    fprintf(out, "engine\tpairs\tmae\tp95_error\tmax_error\tbias\tprecision\trecall\tmb_per_s\tpeak_mb\tseconds\n");
+
+    for (int e = 0; e < num_engines; e++)
+    {
+        EvalEngine *engine = &engines[e];
+        engine->errors = (double *)malloc((num_pairs > 0 ? num_pairs : 1) * sizeof(double));
+        for (int i = 0; i < num_pairs; i++)
+        {
+            float score = 0.0f;
+            int above = 0;
+            long long ns = 0;
+            size_t memory = 0;
+            if (evaluate_pair(engine, &pairs[i], options->num_threads, threshold, &score, &above, &ns, &memory) != 0)
+            {
+                // 每个文档对只报告一次
+                if (e == 0)
+                {
+                    printf("错误：无法打开文档对: %s %s\n", pairs[i].a, pairs[i].b);
+                }
+                engine->failed++;
+                continue;
+            }
+            if (engine->kind != EVAL_THRESHOLD)
+            {
+                double error = (double)score - (double)pairs[i].label;
+                engine->errors[engine->scored++] = fabs(error);
+                engine->error_sum += fabs(error);
+                engine->signed_sum += error;
+                above = score >= threshold;
+            }
+            int truth = pairs[i].label >= threshold;
+            engine->true_positive += above && truth;
+            engine->false_positive += above && !truth;
+            engine->false_negative += !above && truth;
+            engine->evaluated++;
+            engine->ns += ns;
+            engine->bytes += get_file_size(pairs[i].a) + get_file_size(pairs[i].b);
+            engine->peak_memory = memory > engine->peak_memory ? memory : engine->peak_memory;
+        }
+        qsort(engine->errors, engine->scored, sizeof(double), compare_errors);
+        report_engine(out, engine);
+        free(engine->errors);
+    }
+
+    int status = engines[0].failed > 0;
+    if (fclose(out) != 0)
+    {
+        status = 1;
+    }
+    free_labeled_pairs(pairs, num_pairs);
+    return status;
+}
+
+// ==================== 常驻查重服务 ====================
+
+/**
+ * 一次查询的一个结果
+ */
+typedef struct
+{
+    int doc;
+    long long intersection;
+    float similarity;
+    double error;
+} QueryResult;
+
+/**
+ * 一条查询的临时空间，在多次查询之间复用，避免每次查询都重新分配
+ * keys/counts是查询文本中不同n-gram的开放寻址表，used记录已占用的槽位，清空时只重置这些槽位；
+ * deadline非0时是查询的截止时间（monotonic_ns()的值），到期后不再比较，scored是到期前已比较的不同n-gram数
+ */
+typedef struct
+{
+    char *text;
+    size_t *map;
+    size_t *position_slots;
+    size_t text_capacity;
+    unsigned long long *keys;
+    int *counts;
+    long long *key_index;
+    size_t *used;
+    size_t num_used;
+    size_t mask;
+    QueryResult results[SERVER_MAX_RESULTS];
+    int num_results;
+    long long total;
+    int max_count;
+    long long deadline;
+    int expired;
+    size_t scored;
+} QueryScratch;
+
+/**
+ * 批量查询中一条查询的一个不同n-gram，挂在批内合并表对应键的链表上
+ */
+typedef struct
+{
+    int query;
+    int count;
+    size_t slot;
+    int next;
+} BatchEntry;
+
+/**
+ * 查询线程私有的批量打分空间
+ * 同一批的所有查询先合并出不同n-gram的并集（keys/heads），每个键的倒排表只扫描一次；
+ * intersections按 文档 × 批内序号 排列，同一文档的各查询累加值在同一缓存行内
+ */
+typedef struct
+{
+    QueryScratch *queries;
+    int capacity;
+    unsigned long long *keys;
+    int *heads;
+    size_t *used;
+    size_t num_used;
+    size_t mask;
+    BatchEntry *entries;
+    size_t num_entries;
+    size_t entry_capacity;
+    long long *intersections;
+    int *hits;
+    int num_hits;
+} BatchScratch;
+
+static void init_batch_scratch(BatchScratch *b, int num_docs, int capacity)
+{
+    memset(b, 0, sizeof(BatchScratch));
+    b->capacity = capacity;
+    b->queries = (QueryScratch *)calloc(capacity, sizeof(QueryScratch));
+    b->intersections = (long long *)calloc((size_t)(num_docs + 1) * capacity, sizeof(long long));
+    b->hits = (int *)malloc((num_docs + 1) * sizeof(int));
+}
+
+static void free_batch_scratch(BatchScratch *b)
+{
+    for (int i = 0; i < b->capacity; i++)
+    {
+        QueryScratch *q = &b->queries[i];
+        free(q->text);
+        free(q->map);
+        free(q->position_slots);
+        free(q->keys);
+        free(q->counts);
+        free(q->key_index);
+        free(q->used);
+    }
+    free(b->queries);
+    free(b->keys);
+    free(b->heads);
+    free(b->used);
+    free(b->entries);
+    free(b->intersections);
+    free(b->hits);
+}
+
+/**
+ * 计算容纳distinct个不同键、装载因子不超过一半的开放寻址表容量
+ */
+static size_t open_table_capacity(size_t distinct)
+{
+    if (N_GRAM * 8 < 62 && distinct > ((size_t)1 << (N_GRAM * 8)))
+    {
+        distinct = (size_t)1 << (N_GRAM * 8);
+    }
+    size_t capacity = 16;
+    while (capacity < distinct * 2)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/**
+ * 按查询长度扩充临时空间，只增不减
+ */
+static void reserve_query_scratch(QueryScratch *q, size_t raw_length)
+{
+    if (raw_length + 1 > q->text_capacity)
+    {
+        q->text_capacity = raw_length + 1;
+        q->text = (char *)realloc(q->text, q->text_capacity);
+        q->map = (size_t *)realloc(q->map, q->text_capacity * sizeof(size_t));
+        q->position_slots = (size_t *)realloc(q->position_slots, q->text_capacity * sizeof(size_t));
+    }
+
+    size_t capacity = open_table_capacity(raw_length);
+    if (q->keys == NULL || capacity > q->mask + 1)
+    {
+        free(q->keys);
+        free(q->counts);
+        free(q->key_index);
+        free(q->used);
+        q->keys = (unsigned long long *)calloc(capacity, sizeof(unsigned long long));
+        q->counts = (int *)calloc(capacity, sizeof(int));
+        q->key_index = (long long *)malloc(capacity * sizeof(long long));
+        q->used = (size_t *)malloc(capacity / 2 * sizeof(size_t));
+        q->mask = capacity - 1;
+    }
+}
+
+/**
+ * 预处理查询文本并统计其n-gram，同时记下每个位置落在哪个槽位（用于计算匹配片段）
+ * @param deadline 查询的截止时间，0表示不限时
+ */
+static void collect_query(QueryScratch *q, const char *raw, size_t raw_length, long long deadline)
+{
+    size_t consumed;
+    reserve_query_scratch(q, raw_length);
+    q->deadline = deadline;
+    q->expired = 0;
+    q->scored = 0;
+    q->max_count = 0;
+    long long start = metrics_start();
+    size_t length = normalize_block_mapped(raw, raw_length, q->text, q->map, &consumed, 1);
+    q->text[length] = '\0';
+    metrics_record(STAGE_NORMALIZE, start);
+    start = metrics_start();
+
+    long long positions = (long long)length - N_GRAM + 1;
+    q->total = positions > 0 ? positions : 0;
+    q->num_results = 0;
+
+    for (long long i = 0; i < positions; i += PROBE_BATCH)
+    {
+        unsigned long long keys[PROBE_BATCH];
+        unsigned int hashes[PROBE_BATCH];
+        int count = positions - i < PROBE_BATCH ? (int)(positions - i) : PROBE_BATCH;
+
+        hash_key_block(q->text + i, count, keys, hashes);
+        for (int k = 0; k < count; k++)
+        {
+            size_t slot = hashes[k] & q->mask;
+            while (q->keys[slot] != 0 && q->keys[slot] != keys[k])
+            {
+                slot = (slot + 1) & q->mask;
+            }
+            if (q->keys[slot] == 0)
+            {
+                q->keys[slot] = keys[k];
+                q->key_index[slot] = -1;
+                q->used[q->num_used++] = slot;
+            }
+            q->counts[slot]++;
+            q->max_count = q->counts[slot] > q->max_count ? q->counts[slot] : q->max_count;
+            q->position_slots[i + k] = slot;
+        }
+    }
+    metrics_record(STAGE_NGRAM, start);
+}
+
+static int compare_query_result(const void *a, const void *b)
+{
+    const QueryResult *x = (const QueryResult *)a;
+    const QueryResult *y = (const QueryResult *)b;
+    if (x->similarity != y->similarity)
+    {
+        return x->similarity > y->similarity ? -1 : 1;
+    }
+    return x->doc - y->doc;
+}
+
+/**
+ * 把一个候选结果放进查询的前SERVER_MAX_RESULTS名
+ */
+static void offer_query_result(QueryScratch *q, QueryResult result)
+{
+    if (q->num_results < SERVER_MAX_RESULTS)
+    {
+        q->results[q->num_results++] = result;
+    }
+    else if (compare_query_result(&result, &q->results[SERVER_MAX_RESULTS - 1]) < 0)
+    {
+        q->results[SERVER_MAX_RESULTS - 1] = result;
+    }
+    else
+    {
+        return;
+    }
+    qsort(q->results, q->num_results, sizeof(QueryResult), compare_query_result);
+}
+
+/**
+ * 把批内所有查询的不同n-gram合并到一张表上，同一个键的各查询串成链表
+ */
+static void merge_batch_keys(BatchScratch *b, int count)
+{
+    size_t distinct = 0;
+    for (int i = 0; i < count; i++)
+    {
+        distinct += b->queries[i].num_used;
+    }
+
+    size_t capacity = open_table_capacity(distinct);
+    if (b->keys == NULL || capacity > b->mask + 1)
+    {
+        free(b->keys);
+        free(b->heads);
+        free(b->used);
+        b->keys = (unsigned long long *)calloc(capacity, sizeof(unsigned long long));
+        b->heads = (int *)malloc(capacity * sizeof(int));
+        b->used = (size_t *)malloc(capacity / 2 * sizeof(size_t));
+        b->mask = capacity - 1;
+    }
+    if (distinct > b->entry_capacity)
+    {
+        b->entry_capacity = distinct;
+        b->entries = (BatchEntry *)realloc(b->entries, distinct * sizeof(BatchEntry));
+    }
+
+    b->num_entries = 0;
+    for (int i = 0; i < count; i++)
+    {
+        QueryScratch *q = &b->queries[i];
+        for (size_t u = 0; u < q->num_used; u++)
+        {
+            unsigned long long key = q->keys[q->used[u]];
+            size_t slot = gram_key_hash(key) & b->mask;
+            while (b->keys[slot] != 0 && b->keys[slot] != key)
+            {
+                slot = (slot + 1) & b->mask;
+            }
+            if (b->keys[slot] == 0)
+            {
+                b->keys[slot] = key;
+                b->heads[slot] = -1;
+                b->used[b->num_used++] = slot;
+            }
+
+            BatchEntry *entry = &b->entries[b->num_entries];
+            entry->query = i;
+            entry->count = q->counts[q->used[u]];
+            entry->slot = q->used[u];
+            entry->next = b->heads[slot];
+            b->heads[slot] = (int)b->num_entries++;
+        }
+    }
+}
+
+/**
+ * 把已到截止时间的查询标记为到期，返回本次新到期的查询数
+ * 到期前至少要比较SERVER_DEADLINE_MIN_GRAMS个不同n-gram（或全部比较完），保证能给出估计值
+ */
+static int expire_queries(BatchScratch *b, int count)
+{
+    long long now = monotonic_ns();
+    int expired = 0;
+    for (int i = 0; i < count; i++)
+    {
+        QueryScratch *q = &b->queries[i];
+        if (q->deadline != 0 && !q->expired && now >= q->deadline &&
+            (q->scored >= SERVER_DEADLINE_MIN_GRAMS || q->scored == q->num_used))
+        {
+            q->expired = 1;
+            expired++;
+        }
+    }
+    return expired;
+}
+
+/**
+ * 由到期前比较的部分估计相似度
+ * 遍历按槽位顺序进行，槽位取自键的哈希，已比较的不同n-gram相当于以比例 f = scored / 不同n-gram数 做的哈希抽样：
+ * 交集按 I / f 估计；每个n-gram对交集的贡献不超过它在查询中的最大次数c，估计量的方差不超过 (1 - f) / f² · c · I，
+ * 误差取其平方根的1.96倍，再按 J = I / (Tq + Td - I) 的斜率换算到相似度
+ */
+static void estimate_query_result(const QueryScratch *q, long long doc_total, QueryResult *result)
+{
+    double f = (double)q->scored / (double)q->num_used;
+    double limit = (double)(q->total < doc_total ? q->total : doc_total);
+    double intersection = (double)result->intersection / f;
+    intersection = intersection < limit ? intersection : limit;
+    double sum = (double)(q->total + doc_total);
+    double union_total = sum - intersection;
+    double error = 1.96 * sqrt((1.0 - f) / (f * f) * q->max_count * (double)result->intersection);
+
+    result->similarity = union_total > 0.0 ? (float)(intersection / union_total) : 0.0f;
+    result->error = union_total > 0.0 ? error * sum / (union_total * union_total) : 1.0;
+    result->error = result->error < 1.0 ? result->error : 1.0;
+}
+
+/**
+ * 用倒排索引给一批查询打分：先合并全批的n-gram，每个不同的键只查一次索引、只扫描一次倒排表，
+ * 逐个 (查询, 文档) 累加 min(查询次数, 文档次数) 得到交集，再与两边总数求Jaccard相似度
+ * 只有一条查询时与逐条打分完全相同；结果保存在各条查询的results中
+ * 批内有限时查询时改按槽位顺序遍历，每SERVER_DEADLINE_CHECK个槽位检查一次时钟，到期的查询不再累加，
+ * 其结果由已比较的部分估计（estimate_query_result()）；其余查询照常算完，结果不受影响
+ * @param index 倒排索引
+ * @param b 当前线程的批量打分空间
+ * @param count 批内查询数（queries[0..count) 已由collect_query()填好）
+ */
+static void score_batch(const CorpusIndex *index, BatchScratch *b, int count)
+{
+    int width = b->capacity;
+    int timed = 0;
+
+    merge_batch_keys(b, count);
+    b->num_hits = 0;
+    for (int i = 0; i < count; i++)
+    {
+        timed += b->queries[i].deadline != 0;
+    }
+
+    int active = count;
+    size_t limit = timed > 0 ? b->mask + 1 : b->num_used;
+    for (size_t u = 0; u < limit && active > 0; u++)
+    {
+        if (timed > 0 && u % SERVER_DEADLINE_CHECK == 0)
+        {
+            active -= expire_queries(b, count);
+        }
+        size_t slot = timed > 0 ? u : b->used[u];
+        if (b->keys[slot] == 0)
+        {
+            continue;
+        }
+        int live = 0;
+        for (int e = b->heads[slot]; e >= 0; e = b->entries[e].next)
+        {
+            live |= !b->queries[b->entries[e].query].expired;
+        }
+        if (!live)
+        {
+            continue;
+        }
+
+        long long key_index = corpus_index_find(index, b->keys[slot]);
+        for (int e = b->heads[slot]; e >= 0; e = b->entries[e].next)
+        {
+            QueryScratch *q = &b->queries[b->entries[e].query];
+            if (!q->expired)
+            {
+                q->key_index[b->entries[e].slot] = key_index;
+                q->scored++;
+            }
+        }
+        if (key_index < 0)
+        {
+            continue;
+        }
+
+        for (size_t p = index->offsets[key_index]; p < index->offsets[key_index + 1]; p++)
+        {
+            const Posting *posting = &index->postings[p];
+            long long *row = &b->intersections[(size_t)posting->doc * width];
+            int touched = 0;
+            for (int i = 0; i < count; i++)
+            {
+                touched |= row[i] != 0;
+            }
+            if (!touched)
+            {
+                b->hits[b->num_hits++] = posting->doc;
+            }
+            for (int e = b->heads[slot]; e >= 0; e = b->entries[e].next)
+            {
+                if (b->queries[b->entries[e].query].expired)
+                {
+                    continue;
+                }
+                int c = b->entries[e].count;
+                row[b->entries[e].query] += c < posting->count ? c : posting->count;
+            }
+        }
+    }
+
+    for (int h = 0; h < b->num_hits; h++)
+    {
+        int doc = b->hits[h];
+        long long *row = &b->intersections[(size_t)doc * width];
+        for (int i = 0; i < count; i++)
+        {
+            if (row[i] == 0)
+            {
+                continue;
+            }
+            QueryScratch *q = &b->queries[i];
+            QueryResult result;
+            result.doc = doc;
+            result.intersection = row[i];
+            result.similarity = jaccard_from_counts(row[i], q->total + index->totals[doc] - row[i]);
+            result.error = 0.0;
+            if (q->scored < q->num_used)
+            {
+                estimate_query_result(q, index->totals[doc], &result);
+            }
+            offer_query_result(q, result);
+            row[i] = 0;
+        }
+    }
+
+    for (size_t u = 0; u < b->num_used; u++)
+    {
+        b->keys[b->used[u]] = 0;
+    }
+    b->num_used = 0;
+}
+
+/**
+ * 查询结束后清空n-gram表（只重置用到的槽位）
+ */
+static void reset_query_scratch(QueryScratch *q)
+{
+    for (size_t u = 0; u < q->num_used; u++)
+    {
+        q->keys[q->used[u]] = 0;
+        q->counts[q->used[u]] = 0;
+    }
+    q->num_used = 0;
+}
+
+#ifdef HAVE_UNIX_SOCKET
+/**
+ * 可自动扩容的回复缓冲区
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} ReplyBuffer;
+
+static void reply_printf(ReplyBuffer *reply, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply_printf(ReplyBuffer *reply, const char *format, ...)
+{
+    for (;;)
+    {
+        va_list args;
+        va_start(args, format);
+        int need = vsnprintf(reply->data + reply->length, reply->capacity - reply->length, format, args);
+        va_end(args);
+        if (need >= 0 && (size_t)need < reply->capacity - reply->length)
+        {
+            reply->length += (size_t)need;
+            return;
+        }
+        reply->capacity = reply->capacity * 2 + (need > 0 ? (size_t)need : 0) + 256;
+        reply->data = (char *)realloc(reply->data, reply->capacity);
+    }
+}
+
+/**
+ * 把查询结果写成回复：
+ *   OK <结果数> <查询n-gram数>
+ *   <相似度>\t<文档路径>\t<匹配片段>      （每个结果一行）
+ * 匹配片段是原始查询文本中的字节区间 起点-终点（不含终点），多个片段以逗号分隔，没有时为 -
+ * 查询到期未比较完时第一行为 OK <结果数> <查询n-gram数> APPROX <已比较的不同n-gram比例>，
+ * 每个结果行末尾再加一列 \t<误差>，真实相似度以约95%的概率落在 相似度 ± 误差 内；匹配片段只含已比较的部分
+ */
+static void format_query_reply(const CorpusIndex *index, const QueryScratch *q, ReplyBuffer *reply)
+{
+    int exact = q->scored == q->num_used;
+    if (exact)
+    {
+        reply_printf(reply, "OK %d %lld\n", q->num_results, q->total);
+    }
+    else
+    {
+        reply_printf(reply, "OK %d %lld APPROX %.4f\n", q->num_results, q->total, (double)q->scored / (double)q->num_used);
+    }
+
+    for (int r = 0; r < q->num_results; r++)
+    {
+        int doc = q->results[r].doc;
+        int spans = 0;
+        long long span_start = -1;
+        long long span_end = -1;
+
+        reply_printf(reply, "%.2f\t%s\t", q->results[r].similarity, index->paths[doc]);
+
+        // 连续命中的位置合并为一个片段，位置i的n-gram覆盖预处理后文本的 [i, i + N_GRAM)
+        for (long long i = 0; i <= q->total; i++)
+        {
+            int matched = 0;
+            if (i < q->total)
+            {
+                long long key_index = q->key_index[q->position_slots[i]];
+                matched = key_index >= 0 && posting_has_doc(index, key_index, doc);
+            }
+            if (matched && span_start >= 0 && i <= span_end)
+            {
+                span_end = i + N_GRAM;
+            }
+            else if (matched || i == q->total)
+            {
+                if (span_start >= 0)
+                {
+                    reply_printf(reply, "%s%zu-%zu", spans++ > 0 ? "," : "", q->map[span_start], q->map[span_end - 1] + 1);
+                }
+                span_start = matched ? i : -1;
+                span_end = i + N_GRAM;
+            }
+        }
+        reply_printf(reply, "%s", spans > 0 ? "" : "-");
+        if (!exact)
+        {
+            reply_printf(reply, "\t%.4f", q->results[r].error);
+        }
+        reply_printf(reply, "\n");
+    }
+}
+
+/**
+ * 查询类别：交互查询是单篇文档的即时查重，批量查询是语料重扫等后台任务
+ */
+typedef enum
+{
+    QUERY_INTERACTIVE,
+    QUERY_BULK,
+    QUERY_CLASSES
+} QueryClass;
+
+/**
+ * 单个类别的等待队列，长度上限为limit；avg_ns是该类查询单条处理耗时的滑动平均，用于估算重试等待时间
+ */
+typedef struct
+{
+    struct ServerQuery *head;
+    struct ServerQuery *tail;
+    int length;
+    int limit;
+    long long avg_ns;
+} QueryQueue;
+
+/**
+ * 一次待处理的查询，由连接线程提交、查询线程完成后唤醒连接线程
+ */
+typedef struct ServerQuery
+{
+    QueryClass query_class;
+    const char *raw;
+    size_t raw_length;
+    ReplyBuffer *reply;
+    struct timespec arrival;
+    long long deadline;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    struct ServerQuery *next;
+} ServerQuery;
+
+/**
+ * 服务状态
+ * 当前索引通过原子指针发布，更新索引时按纪元回收旧索引（RCU风格）：查询线程处理每一批查询前
+ * 把当前纪元记入reader_epochs中自己的槽位再读取索引指针，处理完清零；更新线程换上新指针并推进纪元后，
+ * 等所有槽位都为0或不小于新纪元，就不再有线程持有旧索引，此时才释放它
+ * 交互查询和批量查询分别排队：两类都有查询时按SERVER_INTERACTIVE_WEIGHT:1的比例轮流取，
+ * 多线程时0号查询线程只接交互查询，其余bulk_workers个线程两类都接，并以较低的调度优先级运行，
+ * 批量查询再多也只能占用这些线程，抢不走交互查询的线程和CPU
+ */
+typedef struct
+{
+    CorpusIndex *_Atomic index;
+    atomic_ullong epoch;
+    atomic_ullong *reader_epochs;
+    const char *source;
+    int num_threads;
+    atomic_int reloading;
+    pthread_t reloader;
+    int has_reloader;
+    QueryQueue queues[QUERY_CLASSES];
+    int bulk_workers;
+    int interactive_streak;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t has_query;
+    pthread_t *workers;
+    int num_workers;
+    int batch_window_us;
+    int deadline_ms;
+    int connections[SERVER_MAX_CONNECTIONS];
+    int num_connections;
+    pthread_cond_t drained;
+} Server;
+
+typedef struct
+{
+    Server *server;
+    int fd;
+} Connection;
+
+typedef struct
+{
+    Server *server;
+    int id;
+} ServerWorkerContext;
+
+static volatile sig_atomic_t server_interrupted = 0;
+static volatile sig_atomic_t server_reload_requested = 0;
+
+static void server_signal_handler(int sig)
+{
+    if (sig == SIGHUP)
+    {
+        server_reload_requested = 1;
+    }
+    else
+    {
+        server_interrupted = 1;
+    }
+}
 
 /**
- * n-gram节点结构体
- * 用于存储每个n-gram片段及其出现次数
+ * 创建服务线程，新线程屏蔽SIGINT/SIGTERM/SIGHUP，保证这些信号总是由主线程在pselect()中接收
  */
-typedef struct NGramNode
+static int create_server_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
 {
-    char gram[N_GRAM + 1];
-    int count;
-    struct NGramNode *next;
-} NGramNode;
+    sigset_t block;
+    sigset_t saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGHUP);
+
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    int error = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return error;
+}
 
 /**
- * 哈希表结构体
- * 用于高效存储和查找n-gram，提高查询效率
+ * 每条批内查询在每篇文档上占一个累加槽，批大小受SERVER_BATCH_MEMORY限制
  */
-typedef struct
+static int batch_capacity_for(const CorpusIndex *index)
 {
-    NGramNode **table;
-    int size;
-} HashTable;
-
-// 函数声明
-void remove_punctuation(char *str);
-void to_lower_case(char *str);
-HashTable *create_hash_table(int size);
-void free_hash_table(HashTable *ht);
-unsigned int hash_function(const char *str, int table_size);
-void addhash(HashTable *ht, const char *gram);
-int get_intersection_count(HashTable *ht1, HashTable *ht2);
-int get_union_count(HashTable *ht1, HashTable *ht2);
-float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized);
-void generate_ngrams(const char *text, HashTable *ht);
+    long long capacity = SERVER_BATCH_MEMORY / ((long long)(index->num_docs + 1) * (long long)sizeof(long long));
+    return capacity < 1 ? 1 : capacity > SERVER_MAX_BATCH ? SERVER_MAX_BATCH : (int)capacity;
+}
 
 /**
- * 程序主入口
- * @param argc 命令行参数个数（包括程序名本身）
- * @param argv 命令行参数数组（字符串数组）
- * @return 程序退出状态码（0表示成功，非0表示失败）
+ * 从队列头部取出一条查询，队列为空时返回NULL（调用者持有server->lock）
  */
-int main(int argc, char *argv[])
+static ServerQuery *server_pop(QueryQueue *queue)
 {
-    if (argc != 4)
+    ServerQuery *query = queue->head;
+    if (query != NULL)
     {
-        printf("错误: 参数数量不正确！\n");
-        printf("使用方法: %s <原文文件> <抄袭版文件> <输出文件>\n", argv[0]);
-        return 1;
+        queue->head = query->next;
+        if (queue->head == NULL)
+        {
+            queue->tail = NULL;
+        }
+        queue->length--;
     }
+    return query;
+}
 
-    char *original_file = argv[1];
-    char *plagiarized_file = argv[2];
-    char *output_file = argv[3];
+/**
+ * 选出下一批要处理的查询类别，没有可处理的查询时返回-1（调用者持有server->lock）
+ * 只有may_bulk的线程取批量查询；两类都可取时，连续取SERVER_INTERACTIVE_WEIGHT批交互查询后让批量查询取一批
+ */
+static int server_pick_class(Server *server, int may_bulk)
+{
+    int interactive = server->queues[QUERY_INTERACTIVE].head != NULL;
+    int bulk = may_bulk && server->queues[QUERY_BULK].head != NULL;
 
-    // 读取原文文件
-    FILE *file = fopen(original_file, "r");
-    if (file == NULL)
+    if (interactive && (!bulk || server->interactive_streak < SERVER_INTERACTIVE_WEIGHT))
     {
-        printf("错误：无法打开原文文件: %s\n", original_file);
-        return 1;
+        server->interactive_streak++;
+        return QUERY_INTERACTIVE;
+    }
+    if (bulk)
+    {
+        server->interactive_streak = 0;
+        return QUERY_BULK;
     }
+    return -1;
+}
 
-    char original_text[MAX_FILE_SIZE];
-    size_t original_len = fread(original_text, 1, MAX_FILE_SIZE - 1, file);
-    original_text[original_len] = '\0';
-    fclose(file);
+/**
+ * 查询线程：每个线程持有自己的批量打分空间，每次从队列中取出一批查询一起打分
+ * 队列中已积压的查询直接并入同一批；设置了合并窗口时，不足一批还会继续等待，
+ * 但最多等到第一条查询到达后batch_window_us微秒，由此限定合并带来的额外延迟
+ */
+static void *server_worker(void *arg)
+{
+    ServerWorkerContext *context = (ServerWorkerContext *)arg;
+    Server *server = context->server;
+    atomic_ullong *reader_epoch = &server->reader_epochs[context->id];
+    ServerQuery *queries[SERVER_MAX_BATCH];
+    BatchScratch batch;
+    int scratch_docs = -1;
+    int may_bulk = context->id >= server->num_workers - server->bulk_workers;
 
-    // 读取抄袭版文件
-    file = fopen(plagiarized_file, "r");
-    if (file == NULL)
+#ifdef __linux__
+    // Linux上nice值按线程生效；只有一个线程时它也要接交互查询，不降低优先级
+    if (may_bulk && server->num_workers > 1)
     {
-        printf("错误：无法打开抄袭版文件: %s\n", plagiarized_file);
-        return 1;
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SERVER_BULK_NICE);
     }
+#endif
 
-    char plagiarized_text[MAX_FILE_SIZE];
-    size_t plagiarized_len = fread(plagiarized_text, 1, MAX_FILE_SIZE - 1, file);
-    plagiarized_text[plagiarized_len] = '\0';
-    fclose(file);
+    for (;;)
+    {
+        pthread_mutex_lock(&server->lock);
+        int query_class;
+        while ((query_class = server_pick_class(server, may_bulk)) < 0 && !server->stop)
+        {
+            pthread_cond_wait(&server->has_query, &server->lock);
+        }
+        if (query_class < 0)
+        {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        QueryQueue *queue = &server->queues[query_class];
+        ServerQuery *first = server_pop(queue);
+
+        int count = 0;
+        int timed_out = 0;
+        struct timespec deadline = first->arrival;
+        deadline.tv_nsec += (long)server->batch_window_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        // 每条查询的临时空间与文本长度成正比（每字节上百字节），批内文本总长超过SERVER_BATCH_TEXT就不再并入
+        size_t batch_text = first->raw_length;
+        queries[count++] = first;
+        while (count < SERVER_MAX_BATCH)
+        {
+            if (queue->head != NULL && batch_text + queue->head->raw_length > SERVER_BATCH_TEXT)
+            {
+                break;
+            }
+            ServerQuery *next = server_pop(queue);
+            if (next != NULL)
+            {
+                batch_text += next->raw_length;
+                queries[count++] = next;
+                continue;
+            }
+            if (timed_out || server->batch_window_us == 0 || server->stop)
+            {
+                break;
+            }
+            timed_out = pthread_cond_timedwait(&server->has_query, &server->lock, &deadline) == ETIMEDOUT;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
 
-    // 文本预处理：转换为小写并去除标点
-    to_lower_case(original_text);
-    to_lower_case(plagiarized_text);
-    remove_punctuation(original_text);
-    remove_punctuation(plagiarized_text);
+        // 进入读者临界区：先公布当前纪元，再读取索引指针，这一批处理完之前旧索引不会被释放
+        atomic_store(reader_epoch, atomic_load(&server->epoch));
+        CorpusIndex *index = atomic_load(&server->index);
+        if (index->num_docs != scratch_docs)
+        {
+            if (scratch_docs >= 0)
+            {
+                free_batch_scratch(&batch);
+            }
+            init_batch_scratch(&batch, index->num_docs, batch_capacity_for(index));
+            scratch_docs = index->num_docs;
+        }
 
-    // 创建哈希表存储n-gram特征
-    HashTable *ht_original = create_hash_table(HASH_TABLE_SIZE);
-    HashTable *ht_plagiarized = create_hash_table(HASH_TABLE_SIZE);
+        for (int start = 0; start < count; start += batch.capacity)
+        {
+            int n = count - start < batch.capacity ? count - start : batch.capacity;
+            for (int i = 0; i < n; i++)
+            {
+                collect_query(&batch.queries[i], queries[start + i]->raw, queries[start + i]->raw_length, queries[start + i]->deadline);
+            }
+            long long scored = metrics_start();
+            score_batch(index, &batch, n);
+            metrics_record(STAGE_INTERSECT, scored);
 
-    // 生成n-gram特征
-    generate_ngrams(original_text, ht_original);
-    generate_ngrams(plagiarized_text, ht_plagiarized);
+            for (int i = 0; i < n; i++)
+            {
+                ServerQuery *query = queries[start + i];
+                format_query_reply(index, &batch.queries[i], query->reply);
+                reset_query_scratch(&batch.queries[i]);
 
-    // 计算Jaccard相似度
-    float similarity = calculate_jaccard_similarity(ht_original, ht_plagiarized);
+                pthread_mutex_lock(&query->lock);
+                query->done = 1;
+                pthread_cond_signal(&query->finished);
+                pthread_mutex_unlock(&query->lock);
+            }
+        }
+        atomic_store(reader_epoch, 0);
 
-    // 输出结果到文件
-    file = fopen(output_file, "w");
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        long long per_query = ((finished.tv_sec - started.tv_sec) * 1000000000LL + (finished.tv_nsec - started.tv_nsec)) / count;
+
+        pthread_mutex_lock(&server->lock);
+        queue->avg_ns = queue->avg_ns == 0 ? per_query : (queue->avg_ns * 7 + per_query) / 8;
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    if (scratch_docs >= 0)
+    {
+        free_batch_scratch(&batch);
+    }
+    return NULL;
+}
+
+/**
+ * 把查询交给查询线程并等待完成
+ * 该类别的队列已满时不排队，直接回复 BUSY <毫秒>，给出按队列长度和平均耗时估算的重试等待时间
+ * @param deadline_ms 查询的时限（从现在算起），0表示不限时
+ */
+static void server_execute(Server *server, QueryClass query_class, const char *raw, size_t raw_length, int deadline_ms,
+                           ReplyBuffer *reply)
+{
+    QueryQueue *queue = &server->queues[query_class];
+    ServerQuery query;
+    memset(&query, 0, sizeof(query));
+    query.query_class = query_class;
+    query.raw = raw;
+    query.raw_length = raw_length;
+    query.reply = reply;
+    clock_gettime(CLOCK_MONOTONIC, &query.arrival);
+    query.deadline = deadline_ms > 0 ? monotonic_ns() + deadline_ms * 1000000LL : 0;
+    pthread_mutex_init(&query.lock, NULL);
+    pthread_cond_init(&query.finished, NULL);
+
+    pthread_mutex_lock(&server->lock);
+    if (queue->length >= queue->limit)
+    {
+        int workers = query_class == QUERY_BULK ? server->bulk_workers : server->num_workers;
+        long long retry_ms = (long long)queue->length * queue->avg_ns / workers / 1000000 + 1;
+        pthread_mutex_unlock(&server->lock);
+        reply_printf(reply, "BUSY %lld\n", retry_ms);
+        pthread_cond_destroy(&query.finished);
+        pthread_mutex_destroy(&query.lock);
+        return;
+    }
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = &query;
+    }
+    else
+    {
+        queue->head = &query;
+    }
+    queue->tail = &query;
+    queue->length++;
+    // 等待者可能正在为另一类查询凑批，或是取不了批量查询的0号线程，单个唤醒可能落空，所以全部唤醒
+    pthread_cond_broadcast(&server->has_query);
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_mutex_lock(&query.lock);
+    while (!query.done)
+    {
+        pthread_cond_wait(&query.finished, &query.lock);
+    }
+    pthread_mutex_unlock(&query.lock);
+
+    pthread_cond_destroy(&query.finished);
+    pthread_mutex_destroy(&query.lock);
+}
+
+/**
+ * 读取整个文件，长度上限与 TEXT 请求相同（SERVER_MAX_REQUEST）
+ * @return 文件内容（调用者负责释放）；无法读取时返回NULL，超过上限时返回NULL并把errno设为EFBIG
+ */
+static char *read_whole_file(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
     if (file == NULL)
     {
-        printf("错误：无法创建输出文件: %s\n", output_file);
-        free_hash_table(ht_original);
-        free_hash_table(ht_plagiarized);
-        return 1;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > SERVER_MAX_REQUEST)
+    {
+        fclose(file);
+        errno = EFBIG;
+        return NULL;
     }
-    fprintf(file, "%.2f\n", similarity);
-    fclose(file);
 
-    // 释放内存
-    free_hash_table(ht_original);
-    free_hash_table(ht_plagiarized);
+    // 管道、设备等fstat得不到长度的文件，以及读取期间变大的文件，在读取中途检查上限
+    size_t capacity = READ_BLOCK_SIZE;
+    char *data = (char *)malloc(capacity);
+    size_t got;
+    *length = 0;
+    while ((got = fread(data + *length, 1, capacity - *length, file)) > 0)
+    {
+        *length += got;
+        if (*length > SERVER_MAX_REQUEST)
+        {
+            free(data);
+            fclose(file);
+            errno = EFBIG;
+            return NULL;
+        }
+        if (*length == capacity)
+        {
+            capacity *= 2;
+            data = (char *)realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    return data;
+}
 
-    printf("查重完成！重复率: %.2f%%\n", similarity * 100);
+static int send_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
     return 0;
 }
 
 /**
- * 去除字符串中的标点符号和特殊字符
- * 只保留字母、数字、汉字和空格
- * @param str 要处理的字符串（原地修改）
+ * 把当前的阶段耗时统计写入回复
  */
-void remove_punctuation(char *str)
+static void send_metrics(int fd, ReplyBuffer *reply)
 {
-    char *src = str;
-    char *dst = str;
+    if (!metrics_enabled)
+    {
+        reply_printf(reply, "ERR 未启用统计\n");
+        return;
+    }
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL)
+    {
+        reply_printf(reply, "ERR 无法生成统计\n");
+        return;
+    }
+    write_metrics(out);
+    fclose(out);
+
+    reply_printf(reply, "METRICS %zu\n", length);
+    if (send_all(fd, reply->data, reply->length) == 0)
+    {
+        send_all(fd, text, length);
+    }
+    reply->length = 0;
+    free(text);
+}
+
+/**
+ * 连接线程：逐行读取请求，每个请求的回复写回同一个连接
+ *   PATH <文件路径>        服务端读取该文件作为查询文本（长度上限与TEXT相同）
+ *   TEXT <字节数>          随后紧跟指定字节数的查询文本
+ * 请求前加 BULK 前缀（如 BULK PATH <文件路径>）表示批量查询，排在低优先级队列；
+ * 再加 DEADLINE <毫秒> 前缀（如 DEADLINE 50 PATH <文件路径>）指定本条查询的时限，到期时回复估计值（见 format_query_reply()），
+ * 不加时使用 --deadline-ms 给出的默认时限
+ *   METRICS                回复 METRICS <字节数>，随后是Prometheus文本格式的各阶段耗时（需以--metrics启动）
+ * 出错时回复 ERR <原因>；队列已满时回复 BUSY <毫秒>，客户端应等待该时间后重试；连接保持可用
+ */
+static void *connection_thread(void *arg)
+{
+    Connection *connection = (Connection *)arg;
+    Server *server = connection->server;
+    int fd = connection->fd;
+    free(connection);
+
+    FILE *in = fdopen(fd, "r");
+    char line[MAX_LINE_LENGTH];
+    ReplyBuffer reply = {(char *)malloc(256), 0, 256};
 
-    while (*src)
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL)
     {
-        if (isalnum((unsigned char)*src) || *src == ' ')
+        line[strcspn(line, "\r\n")] = '\0';
+        char *request = line;
+        char *raw = NULL;
+        size_t raw_length = 0;
+        QueryClass query_class = QUERY_INTERACTIVE;
+        int deadline_ms = server->deadline_ms;
+        reply.length = 0;
+
+        if (strncmp(request, "BULK ", 5) == 0)
         {
-            *dst++ = *src;
-            src++;
+            query_class = QUERY_BULK;
+            request += 5;
         }
-        else if ((unsigned char)*src & 0x80)
+        if (strncmp(request, "DEADLINE ", 9) == 0)
         {
-            unsigned char byte1 = (unsigned char)*src;
-            unsigned char byte2 = (unsigned char)*(src + 1);
+            char *end;
+            long ms = strtol(request + 9, &end, 10);
+            if (end == request + 9 || *end != ' ' || ms <= 0 || ms > INT_MAX)
+            {
+                reply_printf(&reply, "ERR 时限无效\n");
+                request = end + strlen(end);
+            }
+            else
+            {
+                deadline_ms = (int)ms;
+                request = end + 1;
+            }
+        }
 
-            if (byte1 == 0xEF && byte2 == 0xBC)
+        if (strcmp(request, "METRICS") == 0)
+        {
+            send_metrics(fd, &reply);
+        }
+        else if (strncmp(request, "PATH ", 5) == 0)
+        {
+            long long start = metrics_start();
+            errno = 0;
+            raw = read_whole_file(request + 5, &raw_length);
+            metrics_record(STAGE_READ, start);
+            if (raw == NULL && errno == EFBIG)
             {
-                src += 3;
+                reply_printf(&reply, "ERR 文件长度超过上限: %s\n", request + 5);
+            }
+            else if (raw == NULL)
+            {
+                reply_printf(&reply, "ERR 无法打开文件: %s\n", request + 5);
+            }
+        }
+        else if (strncmp(request, "TEXT ", 5) == 0)
+        {
+            long long length = atoll(request + 5);
+            if (length < 0 || length > SERVER_MAX_REQUEST)
+            {
+                reply_printf(&reply, "ERR 文本长度无效\n");
             }
             else
             {
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
+                raw = (char *)malloc((size_t)length + 1);
+                raw_length = fread(raw, 1, (size_t)length, in);
+                if (raw_length != (size_t)length)
+                {
+                    free(raw);
+                    break;
+                }
             }
         }
-        else
+        else if (request[0] != '\0')
+        {
+            reply_printf(&reply, "ERR 未知请求\n");
+        }
+
+        if (raw != NULL)
+        {
+            server_execute(server, query_class, raw, raw_length, deadline_ms, &reply);
+            free(raw);
+        }
+        if (reply.length > 0 && send_all(fd, reply.data, reply.length) != 0)
         {
-            src++;
+            break;
         }
     }
-    *dst = '\0';
-}
+    free(reply.data);
 
-/**
- * 将英文字母转换为小写（不影响中文字符）
- * @param str 要处理的字符串（原地修改）
- */
-void to_lower_case(char *str)
-{
-    for (int i = 0; str[i]; i++)
+    pthread_mutex_lock(&server->lock);
+    for (int i = 0; i < server->num_connections; i++)
     {
-        if (str[i] >= 'A' && str[i] <= 'Z')
+        if (server->connections[i] == fd)
         {
-            str[i] = str[i] + 32;
+            server->connections[i] = server->connections[--server->num_connections];
+            break;
         }
     }
+    if (server->num_connections == 0)
+    {
+        pthread_cond_broadcast(&server->drained);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    else
+    {
+        close(fd);
+    }
+    return NULL;
 }
 
-/**
- * 创建哈希表
- * @param size 哈希表大小
- * @return 新创建的哈希表指针
- */
-HashTable *create_hash_table(int size)
+static int open_listen_socket(const char *socket_path)
 {
-    HashTable *ht = (HashTable *)malloc(sizeof(HashTable));
-    ht->size = size;
-    ht->table = (NGramNode **)calloc(size, sizeof(NGramNode *));
-    return ht;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
+#endif
 
 /**
- * 释放哈希表及其所有节点的内存
- * @param ht 要释放的哈希表
+ * 加载语料列表并建立倒排索引
+ * @param missing 返回无法打开的文档数
+ * @return 倒排索引，列表文件无法打开时返回NULL
  */
-void free_hash_table(HashTable *ht)
+static CorpusIndex *load_corpus_index(const char *list_file, int num_threads, int *missing)
 {
-    for (int i = 0; i < ht->size; i++)
+    *missing = 0;
+    FILE *file = fopen(list_file, "r");
+    if (file == NULL)
+    {
+        printf("错误：无法打开列表文件: %s\n", list_file);
+        return NULL;
+    }
+
+    CorpusJob job;
+    memset(&job, 0, sizeof(job));
+    char line[MAX_LINE_LENGTH];
+
+    while (read_list_line(file, line))
+    {
+        corpus_add_document(&job, line);
+    }
+    fclose(file);
+
+    if (run_corpus_job(&job, num_threads) != 0)
+    {
+        free_corpus_job(&job);
+        return NULL;
+    }
+    *missing = report_missing(&job);
+
+    // 无法打开的文档不进入索引
+    const char **paths = (const char **)malloc((job.num_docs + 1) * sizeof(char *));
+    long long *totals = (long long *)malloc((job.num_docs + 1) * sizeof(long long));
+    const ConcurrentTable **tables = (const ConcurrentTable **)malloc((job.num_docs + 1) * sizeof(ConcurrentTable *));
+    int count = 0;
+    for (int i = 0; i < job.num_docs; i++)
     {
-        NGramNode *current = ht->table[i];
-        while (current != NULL)
+        const CorpusDoc *cd = job.docs[i];
+        if (cd->doc.status == 0 && cd->ct != NULL)
         {
-            NGramNode *temp = current;
-            current = current->next;
-            free(temp);
+            long long positions = (long long)cd->doc.length - N_GRAM + 1;
+            paths[count] = cd->doc.path;
+            totals[count] = positions > 0 ? positions : 0;
+            tables[count++] = cd->ct;
         }
     }
-    free(ht->table);
-    free(ht);
+    CorpusIndex *index = build_corpus_index(paths, totals, tables, count);
+    memory_track_corpus_index(index, 1);
+    free(paths);
+    free(totals);
+    free(tables);
+    free_corpus_job(&job);
+    return index;
 }
 
 /**
- * 哈希函数：将字符串映射到哈希表索引
- * 使用DJB2哈希算法，具有良好的分布特性
- * @param str 输入字符串
- * @param table_size 哈希表大小
- * @return 哈希值（0 到 table_size-1）
+ * 打开索引来源：索引文件直接映射，否则当作语料列表重新建立索引
+ * @param missing 返回语料列表中无法打开的文档数（索引文件总是0）
+ * @return 倒排索引，失败时返回NULL
  */
-unsigned int hash_function(const char *str, int table_size)
+static CorpusIndex *open_corpus_index(const char *source, int num_threads, int *missing)
 {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *str++))
+    *missing = 0;
+    if (!is_index_file(source))
     {
-        hash = ((hash << 5) + hash) + c;
+        return load_corpus_index(source, num_threads, missing);
     }
-    return hash % table_size;
+    CorpusIndex *index = map_corpus_index(source);
+    if (index == NULL)
+    {
+        printf("错误：索引文件无效: %s\n", source);
+        return NULL;
+    }
+    memory_track_corpus_index(index, 1);
+    return index;
 }
 
 /**
- * 向哈希表添加n-gram或增加计数
- * @param ht 目标哈希表
- * @param gram 要添加的n-gram字符串
+ * 建索引模式：加载语料列表并把倒排索引写入索引文件，供服务模式直接映射
+ * @param list_file 语料列表（每行一个文件路径）
+ * @param index_file 索引文件
+ * @param options 命令行选项
+ * @return 程序退出状态码
  */
-void addhash(HashTable *ht, const char *gram)
+int run_build_index_mode(const char *list_file, const char *index_file, const Options *options)
 {
-    unsigned int index = hash_function(gram, ht->size);
-
-    NGramNode *current = ht->table[index];
-    while (current != NULL)
+    int missing;
+    CorpusIndex *index = load_corpus_index(list_file, options->num_threads, &missing);
+    if (index == NULL)
     {
-        if (strcmp(current->gram, gram) == 0)
-        {
-            current->count++;
-            return;
-        }
-        current = current->next;
+        return 1;
     }
 
-    NGramNode *new_node = (NGramNode *)malloc(sizeof(NGramNode));
-    strncpy(new_node->gram, gram, N_GRAM);
-    new_node->gram[N_GRAM] = '\0';
-    new_node->count = 1;
-    new_node->next = ht->table[index];
-    ht->table[index] = new_node;
+    // 缺了文档的索引不写出，免得覆盖上一次完整的索引文件
+    int status = 0;
+    if (missing > 0 || index->num_docs == 0)
+    {
+        printf("错误：语料不完整（%d 篇文档无法打开，可用 %d 篇），未写入索引文件\n", missing, index->num_docs);
+        status = 1;
+    }
+    else if (write_corpus_index(index, index_file) != 0)
+    {
+        printf("错误：无法写入索引文件: %s\n", index_file);
+        status = 1;
+    }
+    else
+    {
+        printf("索引已生成：文档 %d 篇，不同n-gram %zu 个\n", index->num_docs, index->num_keys);
+    }
+    memory_track_corpus_index(index, -1);
+    free_corpus_index(index);
+    return status;
 }
 
+#ifdef HAVE_UNIX_SOCKET
 /**
- * 计算两个哈希表的交集数量（共同n-gram的最小计数之和）
- * @param ht1 第一个哈希表
- * @param ht2 第二个哈希表
- * @return 交集数量
+ * 更新线程：重新打开索引来源，发布新索引，等所有查询线程离开旧纪元后释放旧索引
+ * 整个过程中查询照常进行，旧索引上已开始的查询在旧索引上完成
  */
-int get_intersection_count(HashTable *ht1, HashTable *ht2)
+static void *server_reloader(void *arg)
 {
-    int intersection = 0;
+    Server *server = (Server *)arg;
+    int missing;
+    CorpusIndex *fresh = open_corpus_index(server->source, server->num_threads, &missing);
 
-    for (int i = 0; i < ht1->size; i++)
+    if (fresh != NULL && (missing > 0 || fresh->num_docs == 0))
     {
-        NGramNode *current = ht1->table[i];
-        while (current != NULL)
-        {
-            unsigned int index = hash_function(current->gram, ht2->size);
-            NGramNode *temp = ht2->table[index];
+        // 列表中的文件缺失时新索引是残缺的，不能替换正在服务的索引
+        printf("错误：新索引不完整（%d 篇文档无法打开，可用 %d 篇）\n", missing, fresh->num_docs);
+        memory_track_corpus_index(fresh, -1);
+        free_corpus_index(fresh);
+        fresh = NULL;
+    }
+    if (fresh == NULL)
+    {
+        printf("错误：重新加载索引失败，继续使用原索引\n");
+    }
+    else
+    {
+        CorpusIndex *old = atomic_exchange(&server->index, fresh);
+        unsigned long long epoch = atomic_fetch_add(&server->epoch, 1) + 1;
 
-            while (temp != NULL)
+        for (int i = 0; i < server->num_workers; i++)
+        {
+            for (;;)
             {
-                if (strcmp(current->gram, temp->gram) == 0)
+                unsigned long long seen = atomic_load(&server->reader_epochs[i]);
+                if (seen == 0 || seen >= epoch)
                 {
-                    intersection += (current->count < temp->count) ? current->count : temp->count;
                     break;
                 }
-                temp = temp->next;
+                struct timespec pause = {0, 100000};
+                nanosleep(&pause, NULL);
             }
-            current = current->next;
         }
+        memory_track_corpus_index(old, -1);
+        free_corpus_index(old);
+        printf("索引已更新：文档 %d 篇，不同n-gram %zu 个\n", fresh->num_docs, fresh->num_keys);
     }
-
-    return intersection;
+    fflush(stdout);
+    atomic_store(&server->reloading, 0);
+    return NULL;
 }
 
 /**
- * 计算两个哈希表的并集数量（所有n-gram计数之和）
- * @param ht1 第一个哈希表
- * @param ht2 第二个哈希表
- * @return 并集数量（需要减去交集）
+ * 收到SIGHUP后在后台线程中更新索引；上一次更新尚未结束时忽略本次请求
  */
-int get_union_count(HashTable *ht1, HashTable *ht2)
+static void server_request_reload(Server *server)
 {
-    int union_count = 0;
-
-    for (int i = 0; i < ht1->size; i++)
+    if (atomic_load(&server->reloading))
     {
-        NGramNode *current = ht1->table[i];
-        while (current != NULL)
-        {
-            union_count += current->count;
-            current = current->next;
-        }
+        return;
     }
-
-    for (int i = 0; i < ht2->size; i++)
+    if (server->has_reloader)
     {
-        NGramNode *current = ht2->table[i];
-        while (current != NULL)
-        {
-            union_count += current->count;
-            current = current->next;
-        }
+        pthread_join(server->reloader, NULL);
+        server->has_reloader = 0;
+    }
+    atomic_store(&server->reloading, 1);
+    if (create_server_thread(&server->reloader, server_reloader, server) == 0)
+    {
+        server->has_reloader = 1;
+    }
+    else
+    {
+        atomic_store(&server->reloading, 0);
     }
-
-    return union_count;
 }
+#endif
 
 /**
- * 计算Jaccard相似度系数
- * Jaccard相似度 = 交集大小 / 并集大小
- * @param ht_original 原文的n-gram哈希表
- * @param ht_plagiarized 抄袭版的n-gram哈希表
- * @return 相似度分数（0.0-1.0）
+ * 服务模式：一次性加载语料并建立倒排索引（或直接映射索引文件），然后在Unix套接字上持续接受查询，
+ * 省去每次查重都启动进程、重新读取语料的开销；收到SIGHUP时在后台重新加载索引并无缝切换，
+ * 收到SIGINT/SIGTERM后退出
+ * @param source 语料列表（每行一个文件路径）或 --build-index 生成的索引文件
+ * @param socket_path Unix套接字路径
+ * @param options 命令行选项
+ * @return 程序退出状态码
  */
-float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized)
+int run_serve_mode(const char *source, const char *socket_path, const Options *options)
 {
-    int intersection = get_intersection_count(ht_original, ht_plagiarized);
-    int union_total = get_union_count(ht_original, ht_plagiarized);
+#ifdef HAVE_UNIX_SOCKET
+    int missing;
+    CorpusIndex *index = open_corpus_index(source, options->num_threads, &missing);
+    if (index == NULL)
+    {
+        return 1;
+    }
+
+    int listen_fd = open_listen_socket(socket_path);
+    if (listen_fd < 0)
+    {
+        printf("错误：无法监听套接字: %s\n", socket_path);
+        memory_track_corpus_index(index, -1);
+        free_corpus_index(index);
+        return 1;
+    }
 
-    union_total -= intersection;
+    // 信号平时在主线程中屏蔽，只在pselect()等待期间原子地解除：检查完标志到开始等待之间到达的信号
+    // 会让pselect()立即返回EINTR，不会一直拖到下一个客户端连接时才处理
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    sigset_t block;
+    sigset_t wait_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &block, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    sigdelset(&wait_mask, SIGHUP);
+    // 监听套接字设为非阻塞：客户端在pselect()返回后、accept()之前断开时，accept()不会卡住主循环
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
 
-    if (union_total == 0)
+    Server server;
+    memset(&server, 0, sizeof(server));
+    atomic_init(&server.index, index);
+    atomic_init(&server.epoch, 1);
+    atomic_init(&server.reloading, 0);
+    server.source = source;
+    server.num_threads = options->num_threads;
+    server.num_workers = options->num_threads;
+    server.workers = (pthread_t *)malloc(server.num_workers * sizeof(pthread_t));
+    server.reader_epochs = (atomic_ullong *)calloc(server.num_workers, sizeof(atomic_ullong));
+    server.batch_window_us = options->batch_window_us;
+    server.deadline_ms = options->deadline_ms;
+    server.queues[QUERY_INTERACTIVE].limit = SERVER_INTERACTIVE_QUEUE;
+    server.queues[QUERY_BULK].limit = SERVER_BULK_QUEUE;
+    server.bulk_workers = server.num_workers > 1 ? server.num_workers - 1 : 1;
+    ServerWorkerContext *contexts = (ServerWorkerContext *)malloc(server.num_workers * sizeof(ServerWorkerContext));
+
+    // 合并窗口的截止时间用单调时钟计算，不受系统时间调整影响
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.has_query, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&server.drained, NULL);
+    for (int i = 0; i < server.num_workers; i++)
     {
-        return 0.0f;
+        contexts[i].server = &server;
+        contexts[i].id = i;
+        create_server_thread(&server.workers[i], server_worker, &contexts[i]);
     }
 
-    return (float)intersection / union_total;
-}
+    printf("服务已启动：文档 %d 篇，不同n-gram %zu 个，监听 %s\n", index->num_docs, index->num_keys, socket_path);
+    fflush(stdout);
 
-/**
- * 从文本生成n-gram并存储到哈希表
- * @param text 输入文本（已预处理）
- * @param ht 目标哈希表
- */
-void generate_ngrams(const char *text, HashTable *ht)
-{
-    int len = strlen(text);
+    while (!server_interrupted)
+    {
+        if (server_reload_requested)
+        {
+            server_reload_requested = 0;
+            server_request_reload(&server);
+        }
+
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listen_fd, &readable);
+        if (pselect(listen_fd + 1, &readable, NULL, NULL, NULL, &wait_mask) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // 有的平台上新连接会继承监听套接字的非阻塞标志，连接线程需要阻塞读写
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+        pthread_mutex_lock(&server.lock);
+        int accepted = server.num_connections < SERVER_MAX_CONNECTIONS;
+        if (accepted)
+        {
+            server.connections[server.num_connections++] = fd;
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        pthread_t thread;
+        Connection *connection = (Connection *)malloc(sizeof(Connection));
+        connection->server = &server;
+        connection->fd = fd;
+        if (!accepted || create_server_thread(&thread, connection_thread, connection) != 0)
+        {
+            const char *busy = "ERR 连接数过多\n";
+            send_all(fd, busy, strlen(busy));
+            free(connection);
+            pthread_mutex_lock(&server.lock);
+            for (int i = 0; accepted && i < server.num_connections; i++)
+            {
+                if (server.connections[i] == fd)
+                {
+                    server.connections[i] = server.connections[--server.num_connections];
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&server.lock);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    // 先关闭所有连接的读端，等连接线程处理完手头的请求，再停止查询线程
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < server.num_connections; i++)
+    {
+        shutdown(server.connections[i], SHUT_RD);
+    }
+    while (server.num_connections > 0)
+    {
+        pthread_cond_wait(&server.drained, &server.lock);
+    }
+    server.stop = 1;
+    pthread_cond_broadcast(&server.has_query);
+    pthread_mutex_unlock(&server.lock);
 
-    for (int i = 0; i <= len - N_GRAM; i++)
+    for (int i = 0; i < server.num_workers; i++)
     {
-        char gram[N_GRAM + 1];
-        strncpy(gram, text + i, N_GRAM);
-        gram[N_GRAM] = '\0';
-        addhash(ht, gram);
+        pthread_join(server.workers[i], NULL);
     }
-}
\ No newline at end of file
+    if (server.has_reloader)
+    {
+        pthread_join(server.reloader, NULL);
+    }
+    pthread_cond_destroy(&server.drained);
+    pthread_cond_destroy(&server.has_query);
+    pthread_mutex_destroy(&server.lock);
+    free(contexts);
+    free(server.reader_epochs);
+    free(server.workers);
+    index = atomic_load(&server.index);
+    memory_track_corpus_index(index, -1);
+    free_corpus_index(index);
+    printf("服务已停止\n");
+    return 0;
+#else
+    (void)source;
+    (void)socket_path;
+    (void)options;
+    printf("错误：当前平台不支持服务模式\n");
+    return 1;
+#endif
+}
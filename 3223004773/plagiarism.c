@@ -0,0 +1,2633 @@
+/**
+ * 论文查重计算库 - 文本预处理、n-gram生成与Jaccard相似度
+ * 接口说明与构建方式见 plagiarism.h
+ */
+#define _CRT_SECURE_NO_WARNINGS 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAVE_POSIX_SHM 1
+#define HAVE_PREAD 1
+#endif
+
+#define PLAGIARISM_INTERNAL 1
+#include "plagiarism.h"
+
+// 从调用者缓冲区创建特征时每次预处理的输入字节数
+#define PROFILE_BLOCK 65536
+#define PROFILE_RUN_KEYS (1 << 20)
+#define PARTITION_MAX_BITS 14
+#define ANYTIME_MIN_PARTITIONS 8
+#define THRESHOLD_CHECK_SLOTS 4096
+#define STORE_MAGIC "PLAGSTO1"
+
+// ==================== 文本预处理与哈希表 ====================
+
+/**
+ * 去除字符串中的标点符号和特殊字符
+ * 只保留字母、数字、汉字和空格
+ * @param str 要处理的字符串（原地修改）
+ */
+void remove_punctuation(char *str)
+{
+    char *src = str;
+    char *dst = str;
+
+    while (*src)
+    {
+        if (isalnum((unsigned char)*src) || *src == ' ')
+        {
+            *dst++ = *src;
+            src++;
+        }
+        else if ((unsigned char)*src & 0x80)
+        {
+            unsigned char byte1 = (unsigned char)*src;
+            unsigned char byte2 = (unsigned char)*(src + 1);
+
+            if (byte1 == 0xEF && byte2 == 0xBC)
+            {
+                src += 3;
+            }
+            else
+            {
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+            }
+        }
+        else
+        {
+            src++;
+        }
+    }
+    *dst = '\0';
+}
+
+/**
+ * 将英文字母转换为小写（不影响中文字符）
+ * @param str 要处理的字符串（原地修改）
+ */
+void to_lower_case(char *str)
+{
+    for (int i = 0; str[i]; i++)
+    {
+        if (str[i] >= 'A' && str[i] <= 'Z')
+        {
+            str[i] = str[i] + 32;
+        }
+    }
+}
+
+/**
+ * 创建哈希表
+ * @param size 哈希表大小
+ * @return 新创建的哈希表指针
+ */
+HashTable *create_hash_table(int size)
+{
+    HashTable *ht = (HashTable *)malloc(sizeof(HashTable));
+    ht->size = size;
+    ht->table = (NGramNode **)calloc(size, sizeof(NGramNode *));
+    return ht;
+}
+
+/**
+ * 释放哈希表及其所有节点的内存
+ * @param ht 要释放的哈希表
+ */
+void free_hash_table(HashTable *ht)
+{
+    for (int i = 0; i < ht->size; i++)
+    {
+        NGramNode *current = ht->table[i];
+        while (current != NULL)
+        {
+            NGramNode *temp = current;
+            current = current->next;
+            free(temp);
+        }
+    }
+    free(ht->table);
+    free(ht);
+}
+
+/**
+ * 哈希函数：将字符串映射到哈希表索引
+ * 使用DJB2哈希算法，具有良好的分布特性
+ * @param str 输入字符串
+ * @param table_size 哈希表大小
+ * @return 哈希值（0 到 table_size-1）
+ */
+unsigned int hash_function(const char *str, int table_size)
+{
+    unsigned int hash = 5381;
+    int c;
+    while ((c = *str++))
+    {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash % table_size;
+}
+
+/**
+ * 向哈希表添加n-gram或增加计数
+ * @param ht 目标哈希表
+ * @param gram 要添加的n-gram字符串
+ */
+void addhash(HashTable *ht, const char *gram)
+{
+    unsigned int index = hash_function(gram, ht->size);
+
+    NGramNode *current = ht->table[index];
+    while (current != NULL)
+    {
+        if (strcmp(current->gram, gram) == 0)
+        {
+            current->count++;
+            return;
+        }
+        current = current->next;
+    }
+
+    NGramNode *new_node = (NGramNode *)malloc(sizeof(NGramNode));
+    strncpy(new_node->gram, gram, N_GRAM);
+    new_node->gram[N_GRAM] = '\0';
+    new_node->count = 1;
+    new_node->next = ht->table[index];
+    ht->table[index] = new_node;
+}
+
+/**
+ * 计算两个哈希表的交集数量（共同n-gram的最小计数之和）
+ * @param ht1 第一个哈希表
+ * @param ht2 第二个哈希表
+ * @return 交集数量
+ */
+int get_intersection_count(HashTable *ht1, HashTable *ht2)
+{
+    return get_intersection_count_range(ht1, ht2, 0, ht1->size);
+}
+
+/**
+ * 计算两个哈希表的并集数量（所有n-gram计数之和）
+ * @param ht1 第一个哈希表
+ * @param ht2 第二个哈希表
+ * @return 并集数量（需要减去交集）
+ */
+int get_union_count(HashTable *ht1, HashTable *ht2)
+{
+    int union_count = 0;
+
+    for (int i = 0; i < ht1->size; i++)
+    {
+        NGramNode *current = ht1->table[i];
+        while (current != NULL)
+        {
+            union_count += current->count;
+            current = current->next;
+        }
+    }
+
+    for (int i = 0; i < ht2->size; i++)
+    {
+        NGramNode *current = ht2->table[i];
+        while (current != NULL)
+        {
+            union_count += current->count;
+            current = current->next;
+        }
+    }
+
+    return union_count;
+}
+
+/**
+ * 计算Jaccard相似度系数
+ * Jaccard相似度 = 交集大小 / 并集大小
+ * @param ht_original 原文的n-gram哈希表
+ * @param ht_plagiarized 抄袭版的n-gram哈希表
+ * @return 相似度分数（0.0-1.0）
+ */
+float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized)
+{
+    int intersection = get_intersection_count(ht_original, ht_plagiarized);
+    int union_total = get_union_count(ht_original, ht_plagiarized);
+
+    union_total -= intersection;
+
+    return jaccard_from_counts(intersection, union_total);
+}
+
+/**
+ * 由整数计数得到相似度，所有计算路径都在这里做唯一的一次除法
+ * 并行路径只累加整数（与线程数、完成顺序无关），因此任意线程数下结果逐位相同；
+ * 除法用double完成后只舍入一次，计数超过2^24时也不会先把分子分母各自舍入成float
+ * @param intersection 交集大小
+ * @param union_total 并集大小
+ * @return 相似度分数（0.0-1.0）
+ */
+float jaccard_from_counts(long long intersection, long long union_total)
+{
+    if (union_total == 0)
+    {
+        return 0.0f;
+    }
+    return (float)((double)intersection / (double)union_total);
+}
+
+/**
+ * 从文本生成n-gram并存储到哈希表
+ * @param text 输入文本（已预处理）
+ * @param ht 目标哈希表
+ */
+void generate_ngrams(const char *text, HashTable *ht)
+{
+    int len = strlen(text);
+
+    generate_ngrams_range(text, 0, len - N_GRAM + 1, ht);
+}
+
+/**
+ * 生成起始位置落在 [start, end) 内的所有n-gram
+ * 窗口会越过end向后读取N_GRAM-1个字节，因此相邻区间无需重叠起点即可覆盖全部n-gram
+ * @param text 输入文本（已预处理）
+ * @param start 起始位置（含）
+ * @param end 结束位置（不含），不得超过 strlen(text) - N_GRAM + 1
+ * @param ht 目标哈希表
+ */
+void generate_ngrams_range(const char *text, int start, int end, HashTable *ht)
+{
+    for (int i = start; i < end; i += PROBE_BATCH)
+    {
+        addhash_block(ht, text + i, end - i < PROBE_BATCH ? end - i : PROBE_BATCH);
+    }
+}
+
+/**
+ * 获取可用的CPU核心数
+ * @return 核心数（至少为1）
+ */
+int get_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+/**
+ * 将src中 [bucket_start, bucket_end) 范围内的节点合并进dst
+ * 两张表大小必须相同，这样同一个n-gram在两张表中落在同一个桶里，
+ * 不同线程合并不相交的桶区间时互不干扰，无需加锁。
+ * 合并后src对应的桶被清空，节点直接转移给dst，不再重新分配内存。
+ * @param dst 目标哈希表
+ * @param src 来源哈希表
+ * @param bucket_start 起始桶（含）
+ * @param bucket_end 结束桶（不含）
+ */
+void merge_hash_table(HashTable *dst, HashTable *src, int bucket_start, int bucket_end)
+{
+    for (int i = bucket_start; i < bucket_end; i++)
+    {
+        NGramNode *current = src->table[i];
+        src->table[i] = NULL;
+
+        while (current != NULL)
+        {
+            NGramNode *next = current->next;
+            NGramNode *temp = dst->table[i];
+
+            while (temp != NULL && strcmp(temp->gram, current->gram) != 0)
+            {
+                temp = temp->next;
+            }
+
+            if (temp != NULL)
+            {
+                temp->count += current->count;
+                free(current);
+            }
+            else
+            {
+                current->next = dst->table[i];
+                dst->table[i] = current;
+            }
+            current = next;
+        }
+    }
+}
+
+/**
+ * 并行生成n-gram时每个线程的工作描述
+ * 第一阶段按文本区间建立线程私有哈希表，第二阶段按桶区间把所有私有表合并进目标表
+ */
+typedef struct
+{
+    const char *text;
+    int start;
+    int end;
+    HashTable *local;
+    HashTable **locals;
+    int num_locals;
+    HashTable *dst;
+    int bucket_start;
+    int bucket_end;
+} NGramWorker;
+
+static void *ngram_build_worker(void *arg)
+{
+    NGramWorker *worker = (NGramWorker *)arg;
+    generate_ngrams_range(worker->text, worker->start, worker->end, worker->local);
+    return NULL;
+}
+
+static void *ngram_merge_worker(void *arg)
+{
+    NGramWorker *worker = (NGramWorker *)arg;
+    for (int i = 0; i < worker->num_locals; i++)
+    {
+        merge_hash_table(worker->dst, worker->locals[i], worker->bucket_start, worker->bucket_end);
+    }
+    return NULL;
+}
+
+/**
+ * 为每个参数各开一个线程运行fn并等待全部结束，线程创建失败时退化为在当前线程执行
+ * @param fn 线程函数
+ * @param args 参数数组首地址
+ * @param stride 数组中每个参数的大小
+ * @param count 参数个数（不超过MAX_THREADS）
+ */
+void run_parallel(void *(*fn)(void *), void *args, size_t stride, int count)
+{
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    for (int i = 0; i < count; i++)
+    {
+        void *arg = (char *)args + stride * i;
+        started[i] = pthread_create(&threads[i], NULL, fn, arg) == 0;
+        if (!started[i])
+        {
+            fn(arg);
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+/**
+ * 多线程生成n-gram
+ * 文本被切分为num_threads段，每段由一个线程写入私有哈希表（段与段之间重叠N_GRAM-1个字节，
+ * 保证跨越切分点的n-gram不会丢失也不会重复），随后各线程按桶区间并行合并到ht中。
+ * 文本较短时直接退化为单线程的generate_ngrams。
+ * @param text 输入文本（已预处理）
+ * @param ht 目标哈希表
+ * @param num_threads 线程数
+ */
+void generate_ngrams_parallel(const char *text, HashTable *ht, int num_threads)
+{
+    int len = strlen(text);
+    int positions = len - N_GRAM + 1;
+
+    if (num_threads > MAX_THREADS)
+    {
+        num_threads = MAX_THREADS;
+    }
+    if (num_threads > positions / MIN_CHUNK_SIZE)
+    {
+        num_threads = positions / MIN_CHUNK_SIZE;
+    }
+    if (num_threads <= 1)
+    {
+        generate_ngrams(text, ht);
+        return;
+    }
+
+    NGramWorker workers[MAX_THREADS];
+    HashTable *locals[MAX_THREADS];
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        locals[i] = create_hash_table(ht->size);
+        workers[i].text = text;
+        workers[i].start = (int)((long long)positions * i / num_threads);
+        workers[i].end = (int)((long long)positions * (i + 1) / num_threads);
+        workers[i].local = locals[i];
+        workers[i].locals = locals;
+        workers[i].num_locals = num_threads;
+        workers[i].dst = ht;
+        workers[i].bucket_start = (int)((long long)ht->size * i / num_threads);
+        workers[i].bucket_end = (int)((long long)ht->size * (i + 1) / num_threads);
+    }
+
+    run_parallel(ngram_build_worker, workers, sizeof(NGramWorker), num_threads);
+    run_parallel(ngram_merge_worker, workers, sizeof(NGramWorker), num_threads);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        free_hash_table(locals[i]);
+    }
+}
+
+/**
+ * 预处理的公共实现，map为NULL时不记录偏移（内联后该分支会被常量折叠掉）
+ */
+static inline size_t normalize_core(const char *in, size_t len, char *out, size_t *map, size_t *consumed, int at_eof)
+{
+    size_t i = 0;
+    size_t n = 0;
+
+    while (i < len)
+    {
+        unsigned char c = (unsigned char)in[i];
+
+        if (c & 0x80)
+        {
+            if (i + 3 > len && !at_eof)
+            {
+                break;
+            }
+            if (c == 0xEF && i + 1 < len && (unsigned char)in[i + 1] == 0xBC)
+            {
+                i += 3;
+                continue;
+            }
+            for (int k = 0; k < 3 && i < len; k++, i++)
+            {
+                char b = in[i];
+                if (map != NULL)
+                {
+                    map[n] = i;
+                }
+                out[n++] = (b >= 'A' && b <= 'Z') ? b + 32 : b;
+            }
+        }
+        else
+        {
+            if (c >= 'A' && c <= 'Z')
+            {
+                c += 32;
+            }
+            if (isalnum(c) || c == ' ')
+            {
+                if (map != NULL)
+                {
+                    map[n] = i;
+                }
+                out[n++] = (char)c;
+            }
+            i++;
+        }
+    }
+
+    *consumed = i > len ? len : i;
+    return n;
+}
+
+/**
+ * 对一块原始文本做预处理（转小写并去除标点），效果与依次调用
+ * to_lower_case() 和 remove_punctuation() 相同，但可以分块流式处理。
+ * 多字节字符被切断在块尾时不会被处理，由consumed告知调用者，留待下一块补齐。
+ * @param in 原始文本块
+ * @param len 原始文本块长度
+ * @param out 输出缓冲区（至少len字节）
+ * @param consumed 返回实际处理的输入字节数
+ * @param at_eof 是否为文件最后一块（为真时块尾残缺的字符也会被处理）
+ * @return 输出的字节数
+ */
+size_t normalize_block(const char *in, size_t len, char *out, size_t *consumed, int at_eof)
+{
+    return normalize_core(in, len, out, NULL, consumed, at_eof);
+}
+
+/**
+ * 与normalize_block()相同，另外记录每个输出字节在原始文本中的偏移，
+ * 用于把预处理后文本上的匹配片段换算回原文位置
+ * @param map 偏移数组（至少len个元素），map[k]为out[k]对应的输入下标
+ */
+size_t normalize_block_mapped(const char *in, size_t len, char *out, size_t *map, size_t *consumed, int at_eof)
+{
+    return normalize_core(in, len, out, map, consumed, at_eof);
+}
+
+// ==================== 批量探测与SIMD哈希 ====================
+
+/**
+ * 在ht中批量查询一组节点的n-gram，返回它们与ht的交集数量
+ */
+int intersect_batch(HashTable *ht, NGramNode *nodes[], int count)
+{
+    const char *grams[PROBE_BATCH] = {NULL};
+    NGramNode *found[PROBE_BATCH];
+    int intersection = 0;
+
+    for (int k = 0; k < count; k++)
+    {
+        grams[k] = nodes[k]->gram;
+    }
+    probe_batch(ht, grams, count, found);
+    for (int k = 0; k < count; k++)
+    {
+        if (found[k] != NULL)
+        {
+            intersection += (nodes[k]->count < found[k]->count) ? nodes[k]->count : found[k]->count;
+        }
+    }
+    return intersection;
+}
+
+/**
+ * 计算ht1中 [bucket_start, bucket_end) 范围内的n-gram与ht2的交集数量
+ * 不同桶区间的结果相加即为完整交集，便于拆分给多个线程
+ * @param ht1 第一个哈希表
+ * @param ht2 第二个哈希表
+ * @param bucket_start 起始桶（含）
+ * @param bucket_end 结束桶（不含）
+ * @return 该区间的交集数量
+ */
+int get_intersection_count_range(HashTable *ht1, HashTable *ht2, int bucket_start, int bucket_end)
+{
+    int intersection = 0;
+    NGramNode *nodes[PROBE_BATCH];
+    int pending = 0;
+
+    // 攒满一批再统一探测ht2，让各个键的内存访问相互重叠
+    for (int i = bucket_start; i < bucket_end; i++)
+    {
+        NGramNode *current = ht1->table[i];
+        while (current != NULL)
+        {
+            nodes[pending++] = current;
+            if (pending == PROBE_BATCH)
+            {
+                intersection += intersect_batch(ht2, nodes, pending);
+                pending = 0;
+            }
+            current = current->next;
+        }
+    }
+    if (pending > 0)
+    {
+        intersection += intersect_batch(ht2, nodes, pending);
+    }
+
+    return intersection;
+}
+
+/**
+ * 计算定长n-gram的哈希值，与 hash_function() 对同一个n-gram字符串的结果相同，
+ * 但只读取N_GRAM个字节，不要求以'\0'结尾，可直接指向文本内部
+ * @param gram 指向N_GRAM个字节的指针
+ * @param table_size 哈希表大小
+ * @return 哈希值（0 到 table_size-1）
+ */
+unsigned int hash_gram(const char *gram, int table_size)
+{
+    unsigned int hash = 5381;
+    for (int i = 0; i < N_GRAM; i++)
+    {
+        hash = ((hash << 5) + hash) + gram[i];
+    }
+    return hash % table_size;
+}
+
+/**
+ * 用乘法代替除法求余（Lemire fastmod），对任意32位被除数结果与 % 完全相同
+ */
+static unsigned long long fast_mod_magic(unsigned int divisor)
+{
+    return 0xFFFFFFFFFFFFFFFFULL / divisor + 1;
+}
+
+static unsigned int fast_mod(unsigned int value, unsigned long long magic, unsigned int divisor)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned long long low = magic * value;
+    return (unsigned int)(((unsigned __int128)low * divisor) >> 64);
+#else
+    (void)magic;
+    return value % divisor;
+#endif
+}
+
+/**
+ * 标量版：逐个计算count个相邻窗口的DJB2值（未求余），与 hash_gram() 的累加过程相同
+ */
+void djb2_block_scalar(const char *text, int count, unsigned int out[])
+{
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int hash = 5381;
+        for (int k = 0; k < N_GRAM; k++)
+        {
+            hash = ((hash << 5) + hash) + text[i + k];
+        }
+        out[i] = hash;
+    }
+}
+
+/**
+ * 标量版：逐个打包count个相邻窗口的键并计算 gram_key_hash()
+ */
+void key_block_scalar(const char *text, int count, unsigned long long keys[], unsigned int hashes[])
+{
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = pack_gram(text + i);
+        hashes[i] = gram_key_hash(keys[i]);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * AVX2：一次计算8个相邻窗口的DJB2值
+ * 第k个字节对8个窗口来说是text[i+k]到text[i+k+7]连续8个字节，符号扩展成8个32位整数后
+ * 按 h = h * 33 + c 一起累加，与标量版逐字节的结果相同
+ */
+__attribute__((target("avx2"))) void djb2_block_avx2(const char *text, int count, unsigned int out[])
+{
+    const __m256i seed = _mm256_set1_epi32(5381);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i hash = seed;
+        for (int k = 0; k < N_GRAM; k++)
+        {
+            __m256i c = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(text + i + k)));
+            hash = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(hash, 5), hash), c);
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), hash);
+    }
+    djb2_block_scalar(text + i, count - i, out + i);
+}
+
+/**
+ * AVX-512：一次计算16个相邻窗口的DJB2值
+ */
+__attribute__((target("avx512f"))) void djb2_block_avx512(const char *text, int count, unsigned int out[])
+{
+    const __m512i seed = _mm512_set1_epi32(5381);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i hash = seed;
+        for (int k = 0; k < N_GRAM; k++)
+        {
+            __m512i c = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(text + i + k)));
+            hash = _mm512_add_epi32(_mm512_add_epi32(_mm512_slli_epi32(hash, 5), hash), c);
+        }
+        _mm512_storeu_si512((void *)(out + i), hash);
+    }
+    if (i < count)
+    {
+        djb2_block_avx2(text + i, count - i, out + i);
+    }
+}
+
+/**
+ * AVX2没有64位乘法指令，用三次32位乘法拼出64位乘积的低64位
+ */
+__attribute__((target("avx2"))) static __m256i mul64_avx2(__m256i a, __m256i b)
+{
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+/**
+ * AVX2：一次打包4个相邻窗口的键并计算 gram_key_hash()，每轮处理8个窗口
+ */
+__attribute__((target("avx2"))) void key_block_avx2(const char *text, int count, unsigned long long keys[], unsigned int hashes[])
+{
+    const __m256i c1 = _mm256_set1_epi64x((long long)0x9E3779B97F4A7C15ULL);
+    const __m256i c2 = _mm256_set1_epi64x((long long)0xBF58476D1CE4E5B9ULL);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i key = _mm256_set1_epi64x(1);
+        for (int k = 0; k < N_GRAM; k++)
+        {
+            int bytes;
+            memcpy(&bytes, text + i + k, sizeof(bytes));
+            key = _mm256_or_si256(_mm256_slli_epi64(key, 8), _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)));
+        }
+        _mm256_storeu_si256((__m256i *)(keys + i), key);
+
+        __m256i hash = mul64_avx2(key, c1);
+        hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 29));
+        hash = _mm256_srli_epi64(mul64_avx2(hash, c2), 32);
+        hash = _mm256_permutevar8x32_epi32(hash, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+        _mm_storeu_si128((__m128i *)(hashes + i), _mm256_castsi256_si128(hash));
+    }
+    key_block_scalar(text + i, count - i, keys + i, hashes + i);
+}
+
+/**
+ * AVX-512：一次打包8个相邻窗口的键并计算 gram_key_hash()
+ */
+__attribute__((target("avx512f,avx512dq"))) void key_block_avx512(const char *text, int count, unsigned long long keys[], unsigned int hashes[])
+{
+    const __m512i c1 = _mm512_set1_epi64((long long)0x9E3779B97F4A7C15ULL);
+    const __m512i c2 = _mm512_set1_epi64((long long)0xBF58476D1CE4E5B9ULL);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512i key = _mm512_set1_epi64(1);
+        for (int k = 0; k < N_GRAM; k++)
+        {
+            __m512i c = _mm512_cvtepu8_epi64(_mm_loadl_epi64((const __m128i *)(text + i + k)));
+            key = _mm512_or_si512(_mm512_slli_epi64(key, 8), c);
+        }
+        _mm512_storeu_si512((void *)(keys + i), key);
+
+        __m512i hash = _mm512_mullo_epi64(key, c1);
+        hash = _mm512_xor_si512(hash, _mm512_srli_epi64(hash, 29));
+        hash = _mm512_srli_epi64(_mm512_mullo_epi64(hash, c2), 32);
+        _mm256_storeu_si256((__m256i *)(hashes + i), _mm512_cvtepi64_epi32(hash));
+    }
+    if (i < count)
+    {
+        key_block_avx2(text + i, count - i, keys + i, hashes + i);
+    }
+}
+#endif
+
+/**
+ * 计算连续count个窗口（起点为text到text+count-1）的哈希表桶号，结果与逐个调用 hash_gram() 相同
+ * 支持AVX-512/AVX2的处理器上按16/8个窗口一组并行计算DJB2，求余用乘法完成
+ * @param text 第一个窗口的起点，text[count + N_GRAM - 2] 必须可读
+ * @param count 窗口数量
+ * @param table_size 哈希表大小
+ * @param indices 返回各窗口的桶号
+ */
+void hash_gram_block(const char *text, int count, int table_size, unsigned int indices[])
+{
+    unsigned long long magic = fast_mod_magic((unsigned int)table_size);
+
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        djb2_block_avx512(text, count, indices);
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        djb2_block_avx2(text, count, indices);
+    }
+    else
+#endif
+    {
+        djb2_block_scalar(text, count, indices);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        indices[i] = fast_mod(indices[i], magic, (unsigned int)table_size);
+    }
+}
+
+/**
+ * 计算连续count个窗口的打包键及其 gram_key_hash()，供并发表和分区引擎成块使用
+ * @param text 第一个窗口的起点，text[count + N_GRAM - 2] 必须可读
+ * @param count 窗口数量
+ * @param keys 返回各窗口的打包键
+ * @param hashes 返回各键的哈希值
+ */
+void hash_key_block(const char *text, int count, unsigned long long keys[], unsigned int hashes[])
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    {
+        key_block_avx512(text, count, keys, hashes);
+        return;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        key_block_avx2(text, count, keys, hashes);
+        return;
+    }
+#endif
+    key_block_scalar(text, count, keys, hashes);
+}
+
+/**
+ * 在指定桶中查找定长n-gram，找到则计数加一，否则新建节点
+ */
+static void add_gram_at(HashTable *ht, const char *gram, unsigned int index)
+{
+    NGramNode *current = ht->table[index];
+    while (current != NULL)
+    {
+        if (memcmp(current->gram, gram, N_GRAM) == 0)
+        {
+            current->count++;
+            return;
+        }
+        current = current->next;
+    }
+
+    NGramNode *new_node = (NGramNode *)malloc(sizeof(NGramNode));
+    memcpy(new_node->gram, gram, N_GRAM);
+    new_node->gram[N_GRAM] = '\0';
+    new_node->count = 1;
+    new_node->next = ht->table[index];
+    ht->table[index] = new_node;
+}
+
+/**
+ * 批量向哈希表添加n-gram
+ * 分三步处理一批键：先算出全部桶号并预取桶槽，再预取各桶的首节点，最后依次插入。
+ * 前两步只是缓存提示，插入本身仍按顺序进行，同一批中的重复键照常累加计数
+ * @param ht 目标哈希表
+ * @param grams 指向各n-gram的指针（每个N_GRAM字节，不要求以'\0'结尾）
+ * @param count 本批数量（不超过PROBE_BATCH）
+ */
+void addhash_batch(HashTable *ht, const char *const grams[], int count)
+{
+    unsigned int index[PROBE_BATCH];
+
+    for (int k = 0; k < count; k++)
+    {
+        index[k] = hash_gram(grams[k], ht->size);
+        PREFETCH(&ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        PREFETCH(ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        add_gram_at(ht, grams[k], index[k]);
+    }
+}
+
+/**
+ * 把文本中连续count个窗口的n-gram加入哈希表
+ * 与 addhash_batch() 相同的三步预取，但桶号由 hash_gram_block() 成块计算
+ * @param ht 目标哈希表
+ * @param text 第一个窗口的起点
+ * @param count 窗口数量（不超过PROBE_BATCH）
+ */
+void addhash_block(HashTable *ht, const char *text, int count)
+{
+    unsigned int index[PROBE_BATCH];
+
+    hash_gram_block(text, count, ht->size, index);
+    for (int k = 0; k < count; k++)
+    {
+        PREFETCH(&ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        PREFETCH(ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        add_gram_at(ht, text + k, index[k]);
+    }
+}
+
+/**
+ * 批量查询n-gram，预取方式同 addhash_batch()
+ * @param ht 被查询的哈希表
+ * @param grams 指向各n-gram的指针（每个N_GRAM字节，不要求以'\0'结尾）
+ * @param count 本批数量（不超过PROBE_BATCH）
+ * @param results 返回各n-gram对应的节点，不存在时为NULL
+ */
+void probe_batch(HashTable *ht, const char *const grams[], int count, NGramNode *results[])
+{
+    unsigned int index[PROBE_BATCH];
+
+    for (int k = 0; k < count; k++)
+    {
+        index[k] = hash_gram(grams[k], ht->size);
+        PREFETCH(&ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        PREFETCH(ht->table[index[k]]);
+    }
+    for (int k = 0; k < count; k++)
+    {
+        NGramNode *current = ht->table[index[k]];
+        while (current != NULL && memcmp(current->gram, grams[k], N_GRAM) != 0)
+        {
+            current = current->next;
+        }
+        results[k] = current;
+    }
+}
+
+// ==================== 定长键 ====================
+
+/**
+ * 把定长n-gram打包成64位键
+ * @param gram 指向N_GRAM个字节的指针（不要求以'\0'结尾）
+ * @return 非0的键
+ */
+unsigned long long pack_gram(const char *gram)
+{
+    unsigned long long key = 1;
+    for (int i = 0; i < N_GRAM; i++)
+    {
+        key = (key << 8) | (unsigned char)gram[i];
+    }
+    return key;
+}
+
+/**
+ * 键的哈希函数：乘法加异或移位（multiply-xorshift），高低位混合充分，表容量取2的幂即可
+ * @param key 打包后的键
+ * @return 32位哈希值
+ */
+unsigned int gram_key_hash(unsigned long long key)
+{
+    key *= 0x9E3779B97F4A7C15ULL;
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    return (unsigned int)(key >> 32);
+}
+
+// ==================== 阈值判定 ====================
+
+/**
+ * 相似度达到阈值所需的最小交集
+ * J = I / (Ta + Tb - I) 随I单调递增，先由 I ≥ t(Ta + Tb) / (1 + t) 估计，再用jaccard_from_counts()逐个校正，
+ * 保证判定结果与算出相似度后再和阈值比较完全一致
+ * @param total_a 第一篇文档的n-gram总数
+ * @param total_b 第二篇文档的n-gram总数
+ * @param threshold 阈值
+ * @return 最小交集；交集最大也只能是两者中较小的总数，返回值超过它表示不可能达到阈值
+ */
+long long threshold_need(long long total_a, long long total_b, float threshold)
+{
+    long long limit = total_a < total_b ? total_a : total_b;
+    long long need = (long long)ceil((double)threshold * (double)(total_a + total_b) / (1.0 + (double)threshold));
+    need = need < 0 ? 0 : need > limit + 1 ? limit + 1 : need;
+
+    while (need > 0 && jaccard_from_counts(need - 1, total_a + total_b - (need - 1)) >= threshold)
+    {
+        need--;
+    }
+    while (need <= limit && jaccard_from_counts(need, total_a + total_b - need) < threshold)
+    {
+        need++;
+    }
+    return need;
+}
+
+/**
+ * 初始化阈值判定状态
+ * @param need 达到阈值所需的最小交集（threshold_need()）
+ * @param possible 交集的初始上界，通常是遍历一侧的n-gram总数
+ */
+void init_threshold(ThresholdState *state, long long need, long long possible)
+{
+    state->need = need;
+    atomic_init(&state->found, 0);
+    atomic_init(&state->possible, possible);
+}
+
+/**
+ * 记入一段比较的结果：这一段的上界是checked，实际交集是found，上界因此降低 checked - found
+ */
+void threshold_update(ThresholdState *state, long long found, long long checked)
+{
+    if (found > 0)
+    {
+        atomic_fetch_add_explicit(&state->found, found, memory_order_relaxed);
+    }
+    if (checked > found)
+    {
+        atomic_fetch_sub_explicit(&state->possible, checked - found, memory_order_relaxed);
+    }
+}
+
+/**
+ * @return 1表示必然达到阈值，0表示必然达不到，-1表示尚不能确定
+ */
+int threshold_outcome(ThresholdState *state)
+{
+    if (atomic_load_explicit(&state->found, memory_order_relaxed) >= state->need)
+    {
+        return 1;
+    }
+    if (atomic_load_explicit(&state->possible, memory_order_relaxed) < state->need)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * 探测一批节点并更新阈值判定状态
+ */
+static void threshold_probe(HashTable *ht, NGramNode *nodes[], int count, ThresholdState *state)
+{
+    long long checked = 0;
+    for (int k = 0; k < count; k++)
+    {
+        checked += nodes[k]->count;
+    }
+    threshold_update(state, intersect_batch(ht, nodes, count), checked);
+}
+
+/**
+ * 阈值判定：遍历ht1的n-gram到ht2中探测，每探测一批就检查结果是否已经确定，确定后立即停止
+ * 调用者用ht1的n-gram总数作为上界初始化state，ht1应是较小的一篇，上界更紧
+ * @param ht1 遍历的哈希表
+ * @param ht2 探测的哈希表
+ * @param state 阈值判定状态
+ * @return 1表示相似度达到阈值，0表示达不到
+ */
+int threshold_intersection(HashTable *ht1, HashTable *ht2, ThresholdState *state)
+{
+    NGramNode *nodes[PROBE_BATCH];
+    int pending = 0;
+    int outcome = threshold_outcome(state);
+
+    for (int i = 0; i < ht1->size && outcome < 0; i++)
+    {
+        for (NGramNode *current = ht1->table[i]; current != NULL; current = current->next)
+        {
+            nodes[pending++] = current;
+            if (pending == PROBE_BATCH)
+            {
+                threshold_probe(ht2, nodes, pending, state);
+                pending = 0;
+            }
+        }
+        outcome = threshold_outcome(state);
+    }
+    if (outcome < 0 && pending > 0)
+    {
+        threshold_probe(ht2, nodes, pending, state);
+    }
+    return threshold_outcome(state) == 1;
+}
+
+/**
+ * 用哈希表判定两篇文档的相似度是否达到阈值：遍历较小文档的表，交集上界是它的n-gram总数
+ * @param total_a 第一篇文档的n-gram总数
+ * @param total_b 第二篇文档的n-gram总数
+ * @return 1表示相似度达到阈值，0表示达不到
+ */
+int hash_table_threshold(HashTable *ht_a, HashTable *ht_b, long long total_a, long long total_b, float threshold)
+{
+    int a_smaller = total_a <= total_b;
+    ThresholdState state;
+
+    init_threshold(&state, threshold_need(total_a, total_b, threshold), a_smaller ? total_a : total_b);
+    return a_smaller ? threshold_intersection(ht_a, ht_b, &state) : threshold_intersection(ht_b, ht_a, &state);
+}
+
+// ==================== 并发计数表 ====================
+
+/**
+ * 并发计数表的槽数
+ * 不同n-gram的数量不会超过n-gram总数，也不会超过键空间大小；容量取其2倍向上对齐到2的幂，
+ * 装载因子始终不超过一半，插入时不需要扩容
+ * @param expected_grams 将要插入的n-gram总数
+ */
+size_t concurrent_table_capacity(long long expected_grams)
+{
+    long long distinct = expected_grams > 0 ? expected_grams : 1;
+    if (N_GRAM * 8 < 62 && distinct > (1LL << (N_GRAM * 8)))
+    {
+        distinct = 1LL << (N_GRAM * 8);
+    }
+
+    size_t capacity = 16;
+    while (capacity < (size_t)distinct * 2)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/**
+ * 创建并发计数表，容量见 concurrent_table_capacity()
+ * @param expected_grams 将要插入的n-gram总数
+ * @return 新创建的并发表
+ */
+ConcurrentTable *create_concurrent_table(long long expected_grams)
+{
+    size_t capacity = concurrent_table_capacity(expected_grams);
+
+    ConcurrentTable *ct = (ConcurrentTable *)malloc(sizeof(ConcurrentTable));
+    ct->keys = (_Atomic unsigned long long *)calloc(capacity, sizeof(unsigned long long));
+    ct->counts = (atomic_int *)calloc(capacity, sizeof(int));
+    ct->mask = capacity - 1;
+    return ct;
+}
+
+/**
+ * 释放并发计数表
+ * @param ct 要释放的并发表
+ */
+void free_concurrent_table(ConcurrentTable *ct)
+{
+    free((void *)ct->keys);
+    free((void *)ct->counts);
+    free(ct);
+}
+
+/**
+ * 并发计数表占用的字节数
+ */
+size_t concurrent_table_bytes(const ConcurrentTable *ct)
+{
+    return sizeof(ConcurrentTable) + (ct->mask + 1) * (sizeof(unsigned long long) + sizeof(int));
+}
+
+/**
+ * 向并发表中累加一个n-gram的计数（线程安全，无锁）
+ * 线性探测找到键所在的槽；遇到空槽时用CAS占位，CAS失败说明别的线程抢先写入了某个键，
+ * 若恰好是同一个键就直接累加，否则继续向后探测
+ * @param ct 目标并发表
+ * @param key 打包后的键
+ * @param count 要累加的次数
+ */
+void concurrent_table_add(ConcurrentTable *ct, unsigned long long key, int count)
+{
+    concurrent_table_add_hashed(ct, key, gram_key_hash(key), count);
+}
+
+/**
+ * 同 concurrent_table_add()，但键的哈希值已由调用者算好（例如由 hash_key_block() 成块算出）
+ * @param ct 目标并发表
+ * @param key 打包后的键
+ * @param hash gram_key_hash(key)
+ * @param count 要累加的次数
+ */
+void concurrent_table_add_hashed(ConcurrentTable *ct, unsigned long long key, unsigned int hash, int count)
+{
+    size_t i = hash & ct->mask;
+
+    for (;;)
+    {
+        unsigned long long current = atomic_load_explicit(&ct->keys[i], memory_order_relaxed);
+        if (current == 0)
+        {
+            unsigned long long expected = 0;
+            if (atomic_compare_exchange_strong_explicit(&ct->keys[i], &expected, key,
+                                                        memory_order_relaxed, memory_order_relaxed))
+            {
+                current = key;
+            }
+            else
+            {
+                current = expected;
+            }
+        }
+        if (current == key)
+        {
+            atomic_fetch_add_explicit(&ct->counts[i], count, memory_order_relaxed);
+            return;
+        }
+        i = (i + 1) & ct->mask;
+    }
+}
+
+/**
+ * 查询n-gram在并发表中的计数
+ * 应在所有写入线程结束后调用
+ * @param ct 并发表
+ * @param key 打包后的键
+ * @return 出现次数，不存在时为0
+ */
+int concurrent_table_get(const ConcurrentTable *ct, unsigned long long key)
+{
+    size_t i = gram_key_hash(key) & ct->mask;
+
+    for (;;)
+    {
+        unsigned long long current = atomic_load_explicit(&ct->keys[i], memory_order_relaxed);
+        if (current == key)
+        {
+            return atomic_load_explicit(&ct->counts[i], memory_order_relaxed);
+        }
+        if (current == 0)
+        {
+            return 0;
+        }
+        i = (i + 1) & ct->mask;
+    }
+}
+
+/**
+ * 把起始位置落在 [start, end) 内的n-gram写入并发表，可被多个线程同时调用
+ * @param text 输入文本（已预处理）
+ * @param start 起始位置（含）
+ * @param end 结束位置（不含）
+ * @param ct 目标并发表
+ */
+void generate_ngrams_concurrent_range(const char *text, int start, int end, ConcurrentTable *ct)
+{
+    unsigned long long keys[PROBE_BATCH];
+    unsigned int hashes[PROBE_BATCH];
+
+    for (int i = start; i < end; i += PROBE_BATCH)
+    {
+        int count = end - i < PROBE_BATCH ? end - i : PROBE_BATCH;
+        hash_key_block(text + i, count, keys, hashes);
+        for (int k = 0; k < count; k++)
+        {
+            PREFETCH(&ct->keys[hashes[k] & ct->mask]);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            concurrent_table_add_hashed(ct, keys[k], hashes[k], 1);
+        }
+    }
+}
+
+/**
+ * 同 generate_ngrams_concurrent_range()，但只写入 gram_key_hash() 不超过limit的n-gram；
+ * 抽样只取决于n-gram本身，两篇文档用同一个limit抽到的是同一组n-gram
+ */
+void generate_ngrams_sampled_range(const char *text, int start, int end, ConcurrentTable *ct, unsigned int limit)
+{
+    unsigned long long keys[PROBE_BATCH];
+    unsigned int hashes[PROBE_BATCH];
+
+    for (int i = start; i < end; i += PROBE_BATCH)
+    {
+        int count = end - i < PROBE_BATCH ? end - i : PROBE_BATCH;
+        hash_key_block(text + i, count, keys, hashes);
+        for (int k = 0; k < count; k++)
+        {
+            if (hashes[k] <= limit)
+            {
+                concurrent_table_add_hashed(ct, keys[k], hashes[k], 1);
+            }
+        }
+    }
+}
+
+typedef struct
+{
+    const char *text;
+    int start;
+    int end;
+    ConcurrentTable *ct;
+    unsigned int limit;
+} ConcurrentWorker;
+
+static void *concurrent_build_worker(void *arg)
+{
+    ConcurrentWorker *worker = (ConcurrentWorker *)arg;
+    if (worker->limit == SAMPLE_ALL)
+    {
+        generate_ngrams_concurrent_range(worker->text, worker->start, worker->end, worker->ct);
+    }
+    else
+    {
+        generate_ngrams_sampled_range(worker->text, worker->start, worker->end, worker->ct, worker->limit);
+    }
+    return NULL;
+}
+
+/**
+ * 多线程把整篇文本写入同一张并发表，没有私有表也没有合并阶段
+ * @param text 输入文本（已预处理）
+ * @param ct 目标并发表（容量应按文本长度创建）
+ * @param num_threads 线程数
+ */
+void generate_ngrams_concurrent(const char *text, ConcurrentTable *ct, int num_threads)
+{
+    generate_ngrams_sampled(text, ct, num_threads, SAMPLE_ALL);
+}
+
+/**
+ * 同 generate_ngrams_concurrent()，但只写入 gram_key_hash() 不超过limit的n-gram
+ * @param limit 抽样上限（sample_limit()），SAMPLE_ALL 表示全部写入
+ */
+void generate_ngrams_sampled(const char *text, ConcurrentTable *ct, int num_threads, unsigned int limit)
+{
+    int positions = (int)strlen(text) - N_GRAM + 1;
+    ConcurrentWorker workers[MAX_THREADS];
+
+    if (num_threads > MAX_THREADS)
+    {
+        num_threads = MAX_THREADS;
+    }
+    if (num_threads > positions / MIN_CHUNK_SIZE)
+    {
+        num_threads = positions / MIN_CHUNK_SIZE;
+    }
+    if (num_threads <= 1)
+    {
+        ConcurrentWorker worker = {text, 0, positions, ct, limit};
+        concurrent_build_worker(&worker);
+        return;
+    }
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        workers[i].text = text;
+        workers[i].start = (int)((long long)positions * i / num_threads);
+        workers[i].end = (int)((long long)positions * (i + 1) / num_threads);
+        workers[i].ct = ct;
+        workers[i].limit = limit;
+    }
+    run_parallel(concurrent_build_worker, workers, sizeof(ConcurrentWorker), num_threads);
+}
+
+/**
+ * 计算并发表a中 [slot_start, slot_end) 范围内的n-gram与b的交集数量（取最小计数之和）
+ * @param a 遍历的表
+ * @param b 查询的表
+ * @param slot_start 起始槽（含）
+ * @param slot_end 结束槽（不含）
+ * @return 该区间的交集数量
+ */
+long long concurrent_intersection_range(const ConcurrentTable *a, const ConcurrentTable *b, size_t slot_start, size_t slot_end)
+{
+    long long intersection = 0;
+
+    for (size_t i = slot_start; i < slot_end; i++)
+    {
+        unsigned long long key = atomic_load_explicit(&a->keys[i], memory_order_relaxed);
+        if (key == 0)
+        {
+            continue;
+        }
+        int count_a = atomic_load_explicit(&a->counts[i], memory_order_relaxed);
+        int count_b = concurrent_table_get(b, key);
+        intersection += count_a < count_b ? count_a : count_b;
+    }
+
+    return intersection;
+}
+
+/**
+ * 阈值判定版本的concurrent_intersection_range()：每比较THRESHOLD_CHECK_SLOTS个槽就把结果记入共享的state，
+ * 结果确定后（包括被其他子任务确定）立即停止
+ */
+void concurrent_threshold_range(const ConcurrentTable *a, const ConcurrentTable *b, size_t slot_start, size_t slot_end,
+                                ThresholdState *state)
+{
+    for (size_t start = slot_start; start < slot_end && threshold_outcome(state) < 0; start += THRESHOLD_CHECK_SLOTS)
+    {
+        size_t end = slot_end - start < THRESHOLD_CHECK_SLOTS ? slot_end : start + THRESHOLD_CHECK_SLOTS;
+        long long found = 0;
+        long long checked = 0;
+
+        for (size_t i = start; i < end; i++)
+        {
+            unsigned long long key = atomic_load_explicit(&a->keys[i], memory_order_relaxed);
+            if (key == 0)
+            {
+                continue;
+            }
+            int count_a = atomic_load_explicit(&a->counts[i], memory_order_relaxed);
+            int count_b = concurrent_table_get(b, key);
+            found += count_a < count_b ? count_a : count_b;
+            checked += count_a;
+        }
+        threshold_update(state, found, checked);
+    }
+}
+
+// ==================== 分区（radix partitioning）引擎 ====================
+
+/**
+ * 单调时钟的当前值（纳秒）
+ */
+long long monotonic_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+/**
+ * 选择分区位数，使每个分区建出的表（键8字节、计数4字节、装载因子一半）能放进L2缓存
+ * @param total_grams 较大文档的n-gram数量（用文件字节数估计即可）
+ * @return 分区位数（分区数为 1 << bits）
+ */
+int choose_partition_bits(long long total_grams)
+{
+    long long per_partition = PARTITION_CACHE_BYTES / (2 * (sizeof(unsigned long long) + sizeof(int)));
+    int bits = 0;
+
+    while (bits < PARTITION_MAX_BITS && (total_grams >> bits) > per_partition)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+typedef struct
+{
+    const char *text;
+    int start;
+    int end;
+    int bits;
+    size_t *cursor;
+    unsigned long long *keys;
+} ScatterWorker;
+
+static void *scatter_count_worker(void *arg)
+{
+    ScatterWorker *worker = (ScatterWorker *)arg;
+    int shift = 32 - worker->bits;
+    unsigned long long keys[PROBE_BATCH];
+    unsigned int hashes[PROBE_BATCH];
+
+    for (int i = worker->start; i < worker->end; i += PROBE_BATCH)
+    {
+        int count = worker->end - i < PROBE_BATCH ? worker->end - i : PROBE_BATCH;
+        hash_key_block(worker->text + i, count, keys, hashes);
+        for (int k = 0; k < count; k++)
+        {
+            worker->cursor[worker->bits == 0 ? 0 : hashes[k] >> shift]++;
+        }
+    }
+    return NULL;
+}
+
+static void *scatter_write_worker(void *arg)
+{
+    ScatterWorker *worker = (ScatterWorker *)arg;
+    int shift = 32 - worker->bits;
+    unsigned long long keys[PROBE_BATCH];
+    unsigned int hashes[PROBE_BATCH];
+
+    for (int i = worker->start; i < worker->end; i += PROBE_BATCH)
+    {
+        int count = worker->end - i < PROBE_BATCH ? worker->end - i : PROBE_BATCH;
+        hash_key_block(worker->text + i, count, keys, hashes);
+        for (int k = 0; k < count; k++)
+        {
+            worker->keys[worker->cursor[worker->bits == 0 ? 0 : hashes[k] >> shift]++] = keys[k];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 分区结构占用的字节数
+ */
+size_t partitioned_grams_bytes(const PartitionedGrams *pg)
+{
+    return sizeof(PartitionedGrams) + (size_t)(pg->total > 0 ? pg->total : 1) * sizeof(unsigned long long) +
+           (((size_t)1 << pg->bits) + 1) * sizeof(size_t);
+}
+
+/**
+ * 第一阶段：把文本的所有n-gram键按哈希高位分散到 1 << bits 个分区
+ * 先由各线程统计自己文本段在每个分区的键数，求前缀和得到每个线程在每个分区中的写入起点，
+ * 再由各线程把键写入各自的位置，全程无需同步
+ * @param text 输入文本（已预处理）
+ * @param bits 分区位数
+ * @param num_threads 线程数
+ * @return 分区后的n-gram键
+ */
+PartitionedGrams *scatter_grams(const char *text, int bits, int num_threads)
+{
+    int positions = (int)strlen(text) - N_GRAM + 1;
+    size_t partitions = (size_t)1 << bits;
+    ScatterWorker workers[MAX_THREADS];
+
+    if (positions < 0)
+    {
+        positions = 0;
+    }
+    if (num_threads > MAX_THREADS)
+    {
+        num_threads = MAX_THREADS;
+    }
+    if (num_threads > positions / MIN_CHUNK_SIZE)
+    {
+        num_threads = positions / MIN_CHUNK_SIZE;
+    }
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+
+    PartitionedGrams *pg = (PartitionedGrams *)malloc(sizeof(PartitionedGrams));
+    pg->bits = bits;
+    pg->total = positions;
+    pg->keys = (unsigned long long *)malloc((positions > 0 ? positions : 1) * sizeof(unsigned long long));
+    pg->offsets = (size_t *)malloc((partitions + 1) * sizeof(size_t));
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        workers[t].text = text;
+        workers[t].start = (int)((long long)positions * t / num_threads);
+        workers[t].end = (int)((long long)positions * (t + 1) / num_threads);
+        workers[t].bits = bits;
+        workers[t].cursor = (size_t *)calloc(partitions, sizeof(size_t));
+        workers[t].keys = pg->keys;
+    }
+    run_parallel(scatter_count_worker, workers, sizeof(ScatterWorker), num_threads);
+
+    size_t offset = 0;
+    for (size_t p = 0; p < partitions; p++)
+    {
+        pg->offsets[p] = offset;
+        for (int t = 0; t < num_threads; t++)
+        {
+            size_t count = workers[t].cursor[p];
+            workers[t].cursor[p] = offset;
+            offset += count;
+        }
+    }
+    pg->offsets[partitions] = offset;
+
+    run_parallel(scatter_write_worker, workers, sizeof(ScatterWorker), num_threads);
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        free(workers[t].cursor);
+    }
+    return pg;
+}
+
+/**
+ * 释放分区后的n-gram键
+ * @param pg 要释放的分区结构
+ */
+void free_partitioned_grams(PartitionedGrams *pg)
+{
+    free(pg->keys);
+    free(pg->offsets);
+    free(pg);
+}
+
+/**
+ * 比较阶段每个线程的工作状态，scratch表在各分区之间复用
+ */
+typedef struct
+{
+    const PartitionedGrams *a;
+    const PartitionedGrams *b;
+    atomic_size_t *next;
+    unsigned long long *scratch_keys;
+    int *scratch_counts;
+    size_t scratch_capacity;
+    long long *partition_counts;
+    char *partition_done;
+    long long deadline;
+    ThresholdState *threshold;
+} PartitionWorker;
+
+/**
+ * 计算一个分区内两组键的交集：用较小的一组建表，再用另一组逐个抵消计数
+ */
+static long long intersect_partition(PartitionWorker *worker, const unsigned long long *build, size_t build_count,
+                                     const unsigned long long *probe, size_t probe_count)
+{
+    size_t capacity = 16;
+    while (capacity < build_count * 2)
+    {
+        capacity <<= 1;
+    }
+    if (capacity > worker->scratch_capacity)
+    {
+        free(worker->scratch_keys);
+        free(worker->scratch_counts);
+        worker->scratch_keys = (unsigned long long *)malloc(capacity * sizeof(unsigned long long));
+        worker->scratch_counts = (int *)malloc(capacity * sizeof(int));
+        worker->scratch_capacity = capacity;
+    }
+
+    unsigned long long *keys = worker->scratch_keys;
+    int *counts = worker->scratch_counts;
+    size_t mask = capacity - 1;
+    long long intersection = 0;
+    memset(keys, 0, capacity * sizeof(unsigned long long));
+
+    for (size_t i = 0; i < build_count; i++)
+    {
+        size_t slot = gram_key_hash(build[i]) & mask;
+        while (keys[slot] != 0 && keys[slot] != build[i])
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (keys[slot] == 0)
+        {
+            keys[slot] = build[i];
+            counts[slot] = 0;
+        }
+        counts[slot]++;
+    }
+
+    // 每个命中且计数尚未用完的键贡献1，累计结果即为 min(计数a, 计数b) 之和
+    for (size_t i = 0; i < probe_count; i++)
+    {
+        size_t slot = gram_key_hash(probe[i]) & mask;
+        while (keys[slot] != 0 && keys[slot] != probe[i])
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (keys[slot] != 0 && counts[slot] > 0)
+        {
+            counts[slot]--;
+            intersection++;
+        }
+    }
+    return intersection;
+}
+
+static void *partition_compare_worker(void *arg)
+{
+    PartitionWorker *worker = (PartitionWorker *)arg;
+    size_t partitions = (size_t)1 << worker->a->bits;
+
+    for (;;)
+    {
+        // 有截止时间时，至少比较ANYTIME_MIN_PARTITIONS个分区，保证能给出估计值
+        if (worker->deadline != 0 && atomic_load(worker->next) >= ANYTIME_MIN_PARTITIONS && monotonic_ns() >= worker->deadline)
+        {
+            break;
+        }
+        if (worker->threshold != NULL && threshold_outcome(worker->threshold) >= 0)
+        {
+            break;
+        }
+        size_t p = atomic_fetch_add(worker->next, 1);
+        if (p >= partitions)
+        {
+            break;
+        }
+        if (worker->partition_done != NULL)
+        {
+            worker->partition_done[p] = 1;
+        }
+
+        const unsigned long long *keys_a = worker->a->keys + worker->a->offsets[p];
+        const unsigned long long *keys_b = worker->b->keys + worker->b->offsets[p];
+        size_t count_a = worker->a->offsets[p + 1] - worker->a->offsets[p];
+        size_t count_b = worker->b->offsets[p + 1] - worker->b->offsets[p];
+
+        if (count_a == 0 || count_b == 0)
+        {
+            continue;
+        }
+        if (count_a <= count_b)
+        {
+            worker->partition_counts[p] = intersect_partition(worker, keys_a, count_a, keys_b, count_b);
+        }
+        else
+        {
+            worker->partition_counts[p] = intersect_partition(worker, keys_b, count_b, keys_a, count_a);
+        }
+        if (worker->threshold != NULL)
+        {
+            threshold_update(worker->threshold, worker->partition_counts[p], (long long)(count_a < count_b ? count_a : count_b));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 并行比较各分区，deadline非0时到期后不再领取新分区（已开始的分区仍会完成），
+ * threshold非NULL时阈值判定结果确定后不再领取新分区
+ * @param partition_counts 每个分区的交集（调用者分配并清零）
+ * @param partition_done 每个分区是否已比较（可为NULL）
+ */
+static void compare_partitions(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads,
+                               long long *partition_counts, char *partition_done, long long deadline, ThresholdState *threshold)
+{
+    PartitionWorker workers[MAX_THREADS];
+    atomic_size_t next = 0;
+    size_t partitions = (size_t)1 << a->bits;
+
+    if (num_threads > MAX_THREADS)
+    {
+        num_threads = MAX_THREADS;
+    }
+    if ((size_t)num_threads > partitions)
+    {
+        num_threads = (int)partitions;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < num_threads; t++)
+    {
+        workers[t].a = a;
+        workers[t].b = b;
+        workers[t].next = &next;
+        workers[t].partition_counts = partition_counts;
+        workers[t].partition_done = partition_done;
+        workers[t].deadline = deadline;
+        workers[t].threshold = threshold;
+    }
+    run_parallel(partition_compare_worker, workers, sizeof(PartitionWorker), num_threads);
+
+    for (int t = 0; t < num_threads; t++)
+    {
+        free(workers[t].scratch_keys);
+        free(workers[t].scratch_counts);
+    }
+}
+
+/**
+ * 第二阶段：逐个分区计算交集，分区建出的表足够小，建表和探测都在缓存中完成
+ * 分区之间互不相关，由各线程动态领取；每个分区的交集写入各自的槽位，最后按分区顺序累加
+ * @param a 第一篇文档的分区键（与b的分区位数必须相同）
+ * @param b 第二篇文档的分区键
+ * @param num_threads 线程数
+ * @return 交集数量
+ */
+long long partitioned_intersection(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads)
+{
+    long long intersection = 0;
+    size_t partitions = (size_t)1 << a->bits;
+    long long *partition_counts = (long long *)calloc(partitions, sizeof(long long));
+
+    compare_partitions(a, b, num_threads, partition_counts, NULL, 0, NULL);
+    for (size_t p = 0; p < partitions; p++)
+    {
+        intersection += partition_counts[p];
+    }
+    free(partition_counts);
+    return intersection;
+}
+
+/**
+ * 用分区引擎计算Jaccard相似度，结果与calculate_jaccard_similarity()完全一致
+ * @param a 第一篇文档的分区键
+ * @param b 第二篇文档的分区键
+ * @param num_threads 线程数
+ * @return 相似度分数（0.0-1.0）
+ */
+float partitioned_jaccard_similarity(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads)
+{
+    long long intersection = partitioned_intersection(a, b, num_threads);
+
+    return jaccard_from_counts(intersection, a->total + b->total - intersection);
+}
+
+/**
+ * 用分区引擎判定相似度是否达到阈值
+ * 一个分区的交集不会超过该分区两侧键数的较小者，这些较小者之和就是交集的初始上界；
+ * 不相关的文档往往一开始就被这个上界排除，不必建任何表
+ * @param a 第一篇文档的分区键（与b的分区位数必须相同）
+ * @param b 第二篇文档的分区键
+ * @param num_threads 线程数
+ * @param threshold 阈值
+ * @return 1表示相似度达到阈值，0表示达不到
+ */
+int partitioned_threshold(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads, float threshold)
+{
+    size_t partitions = (size_t)1 << a->bits;
+    long long possible = 0;
+    for (size_t p = 0; p < partitions; p++)
+    {
+        size_t count_a = a->offsets[p + 1] - a->offsets[p];
+        size_t count_b = b->offsets[p + 1] - b->offsets[p];
+        possible += (long long)(count_a < count_b ? count_a : count_b);
+    }
+
+    ThresholdState state;
+    init_threshold(&state, threshold_need(a->total, b->total, threshold), possible);
+    if (threshold_outcome(&state) < 0)
+    {
+        long long *partition_counts = (long long *)calloc(partitions, sizeof(long long));
+        compare_partitions(a, b, num_threads, partition_counts, NULL, 0, &state);
+        free(partition_counts);
+    }
+    return threshold_outcome(&state) == 1;
+}
+
+/**
+ * 在截止时间内计算Jaccard相似度，来不及比较全部分区时给出近似值
+ * 分区号取自键的哈希，每个分区相当于从全部不同n-gram中随机抽取的一组，已比较的分区就是一个整群抽样：
+ * 相似度按 Σ交集 / Σ并集 的比率估计，误差取比率估计量方差（含有限总体校正）的1.96倍
+ * @param a 第一篇文档的分区键（与b的分区位数必须相同）
+ * @param b 第二篇文档的分区键
+ * @param num_threads 线程数
+ * @param deadline 截止时间（monotonic_ns()的值）
+ * @return 相似度及其误差；全部分区都比较完时结果与partitioned_jaccard_similarity()完全一致
+ */
+SimilarityEstimate anytime_jaccard_similarity(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads, long long deadline)
+{
+    size_t partitions = (size_t)1 << a->bits;
+    long long *partition_counts = (long long *)calloc(partitions, sizeof(long long));
+    char *partition_done = (char *)calloc(partitions, 1);
+    SimilarityEstimate estimate = {0.0f, 0.0, 1, 0, partitions};
+
+    compare_partitions(a, b, num_threads, partition_counts, partition_done, deadline, NULL);
+
+    long long intersection = 0;
+    long long union_total = 0;
+    for (size_t p = 0; p < partitions; p++)
+    {
+        if (partition_done[p])
+        {
+            long long sizes = (long long)(a->offsets[p + 1] - a->offsets[p] + b->offsets[p + 1] - b->offsets[p]);
+            intersection += partition_counts[p];
+            union_total += sizes - partition_counts[p];
+            estimate.partitions_done++;
+        }
+    }
+
+    if (estimate.partitions_done == partitions)
+    {
+        estimate.similarity = jaccard_from_counts(intersection, union_total);
+    }
+    else
+    {
+        double ratio = union_total > 0 ? (double)intersection / (double)union_total : 0.0;
+        double m = (double)estimate.partitions_done;
+        double mean_union = (double)union_total / m;
+        double squares = 0.0;
+        for (size_t p = 0; p < partitions; p++)
+        {
+            if (partition_done[p])
+            {
+                long long sizes = (long long)(a->offsets[p + 1] - a->offsets[p] + b->offsets[p + 1] - b->offsets[p]);
+                double residual = (double)partition_counts[p] - ratio * (double)(sizes - partition_counts[p]);
+                squares += residual * residual;
+            }
+        }
+        double variance = mean_union > 0.0 ? (1.0 - m / (double)partitions) * squares / (m - 1.0) / (m * mean_union * mean_union) : 0.0;
+        estimate.similarity = (float)ratio;
+        estimate.error = 1.96 * sqrt(variance);
+        estimate.exact = 0;
+    }
+
+    free(partition_done);
+    free(partition_counts);
+    return estimate;
+}
+
+// ==================== 哈希抽样估计 ====================
+
+/**
+ * 把抽样比例换算成哈希上限：gram_key_hash() 不超过该值的n-gram被抽中
+ * @param rate 抽样比例，(0, 1]
+ * @return 哈希上限，rate为1时是 SAMPLE_ALL
+ */
+unsigned int sample_limit(double rate)
+{
+    if (rate >= 1.0)
+    {
+        return SAMPLE_ALL;
+    }
+    return (unsigned int)(rate * 4294967296.0);
+}
+
+/**
+ * 按抽样比例创建并发表
+ * 抽中的不同n-gram数服从二项分布，均值不超过 positions × 比例；在均值上留出8倍标准差余量，
+ * 表又按2倍容量创建，不可能被填满
+ * @param positions 文档的n-gram总数
+ * @param limit 抽样上限
+ * @return 新创建的并发表
+ */
+ConcurrentTable *create_sample_table(long long positions, unsigned int limit)
+{
+    double expected = (double)(positions > 0 ? positions : 0) * ((double)limit + 1.0) / 4294967296.0;
+    return create_concurrent_table((long long)(expected + 8.0 * sqrt(expected)) + 64);
+}
+
+/**
+ * 用两篇文档抽到的n-gram估计Jaccard相似度
+ * 每个不同的n-gram以相同概率p被抽中（两篇文档一致），它对交集贡献 x = min(计数)，对并集贡献 y = max(计数)；
+ * 相似度按 Σx / Σy 的比率估计，伯努利抽样下其方差约为 (1 - p) Σ(x - R·y)² / (Σy)²，误差取方差平方根的1.96倍
+ * @param a 第一篇文档的抽样表
+ * @param b 第二篇文档的抽样表（与a使用同一个limit）
+ * @param rate 抽样比例
+ * @return 相似度及其误差；rate为1时结果与完整计算一致
+ */
+SimilarityEstimate sampled_jaccard_similarity(const ConcurrentTable *a, const ConcurrentTable *b, double rate)
+{
+    SimilarityEstimate estimate = {0.0f, 0.0, rate >= 1.0, 0, 0};
+    long long sum_x = 0;
+    long long sum_y = 0;
+    double xx = 0.0;
+    double xy = 0.0;
+    double yy = 0.0;
+
+    for (size_t i = 0; i <= a->mask; i++)
+    {
+        unsigned long long key = atomic_load_explicit(&a->keys[i], memory_order_relaxed);
+        if (key == 0)
+        {
+            continue;
+        }
+        int count_a = atomic_load_explicit(&a->counts[i], memory_order_relaxed);
+        int count_b = concurrent_table_get(b, key);
+        double x = count_a < count_b ? count_a : count_b;
+        double y = count_a < count_b ? count_b : count_a;
+        sum_x += (long long)x;
+        sum_y += (long long)y;
+        xx += x * x;
+        xy += x * y;
+        yy += y * y;
+    }
+    for (size_t i = 0; i <= b->mask; i++)
+    {
+        unsigned long long key = atomic_load_explicit(&b->keys[i], memory_order_relaxed);
+        if (key == 0 || concurrent_table_get(a, key) != 0)
+        {
+            continue;
+        }
+        double y = atomic_load_explicit(&b->counts[i], memory_order_relaxed);
+        sum_y += (long long)y;
+        yy += y * y;
+    }
+
+    estimate.similarity = jaccard_from_counts(sum_x, sum_y);
+    if (!estimate.exact)
+    {
+        double ratio = estimate.similarity;
+        double squares = xx - 2.0 * ratio * xy + ratio * ratio * yy;
+        // 一个n-gram都没抽到时没有任何信息
+        estimate.error = sum_y > 0 ? 1.96 * sqrt((1.0 - rate) * (squares > 0.0 ? squares : 0.0)) / (double)sum_y : 1.0;
+    }
+    return estimate;
+}
+
+// ==================== 文件读取 ====================
+
+#ifdef HAVE_PREAD
+/**
+ * 用pread把文件从offset处读到*length为止
+ * 文件在fstat之后被截短时会提前读到文件尾，此时把*length改为实际读到的长度，缓冲区中不会留下未初始化的部分
+ * @param length 输入为期望的文件长度，返回实际长度
+ * @return 0表示成功，-1表示读取出错
+ */
+int pread_all(int fd, char *buffer, size_t offset, size_t *length)
+{
+    while (offset < *length)
+    {
+        ssize_t got = pread(fd, buffer + offset, *length - offset, (off_t)offset);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got < 0)
+        {
+            return -1;
+        }
+        if (got == 0)
+        {
+            *length = offset;
+            break;
+        }
+        offset += (size_t)got;
+    }
+    return 0;
+}
+#endif
+
+// ==================== 文档特征接口 ====================
+
+/**
+ * 文档特征：按键升序排列的互不相同的n-gram及其出现次数
+ */
+struct PlagProfile
+{
+    unsigned long long *keys;
+    int *counts;
+    size_t distinct;
+    long long total;
+};
+
+/**
+ * 按键的低 N_GRAM 个字节做LSD基数排序，键的其余位（打包时的标记位）都相同，不参与比较
+ * @param keys 待排序的键
+ * @param temp 与keys等长的临时数组
+ * @param count 键的数量
+ */
+static void sort_gram_keys(unsigned long long *keys, unsigned long long *temp, size_t count)
+{
+    for (int pass = 0; pass < N_GRAM; pass++)
+    {
+        size_t offsets[257] = {0};
+        int shift = pass * 8;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            offsets[((keys[i] >> shift) & 0xFF) + 1]++;
+        }
+        for (int b = 0; b < 256; b++)
+        {
+            offsets[b + 1] += offsets[b];
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            temp[offsets[(keys[i] >> shift) & 0xFF]++] = keys[i];
+        }
+
+        unsigned long long *swap = keys;
+        keys = temp;
+        temp = swap;
+    }
+    // 趟数为奇数时结果在临时数组里
+    if (N_GRAM % 2 != 0)
+    {
+        memcpy(temp, keys, count * sizeof(unsigned long long));
+    }
+}
+
+int plag_abi_version(void)
+{
+    return PLAG_ABI_VERSION;
+}
+
+/**
+ * 把一段键排序去重后并入文档特征
+ * 排序后的键在keys中原地去重，各键的出现次数借用scratch的空间存放；特征与这一段按键归并成新的数组
+ * @param profile 已累积的特征（键升序）
+ * @param keys 这一段的键（会被改写）
+ * @param scratch 至少与这一段等长的临时数组
+ * @param count 这一段的键数
+ * @return 0表示成功，-1表示内存不足
+ */
+static int profile_add_run(PlagProfile *profile, unsigned long long *keys, unsigned long long *scratch, size_t count)
+{
+    sort_gram_keys(keys, scratch, count);
+
+    int *run_counts = (int *)scratch;
+    size_t run = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (run > 0 && keys[run - 1] == keys[i])
+        {
+            run_counts[run - 1]++;
+        }
+        else
+        {
+            keys[run] = keys[i];
+            run_counts[run++] = 1;
+        }
+    }
+
+    size_t capacity = profile->distinct + run > 0 ? profile->distinct + run : 1;
+    unsigned long long *merged_keys = (unsigned long long *)malloc(capacity * sizeof(unsigned long long));
+    int *merged_counts = (int *)malloc(capacity * sizeof(int));
+    if (merged_keys == NULL || merged_counts == NULL)
+    {
+        free(merged_counts);
+        free(merged_keys);
+        return -1;
+    }
+
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+    while (i < profile->distinct || j < run)
+    {
+        if (j == run || (i < profile->distinct && profile->keys[i] < keys[j]))
+        {
+            merged_keys[n] = profile->keys[i];
+            merged_counts[n++] = profile->counts[i++];
+        }
+        else if (i == profile->distinct || keys[j] < profile->keys[i])
+        {
+            merged_keys[n] = keys[j];
+            merged_counts[n++] = run_counts[j++];
+        }
+        else
+        {
+            merged_keys[n] = keys[j];
+            merged_counts[n++] = profile->counts[i++] + run_counts[j++];
+        }
+    }
+    free(profile->keys);
+    free(profile->counts);
+    profile->keys = merged_keys;
+    profile->counts = merged_counts;
+    profile->distinct = n;
+    profile->total += (long long)count;
+    return 0;
+}
+
+PlagProfile *plag_profile_create(const char *data, size_t length)
+{
+    if (data == NULL && length > 0)
+    {
+        return NULL;
+    }
+
+    // 键按固定长度分段收集、排序去重后并入特征，临时内存与文本长度无关，
+    // 只与段长和文档中不同n-gram的数量有关；短文档只按实际长度分配
+    size_t run_keys = length < PROFILE_RUN_KEYS ? (length > 0 ? length : 1) : PROFILE_RUN_KEYS;
+    PlagProfile *profile = (PlagProfile *)calloc(1, sizeof(PlagProfile));
+    unsigned long long *keys = (unsigned long long *)malloc(run_keys * sizeof(unsigned long long));
+    unsigned long long *scratch = (unsigned long long *)malloc(run_keys * sizeof(unsigned long long));
+    char *window = (char *)malloc(PROFILE_BLOCK + N_GRAM);
+    int ok = profile != NULL && keys != NULL && scratch != NULL && window != NULL;
+
+    // window开头保留上一块末尾的N_GRAM-1个字节，跨块的n-gram不会丢失
+    size_t kept = 0;
+    size_t count = 0;
+    size_t pos = 0;
+    while (ok && pos < length)
+    {
+        size_t len = length - pos < PROFILE_BLOCK ? length - pos : PROFILE_BLOCK;
+        size_t consumed = 0;
+        size_t n = kept + normalize_block(data + pos, len, window + kept, &consumed, pos + len == length);
+        pos += consumed;
+
+        for (size_t i = 0; ok && i + N_GRAM <= n; i++)
+        {
+            keys[count++] = pack_gram(window + i);
+            if (count == run_keys)
+            {
+                ok = profile_add_run(profile, keys, scratch, count) == 0;
+                count = 0;
+            }
+        }
+        kept = n < N_GRAM - 1 ? n : N_GRAM - 1;
+        memmove(window, window + n - kept, kept);
+    }
+    // 最后一段总要并入一次（哪怕为空），空文档也得到有效的键数组
+    ok = ok && profile_add_run(profile, keys, scratch, count) == 0;
+    free(window);
+    free(scratch);
+    free(keys);
+    if (!ok)
+    {
+        plag_profile_free(profile);
+        return NULL;
+    }
+
+    // 合并时按两段之和分配，最后收紧到实际的不同n-gram数
+    if (profile->distinct > 0)
+    {
+        unsigned long long *fitted_keys = (unsigned long long *)realloc(profile->keys, profile->distinct * sizeof(unsigned long long));
+        int *fitted_counts = (int *)realloc(profile->counts, profile->distinct * sizeof(int));
+        profile->keys = fitted_keys != NULL ? fitted_keys : profile->keys;
+        profile->counts = fitted_counts != NULL ? fitted_counts : profile->counts;
+    }
+    return profile;
+}
+
+void plag_profile_free(PlagProfile *profile)
+{
+    if (profile == NULL)
+    {
+        return;
+    }
+    free(profile->keys);
+    free(profile->counts);
+    free(profile);
+}
+
+long long plag_profile_grams(const PlagProfile *profile)
+{
+    return profile != NULL ? profile->total : 0;
+}
+
+/**
+ * 文档特征占用的内存（字节）
+ */
+size_t profile_memory(const PlagProfile *profile)
+{
+    return profile != NULL ? sizeof(PlagProfile) + profile->distinct * (sizeof(unsigned long long) + sizeof(int)) : 0;
+}
+
+float plag_compare(const PlagProfile *a, const PlagProfile *b)
+{
+    if (a == NULL || b == NULL)
+    {
+        return 0.0f;
+    }
+
+    // 两组键都已升序排列，归并一遍即可求出交集
+    long long intersection = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a->distinct && j < b->distinct)
+    {
+        if (a->keys[i] < b->keys[j])
+        {
+            i++;
+        }
+        else if (a->keys[i] > b->keys[j])
+        {
+            j++;
+        }
+        else
+        {
+            intersection += a->counts[i] < b->counts[j] ? a->counts[i] : b->counts[j];
+            i++;
+            j++;
+        }
+    }
+    return jaccard_from_counts(intersection, a->total + b->total - intersection);
+}
+
+/**
+ * 判定两篇文档特征的相似度是否达到阈值，结果与 plag_compare(a, b) >= threshold 完全一致
+ * 归并过程中已确认的交集达到所需的最小交集即可判定达到；已确认的交集加上两侧尚未归并的n-gram数中
+ * 较小的一个仍然不够时，即可判定达不到。每归并THRESHOLD_CHECK_SLOTS步检查一次
+ * @return 1表示达到阈值，0表示达不到
+ */
+int profile_threshold(const PlagProfile *a, const PlagProfile *b, float threshold)
+{
+    if (a == NULL || b == NULL)
+    {
+        return 0.0f >= threshold;
+    }
+
+    long long need = threshold_need(a->total, b->total, threshold);
+    long long found = 0;
+    long long rest_a = a->total;
+    long long rest_b = b->total;
+    size_t i = 0;
+    size_t j = 0;
+    for (size_t step = 0; i < a->distinct && j < b->distinct; step++)
+    {
+        if (step % THRESHOLD_CHECK_SLOTS == 0 && (found >= need || found + (rest_a < rest_b ? rest_a : rest_b) < need))
+        {
+            break;
+        }
+        if (a->keys[i] < b->keys[j])
+        {
+            rest_a -= a->counts[i++];
+        }
+        else if (a->keys[i] > b->keys[j])
+        {
+            rest_b -= b->counts[j++];
+        }
+        else
+        {
+            found += a->counts[i] < b->counts[j] ? a->counts[i] : b->counts[j];
+            rest_a -= a->counts[i++];
+            rest_b -= b->counts[j++];
+        }
+    }
+    return found >= need;
+}
+
+/**
+ * 批量比较中每个线程的参数；above非NULL时只做阈值判定，结果写入above
+ */
+typedef struct
+{
+    const PlagProfile *query;
+    const PlagProfile *const *profiles;
+    float *scores;
+    int *above;
+    float threshold;
+    size_t count;
+    atomic_size_t *next;
+} CompareWorker;
+
+static void *compare_worker(void *arg)
+{
+    CompareWorker *worker = (CompareWorker *)arg;
+    for (;;)
+    {
+        size_t k = atomic_fetch_add(worker->next, 1);
+        if (k >= worker->count)
+        {
+            return NULL;
+        }
+        if (worker->above != NULL)
+        {
+            worker->above[k] = profile_threshold(worker->query, worker->profiles[k], worker->threshold);
+        }
+        else
+        {
+            worker->scores[k] = plag_compare(worker->query, worker->profiles[k]);
+        }
+    }
+}
+
+/**
+ * 多线程把query与每篇文档比较：scores非NULL时计算相似度，否则判定是否达到阈值并写入above
+ */
+static void compare_many(const PlagProfile *query, const PlagProfile *const profiles[], size_t count, float scores[],
+                         int above[], float threshold, int num_threads)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = get_cpu_count();
+    }
+    if (num_threads > MAX_THREADS)
+    {
+        num_threads = MAX_THREADS;
+    }
+    if ((size_t)num_threads > count)
+    {
+        num_threads = count > 0 ? (int)count : 1;
+    }
+
+    // 各文档大小可能相差悬殊，线程逐个领取文档而不是预先平分
+    atomic_size_t next = 0;
+    CompareWorker workers[MAX_THREADS];
+    for (int t = 0; t < num_threads; t++)
+    {
+        workers[t].query = query;
+        workers[t].profiles = profiles;
+        workers[t].scores = scores;
+        workers[t].above = above;
+        workers[t].threshold = threshold;
+        workers[t].count = count;
+        workers[t].next = &next;
+    }
+    if (num_threads <= 1)
+    {
+        compare_worker(&workers[0]);
+        return;
+    }
+    run_parallel(compare_worker, workers, sizeof(CompareWorker), num_threads);
+}
+
+int plag_compare_many(const PlagProfile *query, const PlagProfile *const profiles[], size_t count,
+                      float scores[], int num_threads)
+{
+    if (query == NULL || (count > 0 && (profiles == NULL || scores == NULL)))
+    {
+        return -1;
+    }
+    compare_many(query, profiles, count, scores, NULL, 0.0f, num_threads);
+    return 0;
+}
+
+/**
+ * 阈值判定版本的 plag_compare_many()：above[k]为1表示第k篇文档与query的相似度达到阈值，
+ * 每一对都可能提前结束归并（见 profile_threshold()）
+ * @return 0表示成功，-1表示参数无效
+ */
+int profile_threshold_many(const PlagProfile *query, const PlagProfile *const profiles[], size_t count, float threshold,
+                           int above[], int num_threads)
+{
+    if (query == NULL || (count > 0 && (profiles == NULL || above == NULL)))
+    {
+        return -1;
+    }
+    compare_many(query, profiles, count, NULL, above, threshold, num_threads);
+    return 0;
+}
+
+// ==================== 共享内存特征库 ====================
+
+/**
+ * 特征库头部，位于共享内存开头
+ * 其后依次是count个StoreEntry、各文档的键数组、计数数组和标识字符串，全部按8字节对齐，
+ * 偏移都相对于共享内存起点，任何进程映射到任何地址都能直接使用
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int abi_version;
+    unsigned int n_gram;
+    unsigned long long count;
+    unsigned long long size;
+} StoreHeader;
+
+typedef struct
+{
+    unsigned long long keys_offset;
+    unsigned long long counts_offset;
+    unsigned long long distinct;
+    long long total;
+    unsigned long long id_offset;
+} StoreEntry;
+
+struct PlagStore
+{
+    void *base;
+    size_t size;
+    size_t count;
+    PlagProfile *profiles;
+    const char **ids;
+};
+
+static size_t align8(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+int plag_store_create(const char *name, const PlagProfile *const profiles[], const char *const ids[], size_t count)
+{
+#ifdef HAVE_POSIX_SHM
+    if (name == NULL || (count > 0 && (profiles == NULL || ids == NULL)))
+    {
+        return -1;
+    }
+
+    size_t size = sizeof(StoreHeader) + count * sizeof(StoreEntry);
+    for (size_t i = 0; i < count; i++)
+    {
+        size += align8(profiles[i]->distinct * sizeof(unsigned long long));
+        size += align8(profiles[i]->distinct * sizeof(int));
+        size += align8(strlen(ids[i]) + 1);
+    }
+
+    // 旧库先删名字再新建，已映射旧库的进程继续使用旧内存
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    char *base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return -1;
+    }
+
+    StoreHeader *header = (StoreHeader *)base;
+    StoreEntry *entries = (StoreEntry *)(base + sizeof(StoreHeader));
+    size_t offset = sizeof(StoreHeader) + count * sizeof(StoreEntry);
+    for (size_t i = 0; i < count; i++)
+    {
+        const PlagProfile *profile = profiles[i];
+        size_t id_length = strlen(ids[i]) + 1;
+
+        entries[i].distinct = profile->distinct;
+        entries[i].total = profile->total;
+        entries[i].keys_offset = offset;
+        memcpy(base + offset, profile->keys, profile->distinct * sizeof(unsigned long long));
+        offset += align8(profile->distinct * sizeof(unsigned long long));
+        entries[i].counts_offset = offset;
+        memcpy(base + offset, profile->counts, profile->distinct * sizeof(int));
+        offset += align8(profile->distinct * sizeof(int));
+        entries[i].id_offset = offset;
+        memcpy(base + offset, ids[i], id_length);
+        offset += align8(id_length);
+    }
+    header->abi_version = PLAG_ABI_VERSION;
+    header->n_gram = N_GRAM;
+    header->count = count;
+    header->size = size;
+
+    // 魔数最后写入：映射到一半写好的库的进程会因为魔数不符而拒绝使用
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+    munmap(base, size);
+    return 0;
+#else
+    (void)name;
+    (void)profiles;
+    (void)ids;
+    (void)count;
+    return -1;
+#endif
+}
+
+PlagStore *plag_store_attach(const char *name)
+{
+#ifdef HAVE_POSIX_SHM
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StoreHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *base = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    const StoreHeader *header = (const StoreHeader *)base;
+    int valid = memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) == 0;
+    atomic_thread_fence(memory_order_acquire);
+    valid = valid && header->abi_version == PLAG_ABI_VERSION && header->n_gram == N_GRAM && header->size == size &&
+            header->count <= (size - sizeof(StoreHeader)) / sizeof(StoreEntry);
+
+    // 逐项检查偏移，损坏的库不能让调用者读到映射范围之外
+    const StoreEntry *entries = (const StoreEntry *)(base + sizeof(StoreHeader));
+    for (size_t i = 0; valid && i < header->count; i++)
+    {
+        const StoreEntry *entry = &entries[i];
+        valid = entry->distinct <= size / sizeof(unsigned long long) &&
+                entry->keys_offset <= size - entry->distinct * sizeof(unsigned long long) &&
+                entry->counts_offset <= size - entry->distinct * sizeof(int) &&
+                entry->id_offset < size && memchr(base + entry->id_offset, '\0', size - entry->id_offset) != NULL;
+    }
+    if (!valid)
+    {
+        munmap(base, size);
+        return NULL;
+    }
+
+    PlagStore *store = (PlagStore *)calloc(1, sizeof(PlagStore));
+    size_t count = (size_t)header->count;
+    store->profiles = (PlagProfile *)calloc(count > 0 ? count : 1, sizeof(PlagProfile));
+    store->ids = (const char **)calloc(count > 0 ? count : 1, sizeof(const char *));
+    store->base = base;
+    store->size = size;
+    store->count = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        // 特征直接指向共享内存，不复制
+        store->profiles[i].keys = (unsigned long long *)(base + entries[i].keys_offset);
+        store->profiles[i].counts = (int *)(base + entries[i].counts_offset);
+        store->profiles[i].distinct = (size_t)entries[i].distinct;
+        store->profiles[i].total = entries[i].total;
+        store->ids[i] = base + entries[i].id_offset;
+    }
+    return store;
+#else
+    (void)name;
+    return NULL;
+#endif
+}
+
+void plag_store_detach(PlagStore *store)
+{
+    if (store == NULL)
+    {
+        return;
+    }
+#ifdef HAVE_POSIX_SHM
+    munmap(store->base, store->size);
+#endif
+    free(store->profiles);
+    free(store->ids);
+    free(store);
+}
+
+int plag_store_remove(const char *name)
+{
+#ifdef HAVE_POSIX_SHM
+    return name != NULL && shm_unlink(name) == 0 ? 0 : -1;
+#else
+    (void)name;
+    return -1;
+#endif
+}
+
+size_t plag_store_count(const PlagStore *store)
+{
+    return store != NULL ? store->count : 0;
+}
+
+const PlagProfile *plag_store_profile(const PlagStore *store, size_t index)
+{
+    return store != NULL && index < store->count ? &store->profiles[index] : NULL;
+}
+
+const char *plag_store_id(const PlagStore *store, size_t index)
+{
+    return store != NULL && index < store->count ? store->ids[index] : NULL;
+}
@@ -0,0 +1,323 @@
+/**
+ * 论文查重计算库 - n-gram特征提取与Jaccard相似度
+ * 对外提供稳定的C接口（plag_*），其他服务可以在进程内直接调用，不必启动查重程序；
+ * 查重程序 main.c 与单元测试 ceshi.c 也链接本库，共用同一份实现。
+ *
+ * 构建方式：
+ *   静态库: gcc -O2 -c plagiarism.c index.c && ar rcs libplagiarism.a plagiarism.o index.o
+ *   动态库: gcc -O2 -shared -fPIC -fvisibility=hidden -DPLAG_SHARED -DPLAG_BUILD plagiarism.c -o libplagiarism.so -pthread -lm
+ *   查重程序: gcc -O2 main.c libplagiarism.a -pthread -lm -o main
+ *   （glibc 2.34 之前的系统上共享内存函数在 librt 中，链接时需再加 -lrt）
+ *   单元测试: gcc ceshi.c libplagiarism.a -pthread -lm -o ceshi
+ * 动态库只导出 plag_* 接口；定义了 PLAGIARISM_INTERNAL 的内部接口只保证在静态库中可用，随时可能变化。
+ */
+#ifndef PLAGIARISM_H
+#define PLAGIARISM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// 接口版本：只新增函数时不变，已有函数的签名或语义改变时加一
+#define PLAG_ABI_VERSION 1
+
+#if defined(_WIN32) && defined(PLAG_SHARED)
+#ifdef PLAG_BUILD
+#define PLAG_API __declspec(dllexport)
+#else
+#define PLAG_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define PLAG_API __attribute__((visibility("default")))
+#else
+#define PLAG_API
+#endif
+
+/**
+ * 文档特征（不透明类型）
+ * 保存一篇文档全部n-gram及其出现次数，创建后只读，可被多个线程同时比较
+ */
+typedef struct PlagProfile PlagProfile;
+
+/**
+ * 共享内存特征库（不透明类型）
+ * 一组文档特征平铺在一块命名的POSIX共享内存中，发布后只读；同一台机器上的任意进程都可以只读映射它，
+ * 所有进程共用同一份物理内存，启动时也不必重新读取和预处理参考文档
+ */
+typedef struct PlagStore PlagStore;
+
+/**
+ * 查询库的接口版本
+ * @return 编译库时的 PLAG_ABI_VERSION，与头文件中的值不同说明头文件与库不匹配
+ */
+PLAG_API int plag_abi_version(void);
+
+/**
+ * 直接从调用者的缓冲区创建文档特征
+ * 缓冲区只被读取，不会被修改也不会被整体复制（预处理在固定大小的小缓冲区中分块进行），
+ * 特征不引用缓冲区，函数返回后调用者即可释放或复用它
+ * @param data 原始文本（UTF-8，不要求以'\0'结尾）
+ * @param length 文本字节数
+ * @return 新创建的特征，参数无效或内存不足时返回NULL
+ */
+PLAG_API PlagProfile *plag_profile_create(const char *data, size_t length);
+
+/**
+ * 释放文档特征
+ * @param profile 要释放的特征（可为NULL）
+ */
+PLAG_API void plag_profile_free(PlagProfile *profile);
+
+/**
+ * 文档特征中的n-gram总数（含重复）
+ */
+PLAG_API long long plag_profile_grams(const PlagProfile *profile);
+
+/**
+ * 比较两篇文档的相似度，结果与查重程序对同样两篇文档算出的重复率一致
+ * @return Jaccard相似度（0.0-1.0）
+ */
+PLAG_API float plag_compare(const PlagProfile *a, const PlagProfile *b);
+
+/**
+ * 把一篇文档与多篇文档逐一比较
+ * @param query 被比较的文档
+ * @param profiles 文档特征数组
+ * @param count 数组长度
+ * @param scores 返回每篇文档与query的相似度（至少count个元素）
+ * @param num_threads 线程数，不大于0时使用全部CPU核心
+ * @return 0表示成功，-1表示参数无效
+ */
+PLAG_API int plag_compare_many(const PlagProfile *query, const PlagProfile *const profiles[], size_t count,
+                               float scores[], int num_threads);
+
+/**
+ * 把一组文档特征发布为共享内存特征库
+ * 同名的旧库会先被删除：已经映射旧库的进程不受影响，直到它们自行断开
+ * @param name 共享内存名（以'/'开头，如 "/plagiarism-refs"）
+ * @param profiles 文档特征数组
+ * @param ids 每篇文档的标识（如文件路径），随特征一起保存
+ * @param count 文档数量
+ * @return 0表示成功，-1表示失败（不支持共享内存的平台上总是失败）
+ */
+PLAG_API int plag_store_create(const char *name, const PlagProfile *const profiles[], const char *const ids[], size_t count);
+
+/**
+ * 只读映射一个共享内存特征库
+ * @param name 共享内存名
+ * @return 特征库，不存在、尚未发布完成或格式不符时返回NULL
+ */
+PLAG_API PlagStore *plag_store_attach(const char *name);
+
+/**
+ * 断开特征库的映射；从库中取得的特征和标识随之失效
+ */
+PLAG_API void plag_store_detach(PlagStore *store);
+
+/**
+ * 删除共享内存特征库的名字，已映射的进程仍可继续使用，全部断开后内存才被回收
+ * @return 0表示成功，-1表示失败
+ */
+PLAG_API int plag_store_remove(const char *name);
+
+/**
+ * 特征库中的文档数量
+ */
+PLAG_API size_t plag_store_count(const PlagStore *store);
+
+/**
+ * 特征库中第index篇文档的特征，可直接传给 plag_compare() 和 plag_compare_many()，不能释放
+ */
+PLAG_API const PlagProfile *plag_store_profile(const PlagStore *store, size_t index);
+
+/**
+ * 特征库中第index篇文档的标识
+ */
+PLAG_API const char *plag_store_id(const PlagStore *store, size_t index);
+
+#ifdef PLAGIARISM_INTERNAL
+
+#include <stdatomic.h>
+
+#define N_GRAM 3
+#define HASH_TABLE_SIZE 100003
+#define MAX_THREADS 64
+#define MIN_CHUNK_SIZE 65536
+#define PROBE_BATCH 16
+#define PARTITION_CACHE_BYTES (256 * 1024)
+#define SAMPLE_ALL 0xFFFFFFFFu
+
+// GCC/Clang 的 x86 目标可按运行时检测到的指令集选用AVX2/AVX-512内核
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+#if N_GRAM > 7
+#error "N_GRAM 超过7个字节时无法打包成64位键"
+#endif
+
+/**
+ * n-gram节点结构体
+ * 用于存储每个n-gram片段及其出现次数
+ */
+typedef struct NGramNode
+{
+    char gram[N_GRAM + 1];
+    int count;
+    struct NGramNode *next;
+} NGramNode;
+
+/**
+ * 哈希表结构体
+ * 用于高效存储和查找n-gram，提高查询效率
+ */
+typedef struct
+{
+    NGramNode **table;
+    int size;
+} HashTable;
+
+/**
+ * 按分区存放的n-gram键
+ * 第p个分区的键为 keys[offsets[p]] 到 keys[offsets[p + 1] - 1]，分区号取键哈希的高bits位
+ */
+typedef struct
+{
+    unsigned long long *keys;
+    size_t *offsets;
+    int bits;
+    long long total;
+} PartitionedGrams;
+
+/**
+ * 阈值判定的共享状态
+ * found是已确认的交集，possible是最终交集的上界（已确认的交集 + 尚未比较部分最多还能贡献的数量）；
+ * found ≥ need 时相似度必然达到阈值，possible < need 时必然达不到，两者之一成立即可停止比较
+ */
+typedef struct
+{
+    long long need;
+    atomic_llong found;
+    atomic_llong possible;
+} ThresholdState;
+
+/**
+ * 并发n-gram计数表（开放寻址、无锁）
+ * n-gram定长，直接打包成64位整数作为键（最高处额外置一位，保证键不为0，0表示空槽）。
+ * 插入新键是对键槽的一次CAS，计数递增是原子fetch-add，多个线程可以同时写同一张表，
+ * 既不需要加锁，也不需要线程私有表和合并阶段。容量在创建时按n-gram数量一次性确定，不会扩容。
+ */
+typedef struct
+{
+    _Atomic unsigned long long *keys;
+    atomic_int *counts;
+    size_t mask;
+} ConcurrentTable;
+
+/**
+ * 近似相似度计算结果（限时计算或抽样估计）
+ * exact为0时similarity是由已比较的分区或抽到的n-gram估计出的近似值，真实值以约95%的概率落在 similarity ± error 内；
+ * partitions_done / partitions 只在限时计算时有意义
+ */
+typedef struct
+{
+    float similarity;
+    double error;
+    int exact;
+    size_t partitions_done;
+    size_t partitions;
+} SimilarityEstimate;
+
+void remove_punctuation(char *str);
+void to_lower_case(char *str);
+HashTable *create_hash_table(int size);
+void free_hash_table(HashTable *ht);
+unsigned int hash_function(const char *str, int table_size);
+void addhash(HashTable *ht, const char *gram);
+int get_intersection_count(HashTable *ht1, HashTable *ht2);
+int get_union_count(HashTable *ht1, HashTable *ht2);
+float calculate_jaccard_similarity(HashTable *ht_original, HashTable *ht_plagiarized);
+float jaccard_from_counts(long long intersection, long long union_total);
+void generate_ngrams(const char *text, HashTable *ht);
+void generate_ngrams_range(const char *text, int start, int end, HashTable *ht);
+void generate_ngrams_parallel(const char *text, HashTable *ht, int num_threads);
+void merge_hash_table(HashTable *dst, HashTable *src, int bucket_start, int bucket_end);
+void run_parallel(void *(*fn)(void *), void *args, size_t stride, int count);
+int get_cpu_count(void);
+size_t normalize_block(const char *in, size_t len, char *out, size_t *consumed, int at_eof);
+size_t normalize_block_mapped(const char *in, size_t len, char *out, size_t *map, size_t *consumed, int at_eof);
+int intersect_batch(HashTable *ht, NGramNode *nodes[], int count);
+int get_intersection_count_range(HashTable *ht1, HashTable *ht2, int bucket_start, int bucket_end);
+unsigned int hash_gram(const char *gram, int table_size);
+void addhash_batch(HashTable *ht, const char *const grams[], int count);
+void probe_batch(HashTable *ht, const char *const grams[], int count, NGramNode *results[]);
+void hash_gram_block(const char *text, int count, int table_size, unsigned int indices[]);
+void hash_key_block(const char *text, int count, unsigned long long keys[], unsigned int hashes[]);
+void djb2_block_scalar(const char *text, int count, unsigned int out[]);
+void key_block_scalar(const char *text, int count, unsigned long long keys[], unsigned int hashes[]);
+#ifdef HAVE_X86_SIMD
+// 只能在 __builtin_cpu_supports() 确认支持对应指令集后调用
+void djb2_block_avx2(const char *text, int count, unsigned int out[]);
+void djb2_block_avx512(const char *text, int count, unsigned int out[]);
+void key_block_avx2(const char *text, int count, unsigned long long keys[], unsigned int hashes[]);
+void key_block_avx512(const char *text, int count, unsigned long long keys[], unsigned int hashes[]);
+#endif
+void addhash_block(HashTable *ht, const char *text, int count);
+unsigned long long pack_gram(const char *gram);
+unsigned int gram_key_hash(unsigned long long key);
+size_t profile_memory(const PlagProfile *profile);
+int profile_threshold(const PlagProfile *a, const PlagProfile *b, float threshold);
+int profile_threshold_many(const PlagProfile *query, const PlagProfile *const profiles[], size_t count, float threshold,
+                           int above[], int num_threads);
+long long monotonic_ns(void);
+#ifndef _WIN32
+int pread_all(int fd, char *buffer, size_t offset, size_t *length);
+#endif
+long long threshold_need(long long total_a, long long total_b, float threshold);
+void init_threshold(ThresholdState *state, long long need, long long possible);
+void threshold_update(ThresholdState *state, long long found, long long checked);
+int threshold_outcome(ThresholdState *state);
+int threshold_intersection(HashTable *ht1, HashTable *ht2, ThresholdState *state);
+int hash_table_threshold(HashTable *ht_a, HashTable *ht_b, long long total_a, long long total_b, float threshold);
+size_t concurrent_table_capacity(long long expected_grams);
+ConcurrentTable *create_concurrent_table(long long expected_grams);
+void free_concurrent_table(ConcurrentTable *ct);
+size_t concurrent_table_bytes(const ConcurrentTable *ct);
+void concurrent_table_add(ConcurrentTable *ct, unsigned long long key, int count);
+void concurrent_table_add_hashed(ConcurrentTable *ct, unsigned long long key, unsigned int hash, int count);
+int concurrent_table_get(const ConcurrentTable *ct, unsigned long long key);
+void generate_ngrams_concurrent_range(const char *text, int start, int end, ConcurrentTable *ct);
+void generate_ngrams_concurrent(const char *text, ConcurrentTable *ct, int num_threads);
+void generate_ngrams_sampled_range(const char *text, int start, int end, ConcurrentTable *ct, unsigned int limit);
+void generate_ngrams_sampled(const char *text, ConcurrentTable *ct, int num_threads, unsigned int limit);
+long long concurrent_intersection_range(const ConcurrentTable *a, const ConcurrentTable *b, size_t slot_start, size_t slot_end);
+void concurrent_threshold_range(const ConcurrentTable *a, const ConcurrentTable *b, size_t slot_start, size_t slot_end,
+                                ThresholdState *state);
+int choose_partition_bits(long long total_grams);
+PartitionedGrams *scatter_grams(const char *text, int bits, int num_threads);
+void free_partitioned_grams(PartitionedGrams *pg);
+size_t partitioned_grams_bytes(const PartitionedGrams *pg);
+long long partitioned_intersection(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads);
+float partitioned_jaccard_similarity(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads);
+int partitioned_threshold(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads, float threshold);
+SimilarityEstimate anytime_jaccard_similarity(const PartitionedGrams *a, const PartitionedGrams *b, int num_threads, long long deadline);
+unsigned int sample_limit(double rate);
+ConcurrentTable *create_sample_table(long long positions, unsigned int limit);
+SimilarityEstimate sampled_jaccard_similarity(const ConcurrentTable *a, const ConcurrentTable *b, double rate);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif